@@ -0,0 +1,558 @@
+/*
+  Benchmark of the color quantization library ( see mkm.h ) over a set
+  of images and a matrix of settings. To compile:
+  g++ -O3 -pthread -o bench bench.c libmkm.c -lm
+
+  Every combination of { image } x { algorithm } x { # colors } x
+  { sampling rate } x { exponent } x { initializer } x { # threads } is quantized
+  <# warmup> times without being measured, then <# repetitions> times.
+  Each repetition clusters the image ( mkm_cluster ) and maps it to the
+  palette ( mkm_map ) with the same quantizer, as a long-running program
+  would. The sampling rate and the exponent only matter to Macqueen's
+  and the mini-batch algorithm, so Lloyd's algorithm ( accelerated or
+  not ) runs with the first of each only.
+
+  For each combination, one CSV line ( or JSON object ) gives the median
+  and the 95th percentile ( nearest rank ) over the repetitions of the
+  initialization, clustering and mapping times measured by the library
+  and of the total wall time of the repetition, all in ms, and the MSE.
+  The seed is the same in every repetition, so the MSE is too.
+
+  For a list of command line options: ./bench -h
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <climits>
+#include <cstdlib>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#if defined ( __unix__ ) || defined ( __APPLE__ )
+#define HAVE_POSIX
+#include <dirent.h>
+#endif
+
+#include "mkm.h"
+
+using namespace std::chrono;
+
+/* Exit with the library's message for STATUS unless it is MKM_OK */
+static void
+check_status ( const MKM_Status status )
+{
+ if ( status != MKM_OK )
+  {
+   fprintf ( stderr, "%s!\n", mkm_status_string ( status ) );
+   exit ( EXIT_FAILURE );
+  }
+}
+
+static double
+elapsed_ms ( const high_resolution_clock::time_point start )
+{
+ return duration_cast<microseconds> ( high_resolution_clock::now ( ) - start ).count ( ) / 1e3;
+}
+
+/* Read a nonnegative integer from a PPM header, skipping white space and comments */
+static int
+read_header_int ( FILE *fp, int *value )
+{
+ int c;
+
+ for ( ; ; )
+  {
+   c = getc ( fp );
+   if ( c == '#' )
+    {
+     while ( c != '\n' && c != EOF )
+      {
+       c = getc ( fp );
+      }
+    }
+   else if ( c != ' ' && c != '\t' && c != '\r' && c != '\n' )
+    {
+     break;
+    }
+  }
+
+ if ( c < '0' || '9' < c )
+  {
+   return 0;
+  }
+
+ *value = 0;
+ while ( '0' <= c && c <= '9' )
+  {
+   if ( ( INT_MAX - ( c - '0' ) ) / 10 < *value )
+    {
+     return 0;
+    }
+
+   *value = 10 * *value + ( c - '0' );
+   c = getc ( fp );
+  }
+
+ return c != EOF;
+}
+
+/* Read a binary ( P6 ) PPM image into IMG; the pixels must be freed by the caller */
+static void
+read_PPM ( const char *filename, MKM_Image *img )
+{
+ int width, height, max_rgb_val;
+ size_t num_bytes;
+ uint8_t *pixels;
+ FILE *fp;
+
+ fp = fopen ( filename, "rb" );
+ if ( !fp )
+  {
+   fprintf ( stderr, "Unable to open file '%s'!\n", filename );
+   exit ( EXIT_FAILURE );
+  }
+
+ if ( getc ( fp ) != 'P' || getc ( fp ) != '6' ||
+      !read_header_int ( fp, &width ) || !read_header_int ( fp, &height ) ||
+      !read_header_int ( fp, &max_rgb_val ) || width < 1 || height < 1 ||
+      INT_MAX / width < height || max_rgb_val != 255 )
+  {
+   fprintf ( stderr, "'%s' is not a 24-bit binary PPM image!\n", filename );
+   exit ( EXIT_FAILURE );
+  }
+
+ num_bytes = 3 * ( size_t ) width * height;
+ pixels = ( uint8_t * ) malloc ( num_bytes );
+ if ( !pixels )
+  {
+   fprintf ( stderr, "Unable to allocate memory!\n" );
+   exit ( EXIT_FAILURE );
+  }
+
+ if ( fread ( pixels, 1, num_bytes, fp ) != num_bytes )
+  {
+   fprintf ( stderr, "Truncated pixel data ('%s')!\n", filename );
+   exit ( EXIT_FAILURE );
+  }
+
+ fclose ( fp );
+
+ img->pixels = pixels;
+ img->width = width;
+ img->height = height;
+ img->stride = 3 * ( size_t ) width;
+}
+
+/*
+   The images named by LIST: the .ppm files of a directory, in name
+   order, or a comma-separated list of files
+ */
+static void
+list_images ( const char *list, std::vector<std::string> *names )
+{
+ size_t len;
+
+ #ifdef HAVE_POSIX
+ DIR *dir;
+ struct dirent *entry;
+
+ dir = opendir ( list );
+ if ( dir )
+  {
+   while ( ( entry = readdir ( dir ) ) )
+    {
+     len = strlen ( entry->d_name );
+     if ( 4 < len && !strcmp ( entry->d_name + len - 4, ".ppm" ) )
+      {
+       names->push_back ( std::string ( list ) + "/" + entry->d_name );
+      }
+    }
+
+   closedir ( dir );
+   std::sort ( names->begin ( ), names->end ( ) );
+   return;
+  }
+ #endif
+
+ while ( *list )
+  {
+   len = strcspn ( list, "," );
+   if ( len )
+    {
+     names->push_back ( std::string ( list, len ) );
+    }
+
+   list += len + ( list[len] == ',' );
+  }
+}
+
+/* Parse a comma-separated list of numbers in [MIN_VAL, MAX_VAL]; false if any is invalid */
+static bool
+parse_list ( const char *list, const double min_val, const double max_val,
+	     std::vector<double> *values )
+{
+ char *end;
+ double value;
+
+ values->clear ( );
+ for ( ; ; )
+  {
+   value = strtod ( list, &end );
+   if ( end == list || value < min_val || max_val < value )
+    {
+     return false;
+    }
+
+   values->push_back ( value );
+   if ( *end != ',' )
+    {
+     return *end == '\0';
+    }
+
+   list = end + 1;
+  }
+}
+
+typedef struct
+ {
+  double median;
+  double p95;
+ } Summary;
+
+/* Median and 95th percentile ( nearest rank ) of the NUM_VALS values in VALS, which get sorted */
+static Summary
+summarize ( double *vals, const int num_vals )
+{
+ Summary summary;
+
+ std::sort ( vals, vals + num_vals );
+ summary.median = num_vals % 2 ? vals[num_vals / 2] :
+		  0.5 * ( vals[num_vals / 2 - 1] + vals[num_vals / 2] );
+ summary.p95 = vals[( int ) ceil ( 0.95 * num_vals ) - 1];
+
+ return summary;
+}
+
+/* The phases reported for each combination */
+#define NUM_PHASES 4
+
+static const char *phase_names[NUM_PHASES] = { "init", "cluster", "map", "total" };
+
+/*
+   Quantize IMG REPS times after WARMUP unmeasured runs with QUANTIZER,
+   mapping into OUT; the measurements of each phase go to the summaries
+   and the MSE to *MSE
+ */
+static void
+bench_one ( MKM_Quantizer *quantizer, const MKM_Image *img, MKM_Output *out,
+	    const int warmup, const int reps, Summary summary[NUM_PHASES], double *mse )
+{
+ MKM_Stats stats;
+ std::vector<double> times[NUM_PHASES];
+
+ for ( int r = -warmup; r < reps; r++ )
+  {
+   auto start = high_resolution_clock::now ( );
+
+   check_status ( mkm_cluster ( quantizer, img ) );
+   check_status ( mkm_map ( quantizer, NULL, 0, img->height, out ) );
+
+   double total = elapsed_ms ( start );
+
+   if ( r < 0 )
+    {
+     continue;
+    }
+
+   mkm_get_stats ( quantizer, &stats );
+   times[0].push_back ( stats.hist_time + stats.init_time );
+   times[1].push_back ( stats.cluster_time );
+   times[2].push_back ( stats.map_time );
+   times[3].push_back ( total );
+   *mse = ( double ) stats.sse / stats.num_mapped;
+  }
+
+ for ( int p = 0; p < NUM_PHASES; p++ )
+  {
+   summary[p] = summarize ( times[p].data ( ), reps );
+  }
+}
+
+static void
+print_usage ( char *prog_name )
+{
+ fprintf ( stderr, "Benchmark of Color Quantization Using Macqueen's K-Means Algorithm\n\n" );
+ fprintf ( stderr, "Usage: %s -i <images> -a <algorithms> -n <# colors> -s <sampling rates> -e <exponents> -I <initializers> -J <init sampling rate> -j <# threads> -p <presentation order> -d <seed> -t <# iters> -y <tolerance> -u <histogram> -w <# warmup> -r <# repetitions> -f <output format> -o <output file>\n\n", prog_name );
+ fprintf ( stderr, "The options that take lists take comma-separated values, e.g. -n 16,64,256; all of them are optional\n\n" );
+ fprintf ( stderr, "-i <images>: a directory whose .ppm files are taken, or a list of binary ppm images (default = images)\n\n" );
+ fprintf ( stderr, "-a <algorithms>: list of clustering algorithms (0: Macqueen, 1: Lloyd, 2: Lloyd accelerated with Hamerly's bounds, 3: mini-batch k-means; default = 0)\n\n" );
+ fprintf ( stderr, "-n <# colors>: list of # colors (integers in [2, 65536]; default = 256)\n\n" );
+ fprintf ( stderr, "-s <sampling rates>: list of sampling rates for Macqueen's and the mini-batch algorithm (in (0, 1]; default = 1.0)\n\n" );
+ fprintf ( stderr, "-e <exponents>: list of learning rate exponents for Macqueen's and the mini-batch algorithm (in [0.5, 1]; default = 0.5)\n\n" );
+ fprintf ( stderr, "-I <initializers>: list of initializers (0: maximin, 1: maximin on a quasirandom sample, 2: median cut, 3: Wu's variance-based splitting; default = 0)\n\n" );
+ fprintf ( stderr, "-J <init sampling rate>: sampling rate for initializer 1 (in (0, 1]; default = 0.05)\n\n" );
+ fprintf ( stderr, "-j <# threads>: list of # threads (positive integers; default = 1)\n\n" );
+ fprintf ( stderr, "-p <presentation order>: presentation order for Macqueen's and the mini-batch algorithm (0: quasirandom, 1: pseudorandom; default = 0)\n\n" );
+ fprintf ( stderr, "-d <seed>: seed for the pseudorandom presentation order (nonnegative integer; default = 0)\n\n" );
+ fprintf ( stderr, "-t <# iters>: max. # iterations for Lloyd's algorithm, accelerated or not (positive integer; default = %d)\n\n", INT_MAX );
+ fprintf ( stderr, "-y <tolerance>: relative objective tolerance for Lloyd's algorithm, accelerated or not (in [0, 1); default = 0)\n\n" );
+ fprintf ( stderr, "-u <histogram>: run Lloyd's algorithm, accelerated or not, on the distinct colors (0: no, 1: yes; default = 0)\n\n" );
+ fprintf ( stderr, "-w <# warmup>: # unmeasured runs before the measured ones (nonnegative integer; default = 1)\n\n" );
+ fprintf ( stderr, "-r <# repetitions>: # measured runs (positive integer; default = 5)\n\n" );
+ fprintf ( stderr, "-f <output format>: 0: CSV, 1: JSON (default = 0)\n\n" );
+ fprintf ( stderr, "-o <output file>: where the results go (default = standard output)\n\n" );
+
+ exit ( EXIT_FAILURE );
+}
+
+int
+main ( int argc, char **argv )
+{
+ const char *image_list = "images";
+ const char *out_file_name = NULL;
+ int warmup = 1;
+ int reps = 5;
+ int out_format = 0;
+ int num_rows = 0;
+ double mse = 0.0;
+ std::vector<double> algos ( 1, MKM_MACQUEEN ), colors ( 1, 256 ), rates ( 1, 1.0 );
+ std::vector<double> exps ( 1, 0.5 ), inits ( 1, MKM_INIT_MAXIMIN ), threads ( 1, 1 );
+ std::vector<std::string> names;
+ MKM_Options options;
+ MKM_Image img;
+ MKM_Output out;
+ MKM_Quantizer *quantizer;
+ Summary summary[NUM_PHASES];
+ FILE *out_fp = stdout;
+
+ mkm_default_options ( &options );
+
+ for ( int i = 1; i < argc; i++ )
+  {
+   const char *arg = i + 1 < argc ? argv[i + 1] : "";
+   bool valid = true;
+
+   if ( !strcmp ( argv[i], "-i" ) )
+    {
+     image_list = arg;
+    }
+   else if ( !strcmp ( argv[i], "-a" ) )
+    {
+     valid = parse_list ( arg, MKM_MACQUEEN, MKM_MINIBATCH, &algos );
+    }
+   else if ( !strcmp ( argv[i], "-n" ) )
+    {
+     valid = parse_list ( arg, 2, MKM_MAX_COLORS, &colors );
+    }
+   else if ( !strcmp ( argv[i], "-s" ) )
+    {
+     valid = parse_list ( arg, DBL_MIN, 1.0, &rates );
+    }
+   else if ( !strcmp ( argv[i], "-e" ) )
+    {
+     valid = parse_list ( arg, 0.5, 1.0, &exps );
+    }
+   else if ( !strcmp ( argv[i], "-I" ) )
+    {
+     valid = parse_list ( arg, MKM_INIT_MAXIMIN, MKM_INIT_WU, &inits );
+    }
+   else if ( !strcmp ( argv[i], "-J" ) )
+    {
+     options.init_rate = atof ( arg );
+    }
+   else if ( !strcmp ( argv[i], "-j" ) )
+    {
+     valid = parse_list ( arg, 1, INT_MAX, &threads );
+    }
+   else if ( !strcmp ( argv[i], "-p" ) )
+    {
+     options.pres_order = atoi ( arg );
+    }
+   else if ( !strcmp ( argv[i], "-d" ) )
+    {
+     options.seed = atol ( arg );
+    }
+   else if ( !strcmp ( argv[i], "-t" ) )
+    {
+     options.max_iters = atoi ( arg );
+    }
+   else if ( !strcmp ( argv[i], "-y" ) )
+    {
+     options.tolerance = atof ( arg );
+    }
+   else if ( !strcmp ( argv[i], "-u" ) )
+    {
+     options.use_hist = atoi ( arg );
+    }
+   else if ( !strcmp ( argv[i], "-w" ) )
+    {
+     warmup = atoi ( arg );
+     valid = 0 <= warmup;
+    }
+   else if ( !strcmp ( argv[i], "-r" ) )
+    {
+     reps = atoi ( arg );
+     valid = 1 <= reps;
+    }
+   else if ( !strcmp ( argv[i], "-f" ) )
+    {
+     out_format = atoi ( arg );
+     valid = out_format == 0 || out_format == 1;
+    }
+   else if ( !strcmp ( argv[i], "-o" ) )
+    {
+     out_file_name = arg;
+    }
+   else
+    {
+     valid = false;
+    }
+
+   if ( !valid || argc <= i + 1 )
+    {
+     print_usage ( argv[0] );
+    }
+
+   i++;
+  }
+
+ list_images ( image_list, &names );
+ if ( names.empty ( ) )
+  {
+   fprintf ( stderr, "No images in '%s'!\n", image_list );
+   exit ( EXIT_FAILURE );
+  }
+
+ if ( out_file_name )
+  {
+   out_fp = fopen ( out_file_name, "w" );
+   if ( !out_fp )
+    {
+     fprintf ( stderr, "Unable to open file '%s'!\n", out_file_name );
+     exit ( EXIT_FAILURE );
+    }
+  }
+
+ if ( out_format == 0 )
+  {
+   fprintf ( out_fp, "image,width,height,algorithm,colors,sample_rate,exponent,init,threads,reps" );
+   for ( int p = 0; p < NUM_PHASES; p++ )
+    {
+     fprintf ( out_fp, ",%s_median,%s_p95", phase_names[p], phase_names[p] );
+    }
+
+   fprintf ( out_fp, ",mse\n" );
+  }
+ else
+  {
+   fprintf ( out_fp, "[" );
+  }
+
+ for ( size_t m = 0; m < names.size ( ); m++ )
+  {
+   read_PPM ( names[m].c_str ( ), &img );
+
+   out.rgb = ( uint8_t * ) malloc ( 3 * ( size_t ) img.width * img.height );
+   out.rgb_stride = img.stride;
+   out.indices = NULL;
+   out.index_size = 0;
+   out.index_stride = 0;
+   if ( !out.rgb )
+    {
+     fprintf ( stderr, "Unable to allocate memory!\n" );
+     exit ( EXIT_FAILURE );
+    }
+
+   for ( double algo : algos )
+    {
+     /* Lloyd's algorithm ignores the sampling rate and the exponent */
+     const bool online = algo == MKM_MACQUEEN || algo == MKM_MINIBATCH;
+     const size_t num_rates = online ? rates.size ( ) : 1;
+     const size_t num_exps = online ? exps.size ( ) : 1;
+
+     for ( double num_colors : colors )
+      {
+       for ( size_t s = 0; s < num_rates; s++ )
+	{
+	 for ( size_t e = 0; e < num_exps; e++ )
+	  {
+	   for ( double init : inits )
+	    {
+	     for ( double num_threads : threads )
+	      {
+	       options.algorithm = algo;
+	       options.num_colors = num_colors;
+	       options.init = init;
+	       options.sample_rate = rates[s];
+	       options.lr_exp = exps[e];
+	       options.num_threads = num_threads;
+
+	       if ( mkm_create ( &options, &quantizer ) == MKM_ERROR_ARGUMENT )
+		{
+		 print_usage ( argv[0] );
+		}
+
+	       fprintf ( stderr, "%s: algorithm %d, %d colors, sampling rate %g, exponent %g, initializer %d, %d threads\n",
+			 names[m].c_str ( ), options.algorithm, options.num_colors,
+			 options.sample_rate, options.lr_exp, options.init, options.num_threads );
+
+	       bench_one ( quantizer, &img, &out, warmup, reps, summary, &mse );
+	       mkm_destroy ( quantizer );
+
+	       if ( out_format == 0 )
+		{
+		 fprintf ( out_fp, "%s,%d,%d,%d,%d,%g,%g,%d,%d,%d", names[m].c_str ( ), img.width,
+			   img.height, options.algorithm, options.num_colors, options.sample_rate,
+			   options.lr_exp, options.init, options.num_threads, reps );
+		 for ( int p = 0; p < NUM_PHASES; p++ )
+		  {
+		   fprintf ( out_fp, ",%.3f,%.3f", summary[p].median, summary[p].p95 );
+		  }
+
+		 fprintf ( out_fp, ",%.4f\n", mse );
+		}
+	       else
+		{
+		 fprintf ( out_fp, "%s\n {\"image\": \"%s\", \"width\": %d, \"height\": %d, \"algorithm\": %d, \"colors\": %d, \"sample_rate\": %g, \"exponent\": %g, \"init\": %d, \"threads\": %d, \"reps\": %d",
+			   num_rows ? "," : "", names[m].c_str ( ), img.width, img.height,
+			   options.algorithm, options.num_colors, options.sample_rate,
+			   options.lr_exp, options.init, options.num_threads, reps );
+		 for ( int p = 0; p < NUM_PHASES; p++ )
+		  {
+		   fprintf ( out_fp, ", \"%s_median\": %.3f, \"%s_p95\": %.3f",
+			     phase_names[p], summary[p].median, phase_names[p], summary[p].p95 );
+		  }
+
+		 fprintf ( out_fp, ", \"mse\": %.4f}", mse );
+		}
+
+	       fflush ( out_fp );
+	       num_rows++;
+	      }
+	    }
+	  }
+	}
+      }
+    }
+
+   free ( out.rgb );
+   free ( ( void * ) img.pixels );
+  }
+
+ if ( out_format == 1 )
+  {
+   fprintf ( out_fp, "\n]\n" );
+  }
+
+ if ( out_fp != stdout && fclose ( out_fp ) )
+  {
+   perror ( out_file_name );
+   exit ( EXIT_FAILURE );
+  }
+
+ return EXIT_SUCCESS;
+}
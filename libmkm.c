@@ -0,0 +1,4561 @@
+/* 
+  Color quantization library ( see mkm.h for the interface ). To build 
+  the mkm program with it:
+  g++ -O3 -pthread -o mkm mkm.c libmkm.c -lm
+
+  To verify the vectorized nearest-center kernels against the scalar ones 
+  on every call ( slow ): add -DCHECK_KERNELS. test_kernels.c tests them 
+  on their own.
+ */
+
+/* BEGIN: Copyright notice for the Mersenne Twister implementation */
+
+/* 
+   A C-program for MT19937, with initialization improved 2002/1/26.
+   Coded by Takuji Nishimura and Makoto Matsumoto.
+
+   Before using, initialize the state by using init_genrand(seed)  
+   or init_by_array(init_key, key_length).
+
+   Copyright (C) 1997 - 2002, Makoto Matsumoto and Takuji Nishimura,
+   All rights reserved.                          
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+     1. Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+
+     2. Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+
+     3. The names of its contributors may not be used to endorse or promote 
+        products derived from this software without specific prior written 
+        permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+   Any feedback is very welcome.
+   http://www.math.sci.hiroshima-u.ac.jp/~m-mat/MT/emt.html
+   email: m-mat @ math.sci.hiroshima-u.ac.jp (remove space)
+*/
+
+/* END: Copyright notice for the Mersenne Twister implementation */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cfloat>
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <math.h>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* Start loading *ADDR into the cache ( a hint only ) */
+#if defined ( __GNUC__ )
+#define PREFETCH( addr ) __builtin_prefetch ( addr )
+#else
+#define PREFETCH( addr )
+#endif
+
+#include "mkm.h"
+
+using namespace std::chrono;
+
+typedef unsigned char uchar;
+typedef unsigned long ulong;
+
+typedef struct 
+ {
+  double red, green, blue;
+ } RGB_Pixel;
+
+/* 
+   Pixel as stored in the image ( same layout as the P6 payload ). Only the 
+   cluster centers and the mean are kept in floating point.
+ */
+typedef struct 
+ {
+  uchar red, green, blue;
+ } RGB_Pixel8;
+
+typedef struct 
+ {
+  int size;
+  RGB_Pixel center;
+ } RGB_Cluster;
+
+typedef struct 
+ {
+  int width, height;
+  int size;
+  RGB_Pixel8 *data;
+ } RGB_Image;
+
+/* Maximum possible RGB distance = 3 * 255 * 255 */
+#define MAX_RGB_DIST 195075 
+
+/* Mersenne Twister related constants */
+#define N 624
+#define M 397
+#define MATRIX_A 0x9908b0dfUL   /* constant vector a */
+#define UPPER_MASK 0x80000000UL /* most significant w-r bits */
+#define LOWER_MASK 0x7fffffffUL /* least significant r bits */
+
+#define MAXBIT 30
+
+/* 
+   State of a Mersenne Twister generator. Each run owns one, so that 
+   independent runs can proceed concurrently.
+ */
+
+typedef struct
+ {
+  ulong mt[N]; /* the array for the state vector  */
+  int mti;     /* mti == N + 1 means mt[N] is not initialized */
+ } MT_State;
+
+/* initializes mt[N] with a seed */
+static void 
+init_genrand ( MT_State *state, ulong s )
+{
+ ulong *mt = state->mt;
+ int mti;
+
+ mt[0]= s & 0xffffffffUL;
+ for ( mti = 1; mti < N; mti++ ) 
+  {
+   mt[mti] = 
+	     ( 1812433253UL * ( mt[mti - 1] ^ ( mt[mti - 1] >> 30 ) ) + mti ); 
+   /* See Knuth TAOCP Vol2. 3rd Ed. P.106 for multiplier. */
+   /* In the previous versions, MSBs of the seed affect   */
+   /* only MSBs of the array mt[].                        */
+   /* 2002/01/09 modified by Makoto Matsumoto             */
+   mt[mti] &= 0xffffffffUL;
+   /* for >32 bit machines */
+  }
+
+ state->mti = mti;
+}
+
+static ulong 
+genrand_int32 ( MT_State *state )
+{
+ ulong y;
+ ulong *mt = state->mt;
+ static const ulong mag01[2] = { 0x0UL, MATRIX_A };
+ /* mag01[x] = x * MATRIX_A  for x = 0, 1 */
+
+ if ( state->mti >= N ) 
+  { /* generate N words at one time */
+   int kk;
+
+   if ( state->mti == N + 1 ) 
+    {
+     /* if init_genrand ( ) has not been called, */
+     init_genrand ( state, 5489UL ); /* a default initial seed is used */
+    }
+
+   for ( kk = 0; kk < N - M; kk++ ) 
+    {
+     y = ( mt[kk] & UPPER_MASK )|( mt[kk + 1] & LOWER_MASK );
+     mt[kk] = mt[kk+M] ^ ( y >> 1 ) ^ mag01[y & 0x1UL];
+    }
+   
+   for ( ; kk < N - 1; kk++ ) 
+    {
+     y = ( mt[kk] & UPPER_MASK )|( mt[kk + 1] & LOWER_MASK );
+     mt[kk] = mt[kk + ( M - N )] ^ ( y >> 1 ) ^ mag01[y & 0x1UL];
+    }
+    
+   y = ( mt[N - 1] & UPPER_MASK )|( mt[0] & LOWER_MASK );
+   mt[N - 1] = mt[M - 1] ^ ( y >> 1 ) ^ mag01[y & 0x1UL];
+   state->mti = 0;
+  }
+  
+ y = mt[state->mti++];
+
+ /* Tempering */
+ y ^= ( y >> 11 );
+ y ^= ( y << 7 ) & 0x9d2c5680UL;
+ y ^= ( y << 15 ) & 0xefc60000UL;
+ y ^= ( y >> 18 );
+
+ return y;
+}
+
+static double 
+genrand_real2 ( MT_State *state )
+{
+ return genrand_int32 ( state ) * ( 1.0 / 4294967296.0 );
+ /* divided by 2^32 */
+}
+
+/* Function for generating a bounded random integer between 0 and RANGE */
+/* Source: http://www.pcg-random.org/posts/bounded-rands.html */
+
+static uint32_t 
+bounded_rand ( MT_State *state, const uint32_t range ) 
+{
+ uint32_t x = genrand_int32 ( state );  
+ uint64_t m = ( ( uint64_t ) x ) * ( ( uint64_t ) range );
+ uint32_t l = ( uint32_t ) m;
+
+ if ( l < range ) 
+ {
+  uint32_t t = -range;
+
+  if ( t >= range ) 
+   {
+    t -= range;
+    if ( t >= range ) 
+     {
+      t %= range;
+     }
+   }
+  
+  while ( l < t ) 
+   {
+    x = genrand_int32 ( state );  
+    m = ( ( uint64_t ) x ) * ( ( uint64_t ) range );
+    l = ( uint32_t ) m;
+   }
+ }
+ 
+ return m >> 32;
+}
+
+/* 
+  Returns two quasirandom numbers from a 2D Sobol
+  sequence. Adapted from Numerical Recipies in C. 
+  The direction numbers are shared by all generators 
+  and computed once; the position in the sequence is 
+  kept in a per-generator Sobol_State, which sob_skip 
+  can move to any index, so that a sequence can be 
+  split among threads or resumed. With MAXBIT-bit 
+  integers the sequence has 2^MAXBIT pairs, and there 
+  are direction numbers for no more; indices wrap 
+  around modulo 2^MAXBIT ( e.g. for the mini-batch 
+  algorithm, whose # samples is not bounded ).
+ */
+
+#define SOB_PERIOD ( 1UL << MAXBIT )
+
+typedef struct
+ {
+  ulong in;       /* # numbers generated so far */
+  ulong ix1, ix2; /* last pair of integers */
+ } Sobol_State;
+
+static int
+sob_init_directions ( ulong *iv )
+{
+ int j, k, l;
+ ulong i, ipp;
+ ulong *iu[2 * MAXBIT + 1];
+ const ulong mdeg[3] = { 0, 1, 2 };
+ const ulong ip[3] = { 0, 0, 1 };
+
+ for ( j = 1, k = 0; j <= MAXBIT; j++, k += 2 ) 
+  { 
+   iu[j] = &iv[k]; 
+  }
+  
+ for ( k = 1; k <= 2; k++ ) 
+  {
+   for ( j = 1; j <= ( int ) mdeg[k]; j++ ) 
+    { 
+     iu[j][k] <<= ( MAXBIT - j ); 
+    }
+
+   for ( j = mdeg[k] + 1; j <= MAXBIT; j++ ) 
+    {
+     ipp = ip[k];
+     i = iu[j - mdeg[k]][k];
+     i ^= ( i >> mdeg[k] );
+
+     for ( l = mdeg[k] - 1; l >= 1; l-- )
+      {
+       if ( ipp & 1 ) 
+	{ 
+	 i ^= iu[j - l][k]; 
+	} 
+
+       ipp >>= 1;
+      }
+
+     iu[j][k] = i;
+    }
+  }
+
+ return 1;
+}
+
+/* Direction numbers, initialized the first time they are needed */
+static const ulong *
+sob_directions ( void )
+{
+ static ulong iv[2 * MAXBIT + 1] =
+     { 0, 1, 1, 1, 1, 1, 1, 3, 1, 3, 3, 1, 1, 5, 7, 7, 3, 3, 5, 15, 11, 5, 15, 13, 9 };
+ static const int init = sob_init_directions ( iv );
+
+ ( void ) init;
+ return iv;
+}
+
+static void
+sob_init ( Sobol_State *state )
+{
+ state->in = 0;
+ state->ix1 = state->ix2 = 0;
+}
+
+static void 
+sob_seq ( Sobol_State *state, double *x, double *y ) 
+{
+ int j;
+ ulong im;
+ const ulong *iv = sob_directions ( );
+ const double fac = 1.0 / ( 1L << MAXBIT );
+
+ /* Now calculate the next pair of numbers in the 2-D Sobol sequence */
+
+ im = state->in;
+ for ( j = 1; j <= MAXBIT; j++ ) 
+  {
+   if ( !( im & 1 ) ) 
+    { 
+     break; 
+    }
+
+   im >>= 1;
+  }
+
+ /* Index 2^MAXBIT wraps around to 0 */
+ if ( MAXBIT < j )
+  {
+   state->in = state->ix1 = state->ix2 = 0;
+   *x = *y = 0.0;
+   return;
+  }
+
+ im = ( j - 1 ) * 2;
+ *x = ( state->ix1 ^= iv[im + 1] ) * fac;
+ *y = ( state->ix2 ^= iv[im + 2] ) * fac;
+ 
+ state->in++;
+
+ /* X and Y will fall in [0,1] */
+}
+
+/* 
+  Move STATE to index N ( the next sob_seq returns the N + 1-th pair ). 
+  Stepping flips the bit of the Gray code n ^ ( n >> 1 ) that changes, 
+  so the integers after N steps are the XOR of the direction numbers 
+  of the bits set in the Gray code of N ( modulo SOB_PERIOD ).
+ */
+
+static void
+sob_skip ( Sobol_State *state, ulong n )
+{
+ ulong gray;
+ const ulong *iv = sob_directions ( );
+
+ n %= SOB_PERIOD;
+ gray = n ^ ( n >> 1 );
+ state->in = n;
+ state->ix1 = state->ix2 = 0;
+ for ( int j = 0; gray; j++, gray >>= 1 ) 
+  {
+   if ( gray & 1 ) 
+    { 
+     state->ix1 ^= iv[2 * j + 1];
+     state->ix2 ^= iv[2 * j + 2];
+    }
+  }
+}
+
+/* 
+   Sum the R, G, B components separately. The sums are exact integers, so 
+   the mean is the same as that of a pixel-by-pixel loop in double. On x86, 
+   16 pixels ( three 16-byte vectors ) are summed at a time: every byte 
+   position in the block belongs to a fixed channel, so masking the 
+   vectors per channel and adding the bytes with PSADBW gives the sums.
+ */
+static void
+sum_channels ( const RGB_Pixel8 *pixels, const int num_pixels, uint64_t sum[3] )
+{
+ int i = 0;
+ const uchar *bytes = ( const uchar * ) pixels;
+
+ sum[0] = sum[1] = sum[2] = 0;
+
+ #ifdef HAVE_X86_KERNELS
+ uchar mask_bytes[3][48];
+ __m128i mask[3][3], acc[3], block;
+
+ for ( int c = 0; c < 3; c++ )
+  {
+   for ( int k = 0; k < 48; k++ )
+    {
+     mask_bytes[c][k] = k % 3 == c ? 0xFF : 0;
+    }
+
+   for ( int v = 0; v < 3; v++ )
+    {
+     mask[c][v] = _mm_loadu_si128 ( ( const __m128i * ) &mask_bytes[c][16 * v] );
+    }
+
+   acc[c] = _mm_setzero_si128 ( );
+  }
+
+ for ( ; i + 16 <= num_pixels; i += 16 )
+  {
+   for ( int v = 0; v < 3; v++ )
+    {
+     block = _mm_loadu_si128 ( ( const __m128i * ) ( bytes + 3 * i + 16 * v ) );
+     for ( int c = 0; c < 3; c++ )
+      {
+       acc[c] = _mm_add_epi64 ( acc[c], _mm_sad_epu8 ( _mm_and_si128 ( block, mask[c][v] ), 
+						       _mm_setzero_si128 ( ) ) );
+      }
+    }
+  }
+
+ for ( int c = 0; c < 3; c++ )
+  {
+   sum[c] = ( uint64_t ) _mm_cvtsi128_si64 ( acc[c] ) + 
+	    ( uint64_t ) _mm_cvtsi128_si64 ( _mm_unpackhi_epi64 ( acc[c], acc[c] ) );
+  }
+ #endif
+
+ for ( ; i < num_pixels; i++ )
+  {
+   sum[0] += pixels[i].red;
+   sum[1] += pixels[i].green;
+   sum[2] += pixels[i].blue;
+  }
+}
+
+static double
+elapsed_ms ( const high_resolution_clock::time_point start )
+{
+ return duration_cast<microseconds> ( high_resolution_clock::now ( ) - start ).count ( ) / 1e3;
+}
+
+/* 
+   Working memory. An arena hands out blocks from one buffer and takes 
+   them all back at once with arena_reset. A block that does not fit in 
+   the buffer is allocated separately, and the next reset replaces the 
+   buffer with one large enough for everything handed out since the 
+   previous reset, so an arena stops allocating once it has served its 
+   largest request. The blocks are aligned for the vector kernels. 
+   Allocation failures throw std::bad_alloc, which the library functions 
+   turn into MKM_ERROR_MEMORY.
+ */
+
+#define ARENA_ALIGN 64
+
+typedef struct
+ {
+  char *base;
+  size_t size;                 /* bytes in BASE */
+  size_t used;                 /* bytes of BASE handed out */
+  size_t needed;               /* bytes handed out since the last reset */
+  std::vector<void *> extra;   /* blocks that did not fit in BASE */
+ } Arena;
+
+static void
+arena_init ( Arena *arena )
+{
+ arena->base = NULL;
+ arena->size = arena->used = arena->needed = 0;
+}
+
+static void *
+arena_alloc ( Arena *arena, size_t num_bytes )
+{
+ void *block;
+
+ num_bytes = ( num_bytes + ARENA_ALIGN - 1 ) / ARENA_ALIGN * ARENA_ALIGN;
+ if ( num_bytes == 0 )
+  {
+   num_bytes = ARENA_ALIGN;
+  }
+
+ arena->needed += num_bytes;
+ if ( num_bytes <= arena->size - arena->used )
+  {
+   block = arena->base + arena->used;
+   arena->used += num_bytes;
+   return block;
+  }
+
+ block = aligned_alloc ( ARENA_ALIGN, num_bytes );
+ if ( !block )
+  {
+   throw std::bad_alloc ( );
+  }
+
+ arena->extra.push_back ( block );
+
+ return block;
+}
+
+static void
+arena_free_extra ( Arena *arena )
+{
+ for ( void *block : arena->extra )
+  {
+   free ( block );
+  }
+
+ arena->extra.clear ( );
+}
+
+static void
+arena_reset ( Arena *arena )
+{
+ size_t needed = arena->needed;
+
+ arena->used = arena->needed = 0;
+ if ( arena->extra.empty ( ) )
+  {
+   return;
+  }
+
+ /* Grow the buffer to hold everything at once next time */
+ arena_free_extra ( arena );
+ free ( arena->base );
+ arena->size = 0;
+ arena->base = ( char * ) aligned_alloc ( ARENA_ALIGN, needed );
+ if ( !arena->base )
+  {
+   throw std::bad_alloc ( );
+  }
+
+ arena->size = needed;
+}
+
+static void
+arena_free ( Arena *arena )
+{
+ arena_free_extra ( arena );
+ free ( arena->base );
+ arena_init ( arena );
+}
+
+/* 
+   A persistent pool of worker threads. pool_run splits a job into 
+   NUM_TASKS tasks, which the workers and the calling thread take in turn 
+   until none is left, and returns when all of them are done. Each task 
+   writes only its own part of the output ( or its own partial result, 
+   combined afterwards in task order ), so the results do not depend on 
+   which thread ran which task. A NULL pool runs every task on the 
+   calling thread.
+ */
+
+typedef void ( *Task_Func ) ( void *arg, const int task );
+
+typedef struct
+ {
+  int num_threads;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable work_cv, done_cv;
+  Task_Func func;
+  void *arg;
+  int num_tasks;
+  std::atomic<int> next_task;
+  int num_busy;            /* # workers that have not finished the current job */
+  unsigned long job_id;    /* incremented for every job */
+  bool stop;
+ } Thread_Pool;
+
+static void
+pool_take_tasks ( Thread_Pool *pool )
+{
+ int task;
+
+ while ( ( task = pool->next_task.fetch_add ( 1 ) ) < pool->num_tasks )
+  {
+   pool->func ( pool->arg, task );
+  }
+}
+
+static void
+pool_worker ( Thread_Pool *pool )
+{
+ unsigned long last_job_id = 0;
+
+ for ( ; ; )
+  {
+   {
+    std::unique_lock<std::mutex> lock ( pool->mutex );
+    pool->work_cv.wait ( lock, [&] { return pool->stop || pool->job_id != last_job_id; } );
+    if ( pool->stop )
+     {
+      return;
+     }
+
+    last_job_id = pool->job_id;
+   }
+
+   pool_take_tasks ( pool );
+
+   {
+    std::lock_guard<std::mutex> lock ( pool->mutex );
+    if ( --pool->num_busy == 0 )
+     {
+      pool->done_cv.notify_one ( );
+     }
+   }
+  }
+}
+
+static void
+pool_destroy ( Thread_Pool *pool )
+{
+ if ( !pool )
+  {
+   return;
+  }
+
+ {
+  std::lock_guard<std::mutex> lock ( pool->mutex );
+  pool->stop = true;
+ }
+
+ pool->work_cv.notify_all ( );
+ for ( auto &worker : pool->workers )
+  {
+   worker.join ( );
+  }
+
+ delete pool;
+}
+
+static Thread_Pool *
+pool_create ( const int num_threads )
+{
+ Thread_Pool *pool = new Thread_Pool;
+
+ pool->num_threads = num_threads;
+ pool->num_tasks = 0;
+ pool->next_task = 0;
+ pool->num_busy = 0;
+ pool->job_id = 0;
+ pool->stop = false;
+
+ /* The calling thread is the last of the NUM_THREADS threads */
+ try
+  {
+   for ( int t = 1; t < num_threads; t++ )
+    {
+     pool->workers.emplace_back ( pool_worker, pool );
+    }
+  }
+ catch ( ... )
+  {
+   pool_destroy ( pool );
+   throw;
+  }
+
+ return pool;
+}
+
+static void
+pool_run ( Thread_Pool *pool, Task_Func func, void *arg, const int num_tasks )
+{
+ if ( !pool || pool->workers.empty ( ) )
+  {
+   for ( int task = 0; task < num_tasks; task++ )
+    {
+     func ( arg, task );
+    }
+
+   return;
+  }
+
+ {
+  std::lock_guard<std::mutex> lock ( pool->mutex );
+  pool->func = func;
+  pool->arg = arg;
+  pool->num_tasks = num_tasks;
+  pool->next_task = 0;
+  pool->num_busy = pool->workers.size ( );
+  pool->job_id++;
+ }
+
+ pool->work_cv.notify_all ( );
+ pool_take_tasks ( pool );
+
+ std::unique_lock<std::mutex> lock ( pool->mutex );
+ pool->done_cv.wait ( lock, [&] { return pool->num_busy == 0; } );
+}
+
+static inline int
+pool_num_threads ( const Thread_Pool *pool )
+{
+ return pool ? pool->num_threads : 1;
+}
+
+/* Tasks per thread, so that uneven tasks still keep every thread busy */
+#define TASKS_PER_THREAD 4
+
+/* Number of tasks to split NUM_ITEMS items into */
+static inline int
+pool_num_tasks ( const Thread_Pool *pool, const int num_items )
+{
+ int num_tasks = pool ? TASKS_PER_THREAD * pool->num_threads : 1;
+
+ return num_items < num_tasks ? ( num_items < 1 ? 1 : num_items ) : num_tasks;
+}
+
+/* Range [*BEGIN, *END) of the NUM_ITEMS items handled by TASK */
+static inline void
+task_range ( const int task, const int num_tasks, const int num_items, int *begin, int *end )
+{
+ *begin = ( int ) ( ( long long ) num_items * task / num_tasks );
+ *end = ( int ) ( ( long long ) num_items * ( task + 1 ) / num_tasks );
+}
+
+/* 
+   Nearest-center kernels shared by maximin, Macqueen, Lloyd ( plain and 
+   accelerated ) and the mapping pass. The centers are mirrored in a 
+   structure-of-arrays layout padded to a multiple of SOA_PAD with 
+   far-away dummy centers, so that the vector loops need no remainder 
+   handling. The kernels work in double precision and compute the 
+   distances with the same sequence of operations as the scalar code ( no 
+   fused multiply-adds, even where the target has them, e.g. with 
+   -march=native: GCC may not contract them in this section ). Ties go to 
+   the smaller index, so every kernel returns exactly what the scalar one 
+   returns. The best kernel supported by the CPU is chosen at run time; 
+   setting the environment variable MKM_SIMD to "scalar", "sse4", "avx2" 
+   or "avx512" caps the choice. Compiling with -DCHECK_KERNELS compares 
+   every vector result against the scalar kernel.
+
+   The vector nearest-center kernels are templates on the padded # 
+   centers ( 0 = read it from the Center_SoA ), instantiated for the 
+   common palette sizes so that their loops have a fixed trip count; 
+   nearest_kernel picks one per clustering. The instantiations get the 
+   diagnostic settings in force at the template, so the AVX-512 ones 
+   share the exemption from GCC's false uninitialized warnings.
+ */
+
+#if defined ( __GNUC__ ) && !defined ( __clang__ )
+#pragma GCC push_options
+#pragma GCC optimize ( "fp-contract=off" )
+#endif
+
+#define SOA_PAD 16
+
+/* Padded # centers of the fixed-size kernels: SOA_PAD << 0, ..., SOA_PAD << ( NUM_FIXED - 1 ) */
+#define NUM_FIXED 5
+
+#define SOA_DUMMY 1e30
+
+typedef struct
+ {
+  int num_colors; /* # real centers */
+  int num_padded; /* NUM_COLORS rounded up to a multiple of SOA_PAD */
+  double *red, *green, *blue;
+ } Center_SoA;
+
+static void
+soa_init ( Center_SoA *soa, const RGB_Cluster *clusters, const int num_colors, Arena *arena )
+{
+ size_t num_bytes;
+
+ soa->num_colors = num_colors;
+ soa->num_padded = ( num_colors + SOA_PAD - 1 ) / SOA_PAD * SOA_PAD;
+ num_bytes = soa->num_padded * sizeof ( double );
+ soa->red = ( double * ) arena_alloc ( arena, num_bytes );
+ soa->green = ( double * ) arena_alloc ( arena, num_bytes );
+ soa->blue = ( double * ) arena_alloc ( arena, num_bytes );
+
+ for ( int j = num_colors; j < soa->num_padded; j++ )
+  {
+   soa->red[j] = soa->green[j] = soa->blue[j] = SOA_DUMMY;
+  }
+
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   soa->red[j] = clusters[j].center.red;
+   soa->green[j] = clusters[j].center.green;
+   soa->blue[j] = clusters[j].center.blue;
+  }
+}
+
+static inline void
+soa_set ( Center_SoA *soa, const int index, const RGB_Pixel *center )
+{
+ soa->red[index] = center->red;
+ soa->green[index] = center->green;
+ soa->blue[index] = center->blue;
+}
+
+
+/* Returns the index of the center nearest to PIXEL and its distance */
+typedef int ( *NN_Nearest ) ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist );
+
+/* 
+   NN_Nearest that also gives the distance to the second nearest center 
+   ( equal to MIN_DIST on ties ); needs at least 2 centers
+ */
+typedef int ( *NN_Nearest2 ) ( const Center_SoA *soa, const RGB_Pixel8 *pixel, 
+			       double *min_dist, double *min_dist2 );
+
+typedef struct
+ {
+  const char *name;
+
+  NN_Nearest nearest;
+
+  NN_Nearest2 nearest2;
+
+  /* 
+     One pass of maximin: lowers NC_DIST to the distance to CENTER where 
+     necessary and returns the index of the largest NC_DIST ( the first 
+     one in case of ties ) along with its value.
+   */
+  int ( *maximin_pass ) ( const RGB_Pixel8 *pixels, const int num_pixels, 
+			  const RGB_Pixel *center, double *nc_dist, double *max_dist );
+
+  /* 
+     # colors from which the pruned search in Macqueen's algorithm beats 
+     a full scan with this kernel ( measured on the bundled images with 
+     up to 4096 colors; MKM_Options.use_prune overrides it )
+   */
+  int prune_min_colors;
+
+  /* NEAREST for exactly SOA_PAD << B padded centers */
+  NN_Nearest nearest_fixed[NUM_FIXED];
+
+  /* 
+     # colors up to which the scalar kernel beats this one in Macqueen's 
+     algorithm, where each search waits for the previous update; the 
+     branches of the scalar loop are predicted, the vector reductions 
+     are not ( measured like PRUNE_MIN_COLORS ). NEAREST2 crosses over 
+     at about the same size in the rescans of Hamerly's bounds.
+   */
+  int scalar_max_colors;
+ } NN_Kernels;
+
+static int
+nearest_scalar ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist )
+{
+ int min_dist_index = 0;
+ double delta_red, delta_green, delta_blue, dist;
+
+ *min_dist = DBL_MAX;
+ for ( int j = 0; j < soa->num_colors; j++ )
+  {
+   delta_red = pixel->red - soa->red[j];
+   delta_green = pixel->green - soa->green[j];
+   delta_blue = pixel->blue - soa->blue[j];
+   dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+
+   if ( dist < *min_dist )
+    {
+     *min_dist = dist;
+     min_dist_index = j;
+    }
+  }
+
+ return min_dist_index;
+}
+
+static int
+nearest2_scalar ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist, double *min_dist2 )
+{
+ int min_dist_index = 0;
+ double delta_red, delta_green, delta_blue, dist;
+
+ *min_dist = *min_dist2 = DBL_MAX;
+ for ( int j = 0; j < soa->num_colors; j++ )
+  {
+   delta_red = pixel->red - soa->red[j];
+   delta_green = pixel->green - soa->green[j];
+   delta_blue = pixel->blue - soa->blue[j];
+   dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+
+   if ( dist < *min_dist )
+    {
+     *min_dist2 = *min_dist;
+     *min_dist = dist;
+     min_dist_index = j;
+    }
+   else if ( dist < *min_dist2 )
+    {
+     *min_dist2 = dist;
+    }
+  }
+
+ return min_dist_index;
+}
+
+static int
+maximin_pass_scalar ( const RGB_Pixel8 *pixels, const int num_pixels, 
+		      const RGB_Pixel *center, double *nc_dist, double *max_dist )
+{
+ int max_dist_index = 0;
+ double delta_red, delta_green, delta_blue, dist;
+
+ *max_dist = -MAX_RGB_DIST;
+ for ( int j = 0; j < num_pixels; j++ )
+  {
+   delta_red = pixels[j].red - center->red;
+   delta_green = pixels[j].green - center->green;
+   delta_blue = pixels[j].blue - center->blue;
+   dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+
+   if ( dist < nc_dist[j] )
+    {
+     nc_dist[j] = dist;
+    }
+
+   if ( *max_dist < nc_dist[j] )
+    {
+     *max_dist = nc_dist[j];
+     max_dist_index = j;
+    }
+  }
+
+ return max_dist_index;
+}
+
+/* Reduce per-lane minima ( or maxima ) and their indices, favoring the smaller index on ties */
+static int
+reduce_lanes ( const double *dist, const double *index, const int num_lanes, 
+	       const int find_max, double *best_dist )
+{
+ int best = 0;
+
+ for ( int l = 1; l < num_lanes; l++ )
+  {
+   if ( ( find_max ? dist[best] < dist[l] : dist[l] < dist[best] ) || 
+	( dist[l] == dist[best] && index[l] < index[best] ) )
+    {
+     best = l;
+    }
+  }
+
+ *best_dist = dist[best];
+
+ return ( int ) index[best];
+}
+
+/* 
+   reduce_lanes for the minima and second minima of the lanes: the second 
+   nearest is the nearest of the other lanes or the second of the best one
+ */
+static int
+reduce_lanes2 ( const double *dist, const double *index, const double *dist2, const int num_lanes, 
+		double *min_dist, double *min_dist2 )
+{
+ const int min_dist_index = reduce_lanes ( dist, index, num_lanes, 0, min_dist );
+
+ *min_dist2 = DBL_MAX;
+ for ( int l = 0; l < num_lanes; l++ )
+  {
+   if ( index[l] == min_dist_index && dist[l] == *min_dist )
+    {
+     *min_dist2 = std::min ( *min_dist2, dist2[l] );
+    }
+   else
+    {
+     *min_dist2 = std::min ( *min_dist2, dist[l] );
+    }
+  }
+
+ return min_dist_index;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* 
+   Unpack 4 consecutive pixels into 32-bit lanes, one register per channel. 
+   Reads 16 bytes, so at least 6 pixels must remain in the buffer.
+ */
+
+__attribute__ ( ( target ( "sse4.1" ) ) )
+static inline void
+unpack4 ( const RGB_Pixel8 *pixels, __m128i *red, __m128i *green, __m128i *blue )
+{
+ const __m128i raw = _mm_loadu_si128 ( ( const __m128i * ) pixels );
+
+ *red = _mm_shuffle_epi8 ( raw, _mm_setr_epi8 ( 0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1 ) );
+ *green = _mm_shuffle_epi8 ( raw, _mm_setr_epi8 ( 1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1 ) );
+ *blue = _mm_shuffle_epi8 ( raw, _mm_setr_epi8 ( 2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1 ) );
+}
+
+/* 
+   Scalar maximin update for the pixels left over by the vector loops. 
+   Kept out of line: inlined into a kernel built for AVX-512, whose target 
+   includes FMA, its multiplies and adds would be fused, and the distances 
+   would no longer match those of maximin_pass_scalar to the last bit.
+ */
+__attribute__ ( ( noinline ) )
+static int
+maximin_tail ( const RGB_Pixel8 *pixels, int j, const int num_pixels, const RGB_Pixel *center, 
+	       double *nc_dist, int max_dist_index, double *max_dist )
+{
+ double delta_red, delta_green, delta_blue, dist;
+
+ for ( ; j < num_pixels; j++ )
+  {
+   delta_red = pixels[j].red - center->red;
+   delta_green = pixels[j].green - center->green;
+   delta_blue = pixels[j].blue - center->blue;
+   dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+
+   if ( dist < nc_dist[j] )
+    {
+     nc_dist[j] = dist;
+    }
+
+   if ( *max_dist < nc_dist[j] )
+    {
+     *max_dist = nc_dist[j];
+     max_dist_index = j;
+    }
+  }
+
+ return max_dist_index;
+}
+
+/* SSE4.1: 2 doubles per register */
+
+__attribute__ ( ( target ( "sse4.1" ) ) )
+static inline __m128d
+dist_sse4 ( const __m128d red1, const __m128d green1, const __m128d blue1, 
+	    const __m128d red2, const __m128d green2, const __m128d blue2 )
+{
+ const __m128d delta_red = _mm_sub_pd ( red1, red2 );
+ const __m128d delta_green = _mm_sub_pd ( green1, green2 );
+ const __m128d delta_blue = _mm_sub_pd ( blue1, blue2 );
+
+ return _mm_add_pd ( _mm_add_pd ( _mm_mul_pd ( delta_red, delta_red ), 
+				  _mm_mul_pd ( delta_green, delta_green ) ), 
+		     _mm_mul_pd ( delta_blue, delta_blue ) );
+}
+
+template <int NUM_PADDED>
+__attribute__ ( ( target ( "sse4.1" ) ) )
+static int
+nearest_sse4 ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist )
+{
+ const int num_padded = NUM_PADDED ? NUM_PADDED : soa->num_padded;
+ const __m128d red = _mm_set1_pd ( pixel->red );
+ const __m128d green = _mm_set1_pd ( pixel->green );
+ const __m128d blue = _mm_set1_pd ( pixel->blue );
+ __m128d best[4], best_index[4], index[4], dist, mask;
+ double lane_dist[8], lane_index[8];
+
+ for ( int k = 0; k < 4; k++ )
+  {
+   best[k] = _mm_set1_pd ( DBL_MAX );
+   best_index[k] = _mm_setzero_pd ( );
+   index[k] = _mm_setr_pd ( 2 * k, 2 * k + 1 );
+  }
+
+ for ( int j = 0; j < num_padded; j += 8 )
+  {
+   for ( int k = 0; k < 4; k++ )
+    {
+     dist = dist_sse4 ( red, green, blue, _mm_load_pd ( soa->red + j + 2 * k ), 
+			_mm_load_pd ( soa->green + j + 2 * k ), _mm_load_pd ( soa->blue + j + 2 * k ) );
+     mask = _mm_cmplt_pd ( dist, best[k] );
+     best[k] = _mm_blendv_pd ( best[k], dist, mask );
+     best_index[k] = _mm_blendv_pd ( best_index[k], index[k], mask );
+     index[k] = _mm_add_pd ( index[k], _mm_set1_pd ( 8.0 ) );
+    }
+  }
+
+ for ( int k = 0; k < 4; k++ )
+  {
+   _mm_storeu_pd ( lane_dist + 2 * k, best[k] );
+   _mm_storeu_pd ( lane_index + 2 * k, best_index[k] );
+  }
+
+ return reduce_lanes ( lane_dist, lane_index, 8, 0, min_dist );
+}
+
+/* 
+   A lane's second nearest center is the nearer of its old second and the 
+   farther of its old nearest and the new center
+ */
+
+__attribute__ ( ( target ( "sse4.1" ) ) )
+static int
+nearest2_sse4 ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist, double *min_dist2 )
+{
+ const __m128d red = _mm_set1_pd ( pixel->red );
+ const __m128d green = _mm_set1_pd ( pixel->green );
+ const __m128d blue = _mm_set1_pd ( pixel->blue );
+ __m128d best[4], best_index[4], second[4], index[4], dist, mask;
+ double lane_dist[8], lane_index[8], lane_dist2[8];
+
+ for ( int k = 0; k < 4; k++ )
+  {
+   best[k] = second[k] = _mm_set1_pd ( DBL_MAX );
+   best_index[k] = _mm_setzero_pd ( );
+   index[k] = _mm_setr_pd ( 2 * k, 2 * k + 1 );
+  }
+
+ for ( int j = 0; j < soa->num_padded; j += 8 )
+  {
+   for ( int k = 0; k < 4; k++ )
+    {
+     dist = dist_sse4 ( red, green, blue, _mm_load_pd ( soa->red + j + 2 * k ), 
+			_mm_load_pd ( soa->green + j + 2 * k ), _mm_load_pd ( soa->blue + j + 2 * k ) );
+     second[k] = _mm_min_pd ( second[k], _mm_max_pd ( best[k], dist ) );
+     mask = _mm_cmplt_pd ( dist, best[k] );
+     best[k] = _mm_blendv_pd ( best[k], dist, mask );
+     best_index[k] = _mm_blendv_pd ( best_index[k], index[k], mask );
+     index[k] = _mm_add_pd ( index[k], _mm_set1_pd ( 8.0 ) );
+    }
+  }
+
+ for ( int k = 0; k < 4; k++ )
+  {
+   _mm_storeu_pd ( lane_dist + 2 * k, best[k] );
+   _mm_storeu_pd ( lane_index + 2 * k, best_index[k] );
+   _mm_storeu_pd ( lane_dist2 + 2 * k, second[k] );
+  }
+
+ return reduce_lanes2 ( lane_dist, lane_index, lane_dist2, 8, min_dist, min_dist2 );
+}
+
+__attribute__ ( ( target ( "sse4.1" ) ) )
+static int
+maximin_pass_sse4 ( const RGB_Pixel8 *pixels, const int num_pixels, 
+		    const RGB_Pixel *center, double *nc_dist, double *max_dist )
+{
+ int j, max_dist_index;
+ const __m128d c_red = _mm_set1_pd ( center->red );
+ const __m128d c_green = _mm_set1_pd ( center->green );
+ const __m128d c_blue = _mm_set1_pd ( center->blue );
+ __m128i red, green, blue;
+ __m128d best[2], best_index[2], index[2], nc, mask;
+ double lane_dist[4], lane_index[4];
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   best[k] = _mm_set1_pd ( -MAX_RGB_DIST );
+   best_index[k] = _mm_setzero_pd ( );
+   index[k] = _mm_setr_pd ( 2 * k, 2 * k + 1 );
+  }
+
+ for ( j = 0; j + 6 <= num_pixels; j += 4 )
+  {
+   unpack4 ( pixels + j, &red, &green, &blue );
+
+   for ( int k = 0; k < 2; k++ )
+    {
+     nc = dist_sse4 ( _mm_cvtepi32_pd ( red ), _mm_cvtepi32_pd ( green ), _mm_cvtepi32_pd ( blue ), 
+		      c_red, c_green, c_blue );
+     nc = _mm_min_pd ( nc, _mm_loadu_pd ( nc_dist + j + 2 * k ) );
+     _mm_storeu_pd ( nc_dist + j + 2 * k, nc );
+
+     mask = _mm_cmplt_pd ( best[k], nc );
+     best[k] = _mm_blendv_pd ( best[k], nc, mask );
+     best_index[k] = _mm_blendv_pd ( best_index[k], index[k], mask );
+     index[k] = _mm_add_pd ( index[k], _mm_set1_pd ( 4.0 ) );
+
+     red = _mm_srli_si128 ( red, 8 );
+     green = _mm_srli_si128 ( green, 8 );
+     blue = _mm_srli_si128 ( blue, 8 );
+    }
+  }
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   _mm_storeu_pd ( lane_dist + 2 * k, best[k] );
+   _mm_storeu_pd ( lane_index + 2 * k, best_index[k] );
+  }
+
+ max_dist_index = reduce_lanes ( lane_dist, lane_index, 4, 1, max_dist );
+
+ return maximin_tail ( pixels, j, num_pixels, center, nc_dist, max_dist_index, max_dist );
+}
+
+/* AVX2: 4 doubles per register */
+
+__attribute__ ( ( target ( "avx2" ) ) )
+static inline __m256d
+dist_avx2 ( const __m256d red1, const __m256d green1, const __m256d blue1, 
+	    const __m256d red2, const __m256d green2, const __m256d blue2 )
+{
+ const __m256d delta_red = _mm256_sub_pd ( red1, red2 );
+ const __m256d delta_green = _mm256_sub_pd ( green1, green2 );
+ const __m256d delta_blue = _mm256_sub_pd ( blue1, blue2 );
+
+ return _mm256_add_pd ( _mm256_add_pd ( _mm256_mul_pd ( delta_red, delta_red ), 
+					_mm256_mul_pd ( delta_green, delta_green ) ), 
+			_mm256_mul_pd ( delta_blue, delta_blue ) );
+}
+
+template <int NUM_PADDED>
+__attribute__ ( ( target ( "avx2" ) ) )
+static int
+nearest_avx2 ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist )
+{
+ const int num_padded = NUM_PADDED ? NUM_PADDED : soa->num_padded;
+ const __m256d red = _mm256_set1_pd ( pixel->red );
+ const __m256d green = _mm256_set1_pd ( pixel->green );
+ const __m256d blue = _mm256_set1_pd ( pixel->blue );
+ __m256d best[2], best_index[2], index[2], dist, mask;
+ double lane_dist[8], lane_index[8];
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   best[k] = _mm256_set1_pd ( DBL_MAX );
+   best_index[k] = _mm256_setzero_pd ( );
+   index[k] = _mm256_setr_pd ( 4 * k, 4 * k + 1, 4 * k + 2, 4 * k + 3 );
+  }
+
+ for ( int j = 0; j < num_padded; j += 8 )
+  {
+   for ( int k = 0; k < 2; k++ )
+    {
+     dist = dist_avx2 ( red, green, blue, _mm256_load_pd ( soa->red + j + 4 * k ), 
+			_mm256_load_pd ( soa->green + j + 4 * k ), _mm256_load_pd ( soa->blue + j + 4 * k ) );
+     mask = _mm256_cmp_pd ( dist, best[k], _CMP_LT_OQ );
+     best[k] = _mm256_blendv_pd ( best[k], dist, mask );
+     best_index[k] = _mm256_blendv_pd ( best_index[k], index[k], mask );
+     index[k] = _mm256_add_pd ( index[k], _mm256_set1_pd ( 8.0 ) );
+    }
+  }
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   _mm256_storeu_pd ( lane_dist + 4 * k, best[k] );
+   _mm256_storeu_pd ( lane_index + 4 * k, best_index[k] );
+  }
+
+ return reduce_lanes ( lane_dist, lane_index, 8, 0, min_dist );
+}
+
+__attribute__ ( ( target ( "avx2" ) ) )
+static int
+nearest2_avx2 ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist, double *min_dist2 )
+{
+ const __m256d red = _mm256_set1_pd ( pixel->red );
+ const __m256d green = _mm256_set1_pd ( pixel->green );
+ const __m256d blue = _mm256_set1_pd ( pixel->blue );
+ __m256d best[2], best_index[2], second[2], index[2], dist, mask;
+ double lane_dist[8], lane_index[8], lane_dist2[8];
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   best[k] = second[k] = _mm256_set1_pd ( DBL_MAX );
+   best_index[k] = _mm256_setzero_pd ( );
+   index[k] = _mm256_setr_pd ( 4 * k, 4 * k + 1, 4 * k + 2, 4 * k + 3 );
+  }
+
+ for ( int j = 0; j < soa->num_padded; j += 8 )
+  {
+   for ( int k = 0; k < 2; k++ )
+    {
+     dist = dist_avx2 ( red, green, blue, _mm256_load_pd ( soa->red + j + 4 * k ), 
+			_mm256_load_pd ( soa->green + j + 4 * k ), _mm256_load_pd ( soa->blue + j + 4 * k ) );
+     second[k] = _mm256_min_pd ( second[k], _mm256_max_pd ( best[k], dist ) );
+     mask = _mm256_cmp_pd ( dist, best[k], _CMP_LT_OQ );
+     best[k] = _mm256_blendv_pd ( best[k], dist, mask );
+     best_index[k] = _mm256_blendv_pd ( best_index[k], index[k], mask );
+     index[k] = _mm256_add_pd ( index[k], _mm256_set1_pd ( 8.0 ) );
+    }
+  }
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   _mm256_storeu_pd ( lane_dist + 4 * k, best[k] );
+   _mm256_storeu_pd ( lane_index + 4 * k, best_index[k] );
+   _mm256_storeu_pd ( lane_dist2 + 4 * k, second[k] );
+  }
+
+ return reduce_lanes2 ( lane_dist, lane_index, lane_dist2, 8, min_dist, min_dist2 );
+}
+
+__attribute__ ( ( target ( "avx2" ) ) )
+static int
+maximin_pass_avx2 ( const RGB_Pixel8 *pixels, const int num_pixels, 
+		    const RGB_Pixel *center, double *nc_dist, double *max_dist )
+{
+ int j, max_dist_index;
+ const __m256d c_red = _mm256_set1_pd ( center->red );
+ const __m256d c_green = _mm256_set1_pd ( center->green );
+ const __m256d c_blue = _mm256_set1_pd ( center->blue );
+ __m128i red, green, blue;
+ __m256d best, best_index, index, nc, mask;
+ double lane_dist[4], lane_index[4];
+
+ best = _mm256_set1_pd ( -MAX_RGB_DIST );
+ best_index = _mm256_setzero_pd ( );
+ index = _mm256_setr_pd ( 0.0, 1.0, 2.0, 3.0 );
+
+ for ( j = 0; j + 6 <= num_pixels; j += 4 )
+  {
+   unpack4 ( pixels + j, &red, &green, &blue );
+
+   nc = dist_avx2 ( _mm256_cvtepi32_pd ( red ), _mm256_cvtepi32_pd ( green ), _mm256_cvtepi32_pd ( blue ), 
+		    c_red, c_green, c_blue );
+   nc = _mm256_min_pd ( nc, _mm256_loadu_pd ( nc_dist + j ) );
+   _mm256_storeu_pd ( nc_dist + j, nc );
+
+   mask = _mm256_cmp_pd ( best, nc, _CMP_LT_OQ );
+   best = _mm256_blendv_pd ( best, nc, mask );
+   best_index = _mm256_blendv_pd ( best_index, index, mask );
+   index = _mm256_add_pd ( index, _mm256_set1_pd ( 4.0 ) );
+  }
+
+ _mm256_storeu_pd ( lane_dist, best );
+ _mm256_storeu_pd ( lane_index, best_index );
+
+ max_dist_index = reduce_lanes ( lane_dist, lane_index, 4, 1, max_dist );
+
+ return maximin_tail ( pixels, j, num_pixels, center, nc_dist, max_dist_index, max_dist );
+}
+
+/* 
+   AVX-512: 8 doubles per register. The rounding-mode variants of the 
+   arithmetic intrinsics keep the compiler from fusing the multiplies and 
+   adds, which AVX-512F would otherwise allow.
+ */
+
+#define AVX512_ROUND ( _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC )
+
+/* 
+   GCC's avx512fintrin.h builds some results from an uninitialized 
+   __m512d ( __Y ) that the instruction overwrites, which -Wall reports 
+   once the intrinsics are inlined here; the warnings are false positives.
+ */
+#if defined ( __GNUC__ ) && !defined ( __clang__ )
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__ ( ( target ( "avx512f" ) ) )
+static inline __m512d
+dist_avx512 ( const __m512d red1, const __m512d green1, const __m512d blue1, 
+	      const __m512d red2, const __m512d green2, const __m512d blue2 )
+{
+ const __m512d delta_red = _mm512_sub_round_pd ( red1, red2, AVX512_ROUND );
+ const __m512d delta_green = _mm512_sub_round_pd ( green1, green2, AVX512_ROUND );
+ const __m512d delta_blue = _mm512_sub_round_pd ( blue1, blue2, AVX512_ROUND );
+
+ return _mm512_add_round_pd ( _mm512_add_round_pd ( _mm512_mul_round_pd ( delta_red, delta_red, AVX512_ROUND ), 
+						    _mm512_mul_round_pd ( delta_green, delta_green, AVX512_ROUND ), 
+						    AVX512_ROUND ), 
+			      _mm512_mul_round_pd ( delta_blue, delta_blue, AVX512_ROUND ), 
+			      AVX512_ROUND );
+}
+
+template <int NUM_PADDED>
+__attribute__ ( ( target ( "avx512f" ) ) )
+static int
+nearest_avx512 ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist )
+{
+ const int num_padded = NUM_PADDED ? NUM_PADDED : soa->num_padded;
+ const __m512d red = _mm512_set1_pd ( pixel->red );
+ const __m512d green = _mm512_set1_pd ( pixel->green );
+ const __m512d blue = _mm512_set1_pd ( pixel->blue );
+ __m512d best[2], best_index[2], index[2], dist;
+ __mmask8 mask;
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   best[k] = _mm512_set1_pd ( DBL_MAX );
+   best_index[k] = _mm512_setzero_pd ( );
+   index[k] = _mm512_setr_pd ( 8 * k, 8 * k + 1, 8 * k + 2, 8 * k + 3, 
+			       8 * k + 4, 8 * k + 5, 8 * k + 6, 8 * k + 7 );
+  }
+
+ for ( int j = 0; j < num_padded; j += 16 )
+  {
+   for ( int k = 0; k < 2; k++ )
+    {
+     dist = dist_avx512 ( red, green, blue, _mm512_load_pd ( soa->red + j + 8 * k ), 
+			  _mm512_load_pd ( soa->green + j + 8 * k ), _mm512_load_pd ( soa->blue + j + 8 * k ) );
+     mask = _mm512_cmp_pd_mask ( dist, best[k], _CMP_LT_OQ );
+     best[k] = _mm512_mask_blend_pd ( mask, best[k], dist );
+     best_index[k] = _mm512_mask_blend_pd ( mask, best_index[k], index[k] );
+     index[k] = _mm512_add_pd ( index[k], _mm512_set1_pd ( 16.0 ) );
+    }
+  }
+
+ /* 
+    Merge the two sets of lanes, then take the smallest index among the 
+    lanes holding the minimum, as reduce_lanes does, without branches
+  */
+ mask = _mm512_cmp_pd_mask ( best[1], best[0], _CMP_LT_OQ ) | 
+	( _mm512_cmp_pd_mask ( best[1], best[0], _CMP_EQ_OQ ) & 
+	  _mm512_cmp_pd_mask ( best_index[1], best_index[0], _CMP_LT_OQ ) );
+ best[0] = _mm512_mask_blend_pd ( mask, best[0], best[1] );
+ best_index[0] = _mm512_mask_blend_pd ( mask, best_index[0], best_index[1] );
+
+ *min_dist = _mm512_reduce_min_pd ( best[0] );
+ mask = _mm512_cmp_pd_mask ( best[0], _mm512_set1_pd ( *min_dist ), _CMP_EQ_OQ );
+
+ return ( int ) _mm512_mask_reduce_min_pd ( mask, best_index[0] );
+}
+
+__attribute__ ( ( target ( "avx512f" ) ) )
+static int
+nearest2_avx512 ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist, double *min_dist2 )
+{
+ const __m512d red = _mm512_set1_pd ( pixel->red );
+ const __m512d green = _mm512_set1_pd ( pixel->green );
+ const __m512d blue = _mm512_set1_pd ( pixel->blue );
+ __m512d best[2], best_index[2], second[2], index[2], dist;
+ __mmask8 mask;
+ int min_dist_index;
+
+ for ( int k = 0; k < 2; k++ )
+  {
+   best[k] = second[k] = _mm512_set1_pd ( DBL_MAX );
+   best_index[k] = _mm512_setzero_pd ( );
+   index[k] = _mm512_setr_pd ( 8 * k, 8 * k + 1, 8 * k + 2, 8 * k + 3, 
+			       8 * k + 4, 8 * k + 5, 8 * k + 6, 8 * k + 7 );
+  }
+
+ for ( int j = 0; j < soa->num_padded; j += 16 )
+  {
+   for ( int k = 0; k < 2; k++ )
+    {
+     dist = dist_avx512 ( red, green, blue, _mm512_load_pd ( soa->red + j + 8 * k ), 
+			  _mm512_load_pd ( soa->green + j + 8 * k ), _mm512_load_pd ( soa->blue + j + 8 * k ) );
+     second[k] = _mm512_min_pd ( second[k], _mm512_max_pd ( best[k], dist ) );
+     mask = _mm512_cmp_pd_mask ( dist, best[k], _CMP_LT_OQ );
+     best[k] = _mm512_mask_blend_pd ( mask, best[k], dist );
+     best_index[k] = _mm512_mask_blend_pd ( mask, best_index[k], index[k] );
+     index[k] = _mm512_add_pd ( index[k], _mm512_set1_pd ( 16.0 ) );
+    }
+  }
+
+ /* Merge the two sets of lanes and reduce them as nearest_avx512 does */
+ second[0] = _mm512_min_pd ( _mm512_min_pd ( second[0], second[1] ), _mm512_max_pd ( best[0], best[1] ) );
+ mask = _mm512_cmp_pd_mask ( best[1], best[0], _CMP_LT_OQ ) | 
+	( _mm512_cmp_pd_mask ( best[1], best[0], _CMP_EQ_OQ ) & 
+	  _mm512_cmp_pd_mask ( best_index[1], best_index[0], _CMP_LT_OQ ) );
+ best[0] = _mm512_mask_blend_pd ( mask, best[0], best[1] );
+ best_index[0] = _mm512_mask_blend_pd ( mask, best_index[0], best_index[1] );
+
+ *min_dist = _mm512_reduce_min_pd ( best[0] );
+ mask = _mm512_cmp_pd_mask ( best[0], _mm512_set1_pd ( *min_dist ), _CMP_EQ_OQ );
+ min_dist_index = ( int ) _mm512_mask_reduce_min_pd ( mask, best_index[0] );
+
+ /* The second nearest: the nearest of the other lanes or the second of the best one */
+ mask = _mm512_cmp_pd_mask ( best_index[0], _mm512_set1_pd ( min_dist_index ), _CMP_NEQ_OQ );
+ *min_dist2 = std::min ( _mm512_reduce_min_pd ( second[0] ), _mm512_mask_reduce_min_pd ( mask, best[0] ) );
+
+ return min_dist_index;
+}
+
+__attribute__ ( ( target ( "avx512f" ) ) )
+static int
+maximin_pass_avx512 ( const RGB_Pixel8 *pixels, const int num_pixels, 
+		      const RGB_Pixel *center, double *nc_dist, double *max_dist )
+{
+ int j, max_dist_index;
+ const __m512d c_red = _mm512_set1_pd ( center->red );
+ const __m512d c_green = _mm512_set1_pd ( center->green );
+ const __m512d c_blue = _mm512_set1_pd ( center->blue );
+ __m128i red[2], green[2], blue[2];
+ __m512d best, best_index, index, nc;
+ __mmask8 mask;
+ double lane_dist[8], lane_index[8];
+
+ best = _mm512_set1_pd ( -MAX_RGB_DIST );
+ best_index = _mm512_setzero_pd ( );
+ index = _mm512_setr_pd ( 0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0 );
+
+ for ( j = 0; j + 10 <= num_pixels; j += 8 )
+  {
+   unpack4 ( pixels + j, &red[0], &green[0], &blue[0] );
+   unpack4 ( pixels + j + 4, &red[1], &green[1], &blue[1] );
+
+   nc = dist_avx512 ( _mm512_cvtepi32_pd ( _mm256_set_m128i ( red[1], red[0] ) ), 
+		      _mm512_cvtepi32_pd ( _mm256_set_m128i ( green[1], green[0] ) ), 
+		      _mm512_cvtepi32_pd ( _mm256_set_m128i ( blue[1], blue[0] ) ), 
+		      c_red, c_green, c_blue );
+   nc = _mm512_min_pd ( nc, _mm512_loadu_pd ( nc_dist + j ) );
+   _mm512_storeu_pd ( nc_dist + j, nc );
+
+   mask = _mm512_cmp_pd_mask ( best, nc, _CMP_LT_OQ );
+   best = _mm512_mask_blend_pd ( mask, best, nc );
+   best_index = _mm512_mask_blend_pd ( mask, best_index, index );
+   index = _mm512_add_pd ( index, _mm512_set1_pd ( 8.0 ) );
+  }
+
+ _mm512_storeu_pd ( lane_dist, best );
+ _mm512_storeu_pd ( lane_index, best_index );
+
+ max_dist_index = reduce_lanes ( lane_dist, lane_index, 8, 1, max_dist );
+
+ return maximin_tail ( pixels, j, num_pixels, center, nc_dist, max_dist_index, max_dist );
+}
+
+#if defined ( __GNUC__ ) && !defined ( __clang__ )
+#pragma GCC diagnostic pop
+#endif
+
+#endif /* HAVE_X86_KERNELS */
+
+#if defined ( __GNUC__ ) && !defined ( __clang__ )
+#pragma GCC pop_options
+#endif
+
+#define FIXED_KERNELS( f ) { f<SOA_PAD>, f<SOA_PAD << 1>, f<SOA_PAD << 2>, f<SOA_PAD << 3>, f<SOA_PAD << 4> }
+
+static const NN_Kernels kernel_table[] =
+ {
+  { "scalar", nearest_scalar, nearest2_scalar, maximin_pass_scalar, 32, 
+    { nearest_scalar, nearest_scalar, nearest_scalar, nearest_scalar, nearest_scalar }, 0 },
+  #ifdef HAVE_X86_KERNELS
+  { "sse4", nearest_sse4<0>, nearest2_sse4, maximin_pass_sse4, 128, FIXED_KERNELS ( nearest_sse4 ), 12 },
+  { "avx2", nearest_avx2<0>, nearest2_avx2, maximin_pass_avx2, 256, FIXED_KERNELS ( nearest_avx2 ), 12 },
+  { "avx512", nearest_avx512<0>, nearest2_avx512, maximin_pass_avx512, 1536, FIXED_KERNELS ( nearest_avx512 ), 12 },
+  #endif
+ };
+
+#ifdef CHECK_KERNELS
+
+static const NN_Kernels *checked_kernels;
+
+static int
+nearest_checked ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist )
+{
+ double ref_dist;
+ int index = checked_kernels->nearest ( soa, pixel, min_dist );
+ int ref_index = nearest_scalar ( soa, pixel, &ref_dist );
+
+ if ( index != ref_index || *min_dist != ref_dist )
+  {
+   fprintf ( stderr, "Kernel '%s' returned center %d ( %g ) instead of %d ( %g )!\n", 
+	     checked_kernels->name, index, *min_dist, ref_index, ref_dist );
+   abort ( );
+  }
+
+ return index;
+}
+
+template <int B>
+static int
+nearest_fixed_checked ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist )
+{
+ double ref_dist;
+ int index = checked_kernels->nearest_fixed[B] ( soa, pixel, min_dist );
+ int ref_index = nearest_scalar ( soa, pixel, &ref_dist );
+
+ if ( index != ref_index || *min_dist != ref_dist )
+  {
+   fprintf ( stderr, "Kernel '%s' ( %d centers ) returned center %d ( %g ) instead of %d ( %g )!\n", 
+	     checked_kernels->name, SOA_PAD << B, index, *min_dist, ref_index, ref_dist );
+   abort ( );
+  }
+
+ return index;
+}
+
+static int
+nearest2_checked ( const Center_SoA *soa, const RGB_Pixel8 *pixel, double *min_dist, double *min_dist2 )
+{
+ double ref_dist, ref_dist2;
+ int index = checked_kernels->nearest2 ( soa, pixel, min_dist, min_dist2 );
+ int ref_index = nearest2_scalar ( soa, pixel, &ref_dist, &ref_dist2 );
+
+ if ( index != ref_index || *min_dist != ref_dist || *min_dist2 != ref_dist2 )
+  {
+   fprintf ( stderr, "Kernel '%s' returned center %d ( %g, %g ) instead of %d ( %g, %g )!\n", 
+	     checked_kernels->name, index, *min_dist, *min_dist2, ref_index, ref_dist, ref_dist2 );
+   abort ( );
+  }
+
+ return index;
+}
+
+static int
+maximin_pass_checked ( const RGB_Pixel8 *pixels, const int num_pixels, 
+		       const RGB_Pixel *center, double *nc_dist, double *max_dist )
+{
+ double ref_max_dist;
+ double *ref_nc_dist = ( double * ) malloc ( num_pixels * sizeof ( double ) );
+ int index, ref_index;
+
+ memcpy ( ref_nc_dist, nc_dist, num_pixels * sizeof ( double ) );
+ index = checked_kernels->maximin_pass ( pixels, num_pixels, center, nc_dist, max_dist );
+ ref_index = maximin_pass_scalar ( pixels, num_pixels, center, ref_nc_dist, &ref_max_dist );
+
+ if ( index != ref_index || *max_dist != ref_max_dist || 
+      memcmp ( ref_nc_dist, nc_dist, num_pixels * sizeof ( double ) ) )
+  {
+   fprintf ( stderr, "Kernel '%s' returned pixel %d ( %g ) instead of %d ( %g )!\n", 
+	     checked_kernels->name, index, *max_dist, ref_index, ref_max_dist );
+   abort ( );
+  }
+
+ free ( ref_nc_dist );
+
+ return index;
+}
+
+#endif /* CHECK_KERNELS */
+
+/* Index in KERNEL_TABLE of the best kernels the CPU supports */
+static int
+cpu_kernel_level ( void )
+{
+ int level = 0;
+
+ #ifdef HAVE_X86_KERNELS
+ __builtin_cpu_init ( );
+ if ( __builtin_cpu_supports ( "sse4.1" ) )
+  {
+   level = 1;
+   if ( __builtin_cpu_supports ( "avx2" ) )
+    {
+     level = 2;
+     if ( __builtin_cpu_supports ( "avx512f" ) )
+      {
+       level = 3;
+      }
+    }
+  }
+ #endif
+
+ return level;
+}
+
+static const NN_Kernels *
+select_kernels ( void )
+{
+ int level = cpu_kernel_level ( );
+ const char *cap = getenv ( "MKM_SIMD" );
+ const int num_kernels = sizeof ( kernel_table ) / sizeof ( kernel_table[0] );
+
+ if ( cap )
+  {
+   for ( int k = 0; k < num_kernels; k++ )
+    {
+     if ( !strcmp ( cap, kernel_table[k].name ) && k < level )
+      {
+       level = k;
+      }
+    }
+  }
+
+ #ifdef CHECK_KERNELS
+ static NN_Kernels checked = { "checked", nearest_checked, nearest2_checked, maximin_pass_checked, 0, 
+			       { nearest_fixed_checked<0>, nearest_fixed_checked<1>, nearest_fixed_checked<2>, 
+				 nearest_fixed_checked<3>, nearest_fixed_checked<4> }, 0 };
+ checked_kernels = &kernel_table[level];
+ checked.prune_min_colors = checked_kernels->prune_min_colors;
+ checked.scalar_max_colors = checked_kernels->scalar_max_colors;
+ fprintf ( stderr, "Checking kernel '%s' against the scalar kernel\n", checked_kernels->name );
+ return &checked;
+ #else
+ return &kernel_table[level];
+ #endif
+}
+
+static const NN_Kernels *
+get_kernels ( void )
+{
+ static const NN_Kernels *kernels = select_kernels ( );
+
+ return kernels;
+}
+
+/* The fastest nearest-center kernel of KERNELS for NUM_COLORS centers in Macqueen's algorithm */
+static NN_Nearest
+nearest_kernel ( const NN_Kernels *kernels, const int num_colors )
+{
+ const int num_padded = ( num_colors + SOA_PAD - 1 ) / SOA_PAD * SOA_PAD;
+
+ if ( num_colors <= kernels->scalar_max_colors )
+  {
+   return nearest_scalar;
+  }
+
+ for ( int b = 0; b < NUM_FIXED; b++ )
+  {
+   if ( num_padded == SOA_PAD << b )
+    {
+     return kernels->nearest_fixed[b];
+    }
+  }
+
+ return kernels->nearest;
+}
+
+/* Maximin initialization method */
+/* 
+   For a comprehensive survey of k-means initialization methods, see
+   M. E. Celebi, H. Kingravi, and P. A. Vela, 
+   A Comparative Study of Efficient Initialization Methods for the K-Means Clustering Algorithm, 
+   Expert Systems with Applications, vol. 40, no. 1, pp. 200210, 2013.
+
+   Each pass is split into bands of pixels. Every task finds the first pixel 
+   with the maximum distance in its band, and the bands are then compared in 
+   order, keeping the earlier one on ties, so the chosen centers are the 
+   same as those of a single serial pass.
+ */
+
+typedef struct
+ {
+  const RGB_Image *img;
+  const RGB_Pixel *center;
+  const NN_Kernels *kernels;
+  double *nc_dist;
+  double *max_dist;     /* per task */
+  int *max_dist_index;  /* per task */
+  int num_tasks;
+ } Maximin_Job;
+
+static void
+maximin_task ( void *arg, const int task )
+{
+ int begin, end;
+ const Maximin_Job *job = ( const Maximin_Job * ) arg;
+
+ task_range ( task, job->num_tasks, job->img->size, &begin, &end );
+ job->max_dist_index[task] = begin + 
+  job->kernels->maximin_pass ( job->img->data + begin, end - begin, job->center, 
+			       job->nc_dist + begin, &job->max_dist[task] );
+}
+
+static void 
+maximin ( const RGB_Image *img, RGB_Cluster* clusters, const int num_colors, 
+	  const RGB_Pixel *mean, Thread_Pool *pool, Arena *arena )
+{
+ int i, j, t, max_dist_index = 0;
+ double max_dist;
+ double *nc_dist;
+ RGB_Pixel8 pixel;
+ RGB_Cluster *cluster;
+ Maximin_Job job;
+
+ nc_dist = ( double * ) arena_alloc ( arena, img->size * sizeof ( double ) );
+
+ job.img = img;
+ job.kernels = get_kernels ( );
+ job.nc_dist = nc_dist;
+ job.num_tasks = pool_num_tasks ( pool, img->size );
+ job.max_dist = ( double * ) arena_alloc ( arena, job.num_tasks * sizeof ( double ) );
+ job.max_dist_index = ( int * ) arena_alloc ( arena, job.num_tasks * sizeof ( int ) );
+
+ /* Initialize first center by the mean R, G, B color */
+ cluster = &clusters[0];
+ cluster->center.red = mean->red;
+ cluster->center.green = mean->green;
+ cluster->center.blue = mean->blue;
+ cluster->size = 1;
+
+ /* Initialize the nearest-center-distance for each pixel */
+ for ( j = 0; j < img->size; j++ )
+  {
+   nc_dist[j] = MAX_RGB_DIST;
+  }
+
+ /* Choose the remaining centers using maximin */
+ for ( i = 0 + 1; i < num_colors; i++ )
+  {
+   /* 
+      Update the nearest-center-distance of each pixel using the previously 
+      chosen center and find the pixel with the maximum such distance
+    */
+   job.center = &clusters[i - 1].center;
+   pool_run ( pool, maximin_task, &job, job.num_tasks );
+
+   max_dist = job.max_dist[0];
+   max_dist_index = job.max_dist_index[0];
+   for ( t = 1; t < job.num_tasks; t++ )
+    {
+     if ( max_dist < job.max_dist[t] )
+      {
+       max_dist = job.max_dist[t];
+       max_dist_index = job.max_dist_index[t];
+      }
+    }
+
+   /* Pixel with maximum distance to its nearest center is chosen as a center */
+   cluster = &clusters[i];
+   pixel = img->data[max_dist_index];
+   cluster->center.red = pixel.red;
+   cluster->center.green = pixel.green;
+   cluster->center.blue = pixel.blue;
+   cluster->size = 1;
+  }
+}
+
+/* 
+   Color histogram of an image: the distinct colors in the order of their 
+   first occurrence, the number of pixels having each color, and the index 
+   of each pixel's color. The colors are stored as an RGB_Image so that 
+   they can be passed directly to maximin and map_image. Since the colors 
+   keep the order of first occurrence, maximin picks the same centers on 
+   the histogram as it does on the full image.
+ */
+
+typedef struct
+ {
+  RGB_Image colors; /* distinct colors, one per "pixel" */
+  int *count;       /* # pixels having each color */
+  int *index;       /* index of each pixel's color in COLORS */
+ } Color_Hist;
+
+#define EMPTY_KEY 0xFFFFFFFFU
+
+static Color_Hist *
+build_hist ( const RGB_Image *img, Arena *arena, Arena *scratch )
+{
+ int i, num_slots, max_colors, slot, num_unique = 0;
+ uint32_t key;
+ uint32_t *slot_key;
+ int *slot_index;
+ RGB_Pixel8 pixel;
+ Color_Hist *hist;
+
+ hist = ( Color_Hist * ) arena_alloc ( arena, sizeof ( Color_Hist ) );
+ hist->index = ( int * ) arena_alloc ( arena, img->size * sizeof ( int ) );
+
+ /* Open addressing hash table with a load factor of at most 1/2 */
+ max_colors = img->size < ( 1 << 24 ) ? img->size : ( 1 << 24 );
+ for ( num_slots = 1; num_slots < 2 * max_colors; num_slots <<= 1 );
+ slot_key = ( uint32_t * ) arena_alloc ( scratch, num_slots * sizeof ( uint32_t ) );
+ slot_index = ( int * ) arena_alloc ( scratch, num_slots * sizeof ( int ) );
+ memset ( slot_key, 0xFF, num_slots * sizeof ( uint32_t ) );
+
+ hist->colors.data = ( RGB_Pixel8 * ) arena_alloc ( arena, max_colors * sizeof ( RGB_Pixel8 ) );
+ hist->count = ( int * ) arena_alloc ( arena, max_colors * sizeof ( int ) );
+
+ for ( i = 0; i < img->size; i++ )
+  {
+   pixel = img->data[i];
+   key = ( ( uint32_t ) pixel.red << 16 ) | ( ( uint32_t ) pixel.green << 8 ) | ( uint32_t ) pixel.blue;
+
+   /* Fibonacci hashing followed by linear probing */
+   slot = ( int ) ( ( key * 2654435761U ) & ( num_slots - 1 ) );
+   while ( slot_key[slot] != key && slot_key[slot] != EMPTY_KEY )
+    {
+     slot = ( slot + 1 ) & ( num_slots - 1 );
+    }
+
+   if ( slot_key[slot] == EMPTY_KEY )
+    {
+     /* First occurrence of this color */
+     slot_key[slot] = key;
+     slot_index[slot] = num_unique;
+     hist->colors.data[num_unique] = pixel;
+     hist->count[num_unique] = 0;
+     num_unique++;
+    }
+
+   hist->index[i] = slot_index[slot];
+   hist->count[slot_index[slot]]++;
+  }
+
+ hist->colors.width = num_unique;
+ hist->colors.height = 1;
+ hist->colors.size = num_unique;
+
+ return hist;
+}
+
+/* 
+   Mapping pass. Each pixel is replaced by its nearest palette color, 
+   either found with the nearest-center kernel or, when the image was 
+   collapsed into a histogram, looked up from the index of its distinct 
+   color. The quantized pixels ( or their palette indices ) go straight 
+   into the caller's buffers, a strip at a time if the caller wishes, so 
+   the library never holds an output image. The squared error is 
+   accumulated on the way ( exactly, in integers ) to give the MSE.
+ */
+
+/* 
+   Inverse colormap: for each 24-bit color, 1 + the index of its nearest 
+   center, or 0 if that color has not been seen yet. An entry is filled 
+   with the result of the nearest-center kernel the first time its color 
+   is mapped, so it holds exactly the index a full search would return, 
+   and every later pixel of that color costs a single load. The table 
+   only pays off when colors repeat, hence the minimum image size. It is 
+   kept by the quantizer and cleared when the palette changes.
+ */
+#define MAP_CACHE_SIZE ( 1 << 24 )
+#define MAP_CACHE_MAX_COLORS 65536
+#ifndef MAP_CACHE_MIN_PIXELS
+#define MAP_CACHE_MIN_PIXELS ( 1 << 21 )
+#endif
+
+typedef struct
+ {
+  const RGB_Image *in_img;
+  const int *color_index;     /* palette index of each histogram color, or NULL */
+  const int *hist_index;      /* histogram color of each pixel */
+  const RGB_Pixel8 *palette;  /* palette colors as written */
+  const Center_SoA *soa;
+  const NN_Kernels *kernels;
+  uint16_t *cache;            /* inverse colormap, or NULL */
+  int begin, end;             /* pixels of the current strip */
+  RGB_Pixel8 *out;            /* output for the strip, or NULL */
+  void *out_index;            /* palette indices for the strip, or NULL */
+  int index_size;             /* bytes per index: 1, 2 or sizeof ( int ) */
+  unsigned long long *sse;    /* per task, or NULL */
+  int num_tasks;
+ } Map_Job;
+
+static void
+map_task ( void *arg, const int task )
+{
+ int begin, end, min_dist_index, delta;
+ uint32_t key;
+ uint16_t entry;
+ unsigned long long sse = 0;
+ double min_dist;
+ const RGB_Pixel8 *in_pix, *color;
+ const Map_Job *job = ( const Map_Job * ) arg;
+
+ task_range ( task, job->num_tasks, job->end - job->begin, &begin, &end );
+ for ( int i = job->begin + begin; i < job->begin + end; i++ )
+  {
+   in_pix = &job->in_img->data[i];
+
+   /* Find the nearest center */
+   if ( job->color_index )
+    {
+     min_dist_index = job->color_index[job->hist_index[i]];
+    }
+   else if ( job->cache )
+    {
+     /* Search only on a miss; racing tasks store the same value */
+     key = ( ( uint32_t ) in_pix->red << 16 ) | ( ( uint32_t ) in_pix->green << 8 ) | in_pix->blue;
+     entry = __atomic_load_n ( &job->cache[key], __ATOMIC_RELAXED );
+     if ( entry )
+      {
+       min_dist_index = entry - 1;
+      }
+     else
+      {
+       min_dist_index = job->kernels->nearest ( job->soa, in_pix, &min_dist );
+       __atomic_store_n ( &job->cache[key], ( uint16_t ) ( min_dist_index + 1 ), __ATOMIC_RELAXED );
+      }
+    }
+   else
+    {
+     min_dist_index = job->kernels->nearest ( job->soa, in_pix, &min_dist );
+    }
+
+   if ( job->out_index )
+    {
+     switch ( job->index_size )
+      {
+       case 1:
+	( ( uint8_t * ) job->out_index )[i - job->begin] = min_dist_index;
+	break;
+       case 2:
+	( ( uint16_t * ) job->out_index )[i - job->begin] = min_dist_index;
+	break;
+       default:
+	( ( int * ) job->out_index )[i - job->begin] = min_dist_index;
+      }
+    }
+
+   /* Replace the input color with the nearest color in the palette */
+   color = &job->palette[min_dist_index];
+   if ( job->out )
+    {
+     job->out[i - job->begin] = *color;
+    }
+
+   if ( job->sse )
+    {
+     delta = in_pix->red - color->red;
+     sse += delta * delta;
+     delta = in_pix->green - color->green;
+     sse += delta * delta;
+     delta = in_pix->blue - color->blue;
+     sse += delta * delta;
+    }
+  }
+
+ if ( job->sse )
+  {
+   job->sse[task] = sse;
+  }
+}
+
+/* Map pixels [BEGIN, END) of the image in parallel and return their squared error */
+static unsigned long long
+map_strip ( Map_Job *job, const int begin, const int end, Thread_Pool *pool )
+{
+ unsigned long long sse = 0;
+
+ job->begin = begin;
+ job->end = end;
+ job->num_tasks = pool_num_tasks ( pool, end - begin );
+ pool_run ( pool, map_task, job, job->num_tasks );
+
+ if ( job->sse )
+  {
+   for ( int t = 0; t < job->num_tasks; t++ )
+    {
+     sse += job->sse[t];
+    }
+  }
+
+ return sse;
+}
+
+/* 
+   Nearest-center search for Macqueen's algorithm. The centers are kept 
+   sorted by their intensity projection ( red + green + blue ), which is 
+   a lower bound on the distance: ( p(x) - p(c) )^2 <= 3 * || x - c ||^2. 
+   The search starts at the center whose projection is closest to that of 
+   the pixel and walks outward in both directions, stopping on each side 
+   once the projection gap alone exceeds the best distance found so far. 
+   Surviving candidates use partial distance elimination. Since only one 
+   center moves per update, it is restored to its sorted position by a 
+   few swaps with its neighbors.
+ */
+
+typedef struct
+ {
+  int num_colors;
+  int *order;   /* center indices sorted by projection */
+  int *rank;    /* position of each center in ORDER */
+  double *proj; /* projections, in sorted order */
+ } Proj_Index;
+
+static inline double
+intensity ( const RGB_Pixel *pixel )
+{
+ return pixel->red + pixel->green + pixel->blue;
+}
+
+static void
+proj_index_init ( Proj_Index *pi, const RGB_Cluster *clusters, const int num_colors, Arena *arena )
+{
+ int i, j, tmp_index;
+ double tmp_proj;
+
+ pi->num_colors = num_colors;
+ pi->order = ( int * ) arena_alloc ( arena, num_colors * sizeof ( int ) );
+ pi->rank = ( int * ) arena_alloc ( arena, num_colors * sizeof ( int ) );
+ pi->proj = ( double * ) arena_alloc ( arena, num_colors * sizeof ( double ) );
+
+ /* Insertion sort (called once per run and K is small) */
+ for ( i = 0; i < num_colors; i++ )
+  {
+   tmp_index = i;
+   tmp_proj = intensity ( &clusters[i].center );
+   for ( j = i; 0 < j && tmp_proj < pi->proj[j - 1]; j-- )
+    {
+     pi->order[j] = pi->order[j - 1];
+     pi->proj[j] = pi->proj[j - 1];
+    }
+
+   pi->order[j] = tmp_index;
+   pi->proj[j] = tmp_proj;
+  }
+
+ for ( i = 0; i < num_colors; i++ )
+  {
+   pi->rank[pi->order[i]] = i;
+  }
+}
+
+
+/* Restore the sorted order after center INDEX has moved */
+static void
+proj_index_update ( Proj_Index *pi, const int index, const RGB_Pixel *center )
+{
+ int pos = pi->rank[index];
+ double new_proj = intensity ( center );
+
+ while ( 0 < pos && new_proj < pi->proj[pos - 1] )
+  {
+   pi->order[pos] = pi->order[pos - 1];
+   pi->proj[pos] = pi->proj[pos - 1];
+   pi->rank[pi->order[pos]] = pos;
+   pos--;
+  }
+
+ while ( pos < pi->num_colors - 1 && pi->proj[pos + 1] < new_proj )
+  {
+   pi->order[pos] = pi->order[pos + 1];
+   pi->proj[pos] = pi->proj[pos + 1];
+   pi->rank[pi->order[pos]] = pos;
+   pos++;
+  }
+
+ pi->order[pos] = index;
+ pi->proj[pos] = new_proj;
+ pi->rank[index] = pos;
+}
+
+/* 
+   Returns the index of the center nearest to PIXEL. Ties are broken in 
+   favor of the smaller index so that the result is identical to that of 
+   a full linear scan. NUM_DISTS is incremented by the number of centers 
+   whose distance had to be ( at least partially ) computed.
+ */
+
+static int
+proj_index_nearest ( const Proj_Index *pi, const RGB_Cluster *clusters, 
+		     const RGB_Pixel8 *pixel, long long *num_dists )
+{
+ int lo, hi, mid, j;
+ int min_dist_index = INT_MAX;
+ int lo_done, hi_done;
+ double min_dist = MAX_RGB_DIST;
+ double pix_proj, delta_proj, dist, delta;
+ const RGB_Pixel *center;
+
+ pix_proj = pixel->red + pixel->green + pixel->blue;
+
+ /* Binary search for the first center with projection >= PIX_PROJ */
+ lo = 0;
+ hi = pi->num_colors;
+ while ( lo < hi )
+  {
+   mid = ( lo + hi ) >> 1;
+   if ( pi->proj[mid] < pix_proj )
+    {
+     lo = mid + 1;
+    }
+   else
+    {
+     hi = mid;
+    }
+  }
+
+ hi = lo;
+ lo--;
+ lo_done = lo < 0;
+ hi_done = hi >= pi->num_colors;
+
+ while ( !lo_done || !hi_done )
+  {
+   /* Alternate between the two directions */
+   for ( int side = 0; side < 2; side++ )
+    {
+     if ( side == 0 )
+      {
+       if ( hi_done )
+        {
+         continue;
+        }
+
+       delta_proj = pi->proj[hi] - pix_proj;
+       if ( 3.0 * min_dist < delta_proj * delta_proj )
+        {
+         hi_done = 1;
+         continue;
+        }
+
+       j = pi->order[hi++];
+       hi_done = hi >= pi->num_colors;
+      }
+     else
+      {
+       if ( lo_done )
+        {
+         continue;
+        }
+
+       delta_proj = pix_proj - pi->proj[lo];
+       if ( 3.0 * min_dist < delta_proj * delta_proj )
+        {
+         lo_done = 1;
+         continue;
+        }
+
+       j = pi->order[lo--];
+       lo_done = lo < 0;
+      }
+
+     ( *num_dists )++;
+
+     /* Partial distance elimination */
+     center = &clusters[j].center;
+     delta = pixel->red - center->red;
+     dist = delta * delta;
+     if ( min_dist < dist )
+      {
+       continue;
+      }
+
+     delta = pixel->green - center->green;
+     dist += delta * delta;
+     if ( min_dist < dist )
+      {
+       continue;
+      }
+
+     delta = pixel->blue - center->blue;
+     dist += delta * delta;
+     if ( dist < min_dist || ( dist == min_dist && j < min_dist_index ) )
+      {
+       min_dist = dist;
+       min_dist_index = j;
+      }
+    }
+  }
+
+ return min_dist_index;
+}
+
+/* 
+   Presentation order of the pixels: quasirandom ( the Sobol point of 
+   each step rounded to the nearest pixel ) or pseudorandom ( uniform 
+   over the pixels, from the run's own generator seeded with SEED ). 
+   The quasirandom order can start anywhere ( see pres_seek ), so a copy 
+   of the state can produce any part of it.
+ */
+
+typedef struct
+ {
+  int pres_order;
+  int width, height, size;
+  Sobol_State sob;
+  MT_State rng;
+ } Pres_State;
+
+static void
+pres_init ( Pres_State *state, const RGB_Image *img, const int pres_order, const ulong seed )
+{
+ state->pres_order = pres_order;
+ state->width = img->width;
+ state->height = img->height;
+ state->size = img->size;
+
+ if ( pres_order == 0 )
+  {
+   sob_init ( &state->sob );
+  }
+ else
+  {
+   init_genrand ( &state->rng, seed );
+  }
+}
+
+/* Index of the next pixel to present */
+static inline int
+pres_next ( Pres_State *state )
+{
+ int row_index, col_index;
+ double sob_x, sob_y;
+
+ if ( state->pres_order == 0 )
+  {
+   /* Quasirandom */
+   sob_seq ( &state->sob, &sob_x, &sob_y );
+
+   row_index = ( int ) ( sob_y * state->height + 0.5 ); /* round */
+   if ( row_index == state->height )
+    {
+     row_index--;
+    }
+
+   col_index = ( int ) ( sob_x * state->width + 0.5 ); /* round */
+   if ( col_index == state->width )
+    {
+     col_index--;
+    }
+
+   return row_index * state->width + col_index;
+  }
+
+ /* Pseudorandom */
+ /* return ( int ) ( genrand_real2 ( &state->rng ) * state->size ); */
+ return bounded_rand ( &state->rng, state->size );
+}
+
+/* Move the quasirandom order to step N ( the next pres_next returns its pixel ) */
+static void
+pres_seek ( Pres_State *state, const long long n )
+{
+ sob_skip ( &state->sob, n );
+}
+
+/* Indices of the next COUNT pixels to present */
+static void
+pres_block ( Pres_State *state, int *index, const int count )
+{
+ for ( int i = 0; i < count; i++ )
+  {
+   index[i] = pres_next ( state );
+  }
+}
+
+/* 
+   Maximin on a subsample: the pixels of the first INIT_RATE x # pixels 
+   steps of the quasirandom order ( at least NUM_COLORS ), so that its 
+   cost falls with the rate, like that of Macqueen's algorithm.
+ */
+
+static void
+subsample_maximin ( const RGB_Image *img, RGB_Cluster *clusters, const int num_colors, 
+		    const RGB_Pixel *mean, const double init_rate, Thread_Pool *pool, Arena *arena )
+{
+ int *index;
+ RGB_Image sample;
+ Pres_State pres;
+
+ sample.size = std::max ( num_colors, ( int ) ( img->size * init_rate ) );
+ if ( img->size <= sample.size )
+  {
+   maximin ( img, clusters, num_colors, mean, pool, arena );
+   return;
+  }
+
+ sample.width = sample.size;
+ sample.height = 1;
+ sample.data = ( RGB_Pixel8 * ) arena_alloc ( arena, sample.size * sizeof ( RGB_Pixel8 ) );
+ index = ( int * ) arena_alloc ( arena, sample.size * sizeof ( int ) );
+
+ pres_init ( &pres, img, 0, 0 );
+ pres_block ( &pres, index, sample.size );
+ for ( int i = 0; i < sample.size; i++ )
+  {
+   sample.data[i] = img->data[index[i]];
+  }
+
+ maximin ( &sample, clusters, num_colors, mean, pool, arena );
+}
+
+/* 
+   Cumulative color moments for median cut and Wu's algorithm. The colors 
+   are binned with MOM_BITS bits per channel; entry ( r, g, b ) of each 
+   table holds the # pixels, the sums of their R, G and B values or the 
+   sum of their squared norms over all the bins up to bin ( r, g, b ) 
+   ( counted from 1; the planes of index 0 are zero ), so that the sums 
+   over any box of bins take 8 lookups. For the method, see
+   X. Wu, Efficient Statistical Computations for Optimal Color 
+   Quantization, in Graphics Gems II, J. Arvo ( ed. ), pp. 126-133, 
+   Academic Press, 1991.
+   All the sums are integers, hence exact.
+ */
+
+#define MOM_BITS 5
+#define MOM_SIDE ( ( 1 << MOM_BITS ) + 1 )
+#define MOM_SIZE ( MOM_SIDE * MOM_SIDE * MOM_SIDE )
+
+#define MOM_WEIGHT 0
+#define MOM_NORM 4
+#define MOM_NUM 5 /* weight, red, green, blue, norm */
+
+typedef struct
+ {
+  long long *sum[MOM_NUM];
+  int num_cells; /* # nonempty bins */
+ } Color_Moments;
+
+static inline int
+mom_index ( const int red, const int green, const int blue )
+{
+ return ( red * MOM_SIDE + green ) * MOM_SIDE + blue;
+}
+
+/* Moments of IMG, whose pixels are weighted by COUNT if it is not NULL */
+static void
+build_moments ( const RGB_Image *img, const int *count, Color_Moments *mom, Arena *arena )
+{
+ int k, m, r, g, b;
+ long long weight;
+ long long *sum;
+ RGB_Pixel8 pixel;
+ const int shift = 8 - MOM_BITS;
+
+ for ( m = 0; m < MOM_NUM; m++ )
+  {
+   mom->sum[m] = ( long long * ) arena_alloc ( arena, MOM_SIZE * sizeof ( long long ) );
+   memset ( mom->sum[m], 0, MOM_SIZE * sizeof ( long long ) );
+  }
+
+ for ( int i = 0; i < img->size; i++ )
+  {
+   pixel = img->data[i];
+   weight = count ? count[i] : 1;
+   k = mom_index ( ( pixel.red >> shift ) + 1, ( pixel.green >> shift ) + 1, 
+		   ( pixel.blue >> shift ) + 1 );
+
+   mom->sum[MOM_WEIGHT][k] += weight;
+   mom->sum[1][k] += weight * pixel.red;
+   mom->sum[2][k] += weight * pixel.green;
+   mom->sum[3][k] += weight * pixel.blue;
+   mom->sum[MOM_NORM][k] += weight * ( pixel.red * pixel.red + pixel.green * pixel.green + 
+				       pixel.blue * pixel.blue );
+  }
+
+ mom->num_cells = 0;
+ for ( k = 0; k < MOM_SIZE; k++ )
+  {
+   mom->num_cells += mom->sum[MOM_WEIGHT][k] != 0;
+  }
+
+ /* Accumulate along blue, then green, then red */
+ for ( m = 0; m < MOM_NUM; m++ )
+  {
+   sum = mom->sum[m];
+   for ( r = 1; r < MOM_SIDE; r++ )
+    {
+     for ( g = 1; g < MOM_SIDE; g++ )
+      {
+       for ( b = 2; b < MOM_SIDE; b++ )
+	{
+	 sum[mom_index ( r, g, b )] += sum[mom_index ( r, g, b - 1 )];
+	}
+      }
+    }
+
+   for ( r = 1; r < MOM_SIDE; r++ )
+    {
+     for ( g = 2; g < MOM_SIDE; g++ )
+      {
+       for ( b = 1; b < MOM_SIDE; b++ )
+	{
+	 sum[mom_index ( r, g, b )] += sum[mom_index ( r, g - 1, b )];
+	}
+      }
+    }
+
+   for ( r = 2; r < MOM_SIDE; r++ )
+    {
+     for ( g = 1; g < MOM_SIDE; g++ )
+      {
+       for ( b = 1; b < MOM_SIDE; b++ )
+	{
+	 sum[mom_index ( r, g, b )] += sum[mom_index ( r - 1, g, b )];
+	}
+      }
+    }
+  }
+}
+
+/* Box of bins LO + 1 to HI of each channel ( R, G, B ) */
+typedef struct
+ {
+  int lo[3], hi[3];
+  long long sum[MOM_NUM]; /* moments over the box */
+ } Color_Box;
+
+/* Moment M over the bins LO + 1 to HI of each channel */
+static long long
+box_sum ( const Color_Moments *mom, const int m, const int *lo, const int *hi )
+{
+ const long long *sum = mom->sum[m];
+
+ return sum[mom_index ( hi[0], hi[1], hi[2] )] - sum[mom_index ( hi[0], hi[1], lo[2] )] - 
+	sum[mom_index ( hi[0], lo[1], hi[2] )] + sum[mom_index ( hi[0], lo[1], lo[2] )] - 
+	sum[mom_index ( lo[0], hi[1], hi[2] )] + sum[mom_index ( lo[0], hi[1], lo[2] )] + 
+	sum[mom_index ( lo[0], lo[1], hi[2] )] - sum[mom_index ( lo[0], lo[1], lo[2] )];
+}
+
+/* Shrink BOX ( which holds some pixels ) to its nonempty bins and get its moments */
+static void
+box_fit ( const Color_Moments *mom, Color_Box *box )
+{
+ int lo[3], hi[3];
+
+ for ( int c = 0; c < 3; c++ )
+  {
+   memcpy ( lo, box->lo, sizeof ( lo ) );
+   memcpy ( hi, box->hi, sizeof ( hi ) );
+
+   /* Empty slabs at the low end, then at the high end */
+   for ( hi[c] = lo[c] + 1; box_sum ( mom, MOM_WEIGHT, lo, hi ) == 0; hi[c]++ )
+    {
+     box->lo[c]++;
+     lo[c]++;
+    }
+
+   memcpy ( lo, box->lo, sizeof ( lo ) );
+   for ( hi[c] = box->hi[c], lo[c] = hi[c] - 1; box_sum ( mom, MOM_WEIGHT, lo, hi ) == 0; 
+	 hi[c]--, lo[c]-- )
+    {
+     box->hi[c]--;
+    }
+  }
+
+ for ( int m = 0; m < MOM_NUM; m++ )
+  {
+   box->sum[m] = box_sum ( mom, m, box->lo, box->hi );
+  }
+}
+
+/* Sum of squared distances of the pixels of BOX to their mean */
+static double
+box_sse ( const Color_Box *box )
+{
+ return box->sum[MOM_NORM] - ( ( double ) box->sum[1] * box->sum[1] + ( double ) box->sum[2] * box->sum[2] + 
+			       ( double ) box->sum[3] * box->sum[3] ) / box->sum[MOM_WEIGHT];
+}
+
+/* 
+   Where to split BOX: the channel *CHANNEL and the last bin *CUT of the 
+   lower part. Median cut splits the longest side where the halves have 
+   the closest # pixels; Wu's algorithm splits where the sum of squared 
+   distances of the two parts to their means is smallest.
+ */
+static void
+box_cut ( const Color_Moments *mom, const Color_Box *box, const int wu, int *channel, int *cut )
+{
+ int longest = 0;
+ long long weight, lower[MOM_NUM];
+ double score, best_score = -DBL_MAX;
+ int hi[3];
+
+ for ( int c = 1; c < 3; c++ )
+  {
+   if ( box->hi[longest] - box->lo[longest] < box->hi[c] - box->lo[c] )
+    {
+     longest = c;
+    }
+  }
+
+ for ( int c = 0; c < 3; c++ )
+  {
+   if ( !wu && c != longest )
+    {
+     continue;
+    }
+
+   memcpy ( hi, box->hi, sizeof ( hi ) );
+   for ( hi[c] = box->lo[c] + 1; hi[c] < box->hi[c]; hi[c]++ )
+    {
+     for ( int m = 0; m < 4; m++ )
+      {
+       lower[m] = box_sum ( mom, m, box->lo, hi );
+      }
+
+     /* The box is fitted, so both parts hold pixels unless the lower one is empty */
+     weight = lower[MOM_WEIGHT];
+     if ( weight == 0 )
+      {
+       continue;
+      }
+
+     if ( wu )
+      {
+       /* Largest sum of squared norms of the means, weighted */
+       score = ( ( double ) lower[1] * lower[1] + ( double ) lower[2] * lower[2] + 
+		 ( double ) lower[3] * lower[3] ) / weight;
+       weight = box->sum[MOM_WEIGHT] - weight;
+       score += ( ( double ) ( box->sum[1] - lower[1] ) * ( box->sum[1] - lower[1] ) + 
+		  ( double ) ( box->sum[2] - lower[2] ) * ( box->sum[2] - lower[2] ) + 
+		  ( double ) ( box->sum[3] - lower[3] ) * ( box->sum[3] - lower[3] ) ) / weight;
+      }
+     else
+      {
+       score = -llabs ( 2 * weight - box->sum[MOM_WEIGHT] );
+      }
+
+     if ( best_score < score )
+      {
+       best_score = score;
+       *channel = c;
+       *cut = hi[c];
+      }
+    }
+  }
+}
+
+/* 
+   Median cut ( WU = 0 ) or Wu's algorithm ( WU = 1 ) on the color 
+   histogram: starting from one box holding all the colors, the box with 
+   the most pixels ( median cut ) or the largest sum of squared distances 
+   to its mean ( Wu ) is split until there are NUM_COLORS boxes, whose 
+   means are the centers. Returns false, leaving CLUSTERS alone, when 
+   fewer than NUM_COLORS bins hold pixels. For the methods, see
+   P. Heckbert, Color Image Quantization for Frame Buffer Display, 
+   ACM SIGGRAPH Computer Graphics, vol. 16, no. 3, pp. 297-307, 1982.
+   X. Wu, Efficient Statistical Computations for Optimal Color 
+   Quantization ( see Color_Moments ).
+ */
+
+static bool
+split_boxes ( const RGB_Image *img, const int *count, RGB_Cluster *clusters, const int num_colors, 
+	      const int wu, Arena *arena )
+{
+ int b, channel = 0, cut = 0;
+ Color_Moments mom;
+ Color_Box *boxes, *box, *upper;
+ std::priority_queue<std::pair<double, int>> queue;
+
+ build_moments ( img, count, &mom, arena );
+ if ( mom.num_cells < num_colors )
+  {
+   return false;
+  }
+
+ /* A box can be split while it spans more than one bin */
+ auto push = [&] ( const int index ) 
+  {
+   const Color_Box *part = &boxes[index];
+
+   if ( part->hi[0] - part->lo[0] > 1 || part->hi[1] - part->lo[1] > 1 || part->hi[2] - part->lo[2] > 1 )
+    {
+     queue.push ( std::make_pair ( wu ? box_sse ( part ) : ( double ) part->sum[MOM_WEIGHT], index ) );
+    }
+  };
+
+ boxes = ( Color_Box * ) arena_alloc ( arena, num_colors * sizeof ( Color_Box ) );
+ for ( int c = 0; c < 3; c++ )
+  {
+   boxes[0].lo[c] = 0;
+   boxes[0].hi[c] = MOM_SIDE - 1;
+  }
+ box_fit ( &mom, &boxes[0] );
+ push ( 0 );
+
+ /* With at least NUM_COLORS nonempty bins, some box can always be split */
+ for ( int num_boxes = 1; num_boxes < num_colors; num_boxes++ )
+  {
+   b = queue.top ( ).second;
+   queue.pop ( );
+
+   box_cut ( &mom, &boxes[b], wu, &channel, &cut );
+   upper = &boxes[num_boxes];
+   *upper = boxes[b];
+   upper->lo[channel] = cut;
+   boxes[b].hi[channel] = cut;
+   box_fit ( &mom, &boxes[b] );
+   box_fit ( &mom, upper );
+   push ( b );
+   push ( num_boxes );
+  }
+
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   box = &boxes[j];
+   clusters[j].center.red = ( double ) box->sum[1] / box->sum[MOM_WEIGHT];
+   clusters[j].center.green = ( double ) box->sum[2] / box->sum[MOM_WEIGHT];
+   clusters[j].center.blue = ( double ) box->sum[3] / box->sum[MOM_WEIGHT];
+   clusters[j].size = 1;
+  }
+
+ return true;
+}
+
+/* 
+   Initial centers: a copy of SEEDS ( the centers of an earlier clustering, 
+   e.g. of the previous frame of a video ) if it is not NULL, otherwise 
+   those of the initializer of OPTIONS, on IMG weighted by COUNT ( if not 
+   NULL ). Median cut and Wu's algorithm fall back to maximin on images 
+   with too few colors. The seeds keep their sizes, which set the learning 
+   rates of their first updates in Macqueen's algorithm.
+ */
+
+static void
+init_centers ( const RGB_Image *img, const int *count, RGB_Cluster *clusters, const int num_colors, 
+	       const RGB_Pixel *mean, const RGB_Cluster *seeds, const MKM_Options *options, 
+	       Thread_Pool *pool, Arena *arena )
+{
+ if ( seeds )
+  {
+   memcpy ( clusters, seeds, num_colors * sizeof ( RGB_Cluster ) );
+   return;
+  }
+
+ switch ( options->init )
+  {
+   case MKM_INIT_SUBSAMPLE:
+    subsample_maximin ( img, clusters, num_colors, mean, options->init_rate, pool, arena );
+    break;
+   case MKM_INIT_MEDIAN_CUT:
+   case MKM_INIT_WU:
+    if ( split_boxes ( img, count, clusters, num_colors, options->init == MKM_INIT_WU, arena ) )
+     {
+      break;
+     }
+    maximin ( img, clusters, num_colors, mean, pool, arena );
+    break;
+   default:
+    maximin ( img, clusters, num_colors, mean, pool, arena );
+  }
+}
+
+/* 
+   Learning rates ( # pixels of the cluster )^-LR_EXP of Macqueen's and 
+   the mini-batch algorithm. For LR_EXP = 1, a division gives the same 
+   value as pow. Otherwise, the rate of each size below the size of the 
+   table is computed with pow the first time a cluster reaches it and 
+   kept, so that the clusters share the work. ( A square root for 
+   LR_EXP = 0.5 would be faster still, but 1 / sqrt ( n ) differs from 
+   pow ( n, -0.5 ) in the last bit for about a quarter of the sizes, 
+   which would change the palettes. )
+ */
+
+#define MAX_RATE_TABLE ( 1 << 20 )
+
+typedef struct
+ {
+  double lr_exp;
+  bool reciprocal;
+  int size;     /* # entries */
+  double *rate; /* rate of each size, or 0 if not computed yet */
+ } Rate_Table;
+
+/* Rates for clusters of up to MAX_SIZE pixels */
+static void
+rate_init ( Rate_Table *table, const double lr_exp, const long long max_size, Arena *arena )
+{
+ table->lr_exp = lr_exp;
+ table->reciprocal = lr_exp == 1.0;
+ table->size = table->reciprocal ? 0 : ( int ) std::min ( max_size + 1, ( long long ) MAX_RATE_TABLE );
+ table->rate = ( double * ) arena_alloc ( arena, table->size * sizeof ( double ) );
+ memset ( table->rate, 0, table->size * sizeof ( double ) );
+}
+
+static inline double
+rate_of ( Rate_Table *table, const int size )
+{
+ if ( table->reciprocal )
+  {
+   return 1.0 / size;
+  }
+
+ if ( size < table->size )
+  {
+   if ( table->rate[size] == 0.0 )
+    {
+     table->rate[size] = pow ( size, -table->lr_exp );
+    }
+
+   return table->rate[size];
+  }
+
+ return pow ( size, -table->lr_exp );
+}
+
+/* Largest cluster of CLUSTERS after NUM_SAMPLES more pixels */
+static long long
+max_cluster_size ( const RGB_Cluster *clusters, const int num_colors, const long long num_samples )
+{
+ int max_size = 0;
+
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   max_size = std::max ( max_size, clusters[j].size );
+  }
+
+ return max_size + num_samples;
+}
+
+/* # samples between the choice of a pixel and its use ( a power of 2 ) */
+#define PRES_AHEAD 16
+
+/* Color quantization using Macqueen's k-means algorithm */
+/* 
+  For detailed information, see
+  S. Thompson, M. E. Celebi, and K. H. Buck, 
+  Fast Color Quantization Using Macqueens K-Means Algorithm, 
+  Journal of Real-Time Image Processing, to appear 
+  (https://doi.org/10.1007/s11554-019-00914-6), 2020.
+
+  SEED initializes the run's own pseudorandom number generator 
+  when PRES_ORDER = 1; it is ignored for the quasirandom order. 
+  USE_PRUNE chooses the nearest-center search ( see MKM_Options ). 
+  SCHEDULE, if not NULL, holds the pixel indices of the presentation 
+  order ( at least as many as the samples ), which are then not drawn.
+  Refines the NUM_COLORS initial centers in CLUSTERS ( see 
+  init_centers ); the working memory comes from ARENA and the counts 
+  go to STATS.
+ */
+
+static void 
+macqueen_cluster ( const RGB_Image *in_img, RGB_Cluster *clusters, const int num_colors, 
+		   const int pres_order, const double lr_exp, const double sample_rate, 
+		   const ulong seed, const int use_prune, const int *schedule, 
+		   Arena *arena, MKM_Stats *stats )
+{
+ int i;
+ int max_pres, min_dist_index, next;
+ int ahead[PRES_AHEAD];
+ int old_size, new_size;
+ double rate;
+ double min_dist;
+ long long num_dists = 0;
+ RGB_Cluster *cluster;
+ RGB_Pixel8 in_pix;
+ Proj_Index pi = { };
+ Center_SoA soa;
+ Pres_State pres;
+ Rate_Table rates;
+ const NN_Kernels *kernels = get_kernels ( );
+ const int prune = use_prune < 0 ? kernels->prune_min_colors <= num_colors : use_prune;
+ const NN_Nearest nearest = nearest_kernel ( kernels, num_colors );
+
+ pres_init ( &pres, in_img, pres_order, seed );
+
+ if ( prune )
+  {
+   proj_index_init ( &pi, clusters, num_colors, arena );
+  }
+ else
+  {
+   soa_init ( &soa, clusters, num_colors, arena );
+  }
+
+ /* 
+    The pixels are chosen PRES_AHEAD samples before they are presented, 
+    so that their loads are under way by then
+  */
+ max_pres = in_img->size * sample_rate; 
+ rate_init ( &rates, lr_exp, max_cluster_size ( clusters, num_colors, max_pres ), arena );
+ for ( i = 0; i < PRES_AHEAD && i < max_pres; i++ )
+  {
+   ahead[i] = schedule ? schedule[i] : pres_next ( &pres );
+   PREFETCH ( &in_img->data[ahead[i]] );
+  }
+
+ /* Clustering pixel data using Macqueen's k-means algorithm */
+ for ( i = 0; i < max_pres; i++ )
+  {
+   /* Take the pixel chosen quasi- or pseudo-randomly earlier and cache it */
+   in_pix = in_img->data[ahead[i % PRES_AHEAD]];
+
+   /* Choose the pixel of a later sample in its place */
+   if ( i + PRES_AHEAD < max_pres )
+    {
+     next = schedule ? schedule[i + PRES_AHEAD] : pres_next ( &pres );
+     ahead[i % PRES_AHEAD] = next;
+     PREFETCH ( &in_img->data[next] );
+    }
+
+   /* Find the nearest center */
+   if ( prune )
+    {
+     min_dist_index = proj_index_nearest ( &pi, clusters, &in_pix, &num_dists );
+    }
+   else
+    {
+     min_dist_index = nearest ( &soa, &in_pix, &min_dist );
+     num_dists += num_colors;
+    }
+
+   /* Update the nearest center */
+   cluster = &clusters[min_dist_index];
+   old_size = cluster->size;
+   new_size = old_size + 1;
+   rate = rate_of ( &rates, new_size );
+   cluster->center.red += rate * ( in_pix.red - cluster->center.red );
+   cluster->center.green += rate * ( in_pix.green - cluster->center.green );
+   cluster->center.blue += rate * ( in_pix.blue - cluster->center.blue );
+   cluster->size = new_size;
+
+   if ( prune )
+    {
+     /* Move the center to its new place in the projection order */
+     proj_index_update ( &pi, min_dist_index, &cluster->center );
+    }
+   else
+    {
+     soa_set ( &soa, min_dist_index, &cluster->center );
+    }
+  }
+    
+ stats->num_samples = max_pres;
+ stats->num_dists = num_dists;
+}
+
+/* 
+   Assignment step of the mini-batch algorithm: the nearest center of 
+   each pixel of the batch, found in parallel against the centers as 
+   they were at the start of the batch.
+ */
+
+typedef struct
+ {
+  const RGB_Image *img;
+  const Pres_State *pres; /* quasirandom order, drawn by the tasks; NULL if INDEX is drawn */
+  long long first;        /* step of the first pixel of the batch */
+  int *index;             /* pixel indices of the batch */
+  RGB_Pixel8 *batch;
+  int *member;
+  const Center_SoA *soa;
+  const NN_Kernels *kernels;
+  int batch_size;
+  int num_tasks;
+ } Batch_Job;
+
+static void
+batch_task ( void *arg, const int task )
+{
+ int begin, end;
+ double min_dist;
+ Pres_State pres;
+ const Batch_Job *job = ( const Batch_Job * ) arg;
+
+ task_range ( task, job->num_tasks, job->batch_size, &begin, &end );
+
+ /* Each task draws its own part of a quasirandom batch */
+ if ( job->pres )
+  {
+   pres = *job->pres;
+   pres_seek ( &pres, job->first + begin );
+   pres_block ( &pres, &job->index[begin], end - begin );
+  }
+
+ for ( int i = begin; i < end; i++ )
+  {
+   job->batch[i] = job->img->data[job->index[i]];
+   job->member[i] = job->kernels->nearest ( job->soa, &job->batch[i], &min_dist );
+  }
+}
+
+/* Color quantization using mini-batch k-means */
+/* 
+   For the algorithm, see
+   D. Sculley, Web-Scale K-Means Clustering, Proc. of the 19th 
+   International Conference on World Wide Web, pp. 1177-1178, 2010.
+
+   Each of the NUM_BATCHES batches takes the next BATCH_SIZE pixels of the 
+   presentation order of Macqueen's algorithm. The whole batch is drawn 
+   ( in parallel for the quasirandom order ) and assigned first ( in 
+   parallel ), then every pixel moves its center in batch order 
+   with the per-center rate ( # pixels it got so far )^-LR_EXP, as in 
+   Macqueen's algorithm; with LR_EXP = 1 this is Sculley's update. Since 
+   the assignment does not depend on the task split, neither does the 
+   result. The other arguments are as in macqueen_cluster.
+ */
+
+static void 
+minibatch_cluster ( const RGB_Image *in_img, RGB_Cluster *clusters, const int num_colors, 
+		    const int pres_order, const double lr_exp, const int batch_size, 
+		    const int num_batches, const ulong seed, Thread_Pool *pool, Arena *arena, 
+		    MKM_Stats *stats )
+{
+ int new_size;
+ double rate;
+ RGB_Cluster *cluster;
+ const RGB_Pixel8 *in_pix;
+ RGB_Pixel8 *batch;
+ Center_SoA soa;
+ Pres_State pres;
+ Batch_Job job;
+ Rate_Table rates;
+
+ pres_init ( &pres, in_img, pres_order, seed );
+
+ soa_init ( &soa, clusters, num_colors, arena );
+ rate_init ( &rates, lr_exp, max_cluster_size ( clusters, num_colors, 
+						 ( long long ) num_batches * batch_size ), arena );
+ batch = ( RGB_Pixel8 * ) arena_alloc ( arena, batch_size * sizeof ( RGB_Pixel8 ) );
+
+ job.img = in_img;
+ job.pres = pres_order == 0 ? &pres : NULL;
+ job.index = ( int * ) arena_alloc ( arena, batch_size * sizeof ( int ) );
+ job.batch = batch;
+ job.member = ( int * ) arena_alloc ( arena, batch_size * sizeof ( int ) );
+ job.soa = &soa;
+ job.kernels = get_kernels ( );
+ job.batch_size = batch_size;
+ job.num_tasks = pool_num_tasks ( pool, batch_size );
+
+ for ( int b = 0; b < num_batches; b++ )
+  {
+   /* The pseudorandom order can only be drawn in sequence */
+   job.first = ( long long ) b * batch_size;
+   if ( !job.pres )
+    {
+     pres_block ( &pres, job.index, batch_size );
+    }
+
+   pool_run ( pool, batch_task, &job, job.num_tasks );
+
+   /* Update the centers in batch order */
+   for ( int i = 0; i < batch_size; i++ )
+    {
+     in_pix = &batch[i];
+     cluster = &clusters[job.member[i]];
+     new_size = cluster->size + 1;
+     rate = rate_of ( &rates, new_size );
+     cluster->center.red += rate * ( in_pix->red - cluster->center.red );
+     cluster->center.green += rate * ( in_pix->green - cluster->center.green );
+     cluster->center.blue += rate * ( in_pix->blue - cluster->center.blue );
+     cluster->size = new_size;
+    }
+
+   for ( int i = 0; i < batch_size; i++ )
+    {
+     soa_set ( &soa, job.member[i], &clusters[job.member[i]].center );
+    }
+  }
+
+ stats->num_samples = ( long long ) num_batches * batch_size;
+ stats->num_dists = stats->num_samples * num_colors;
+ stats->num_iters = num_batches;
+}
+
+/* 
+   Assignment step of Lloyd's algorithm, split into bands of pixels. Each 
+   task accumulates its own partial centroid sums and # changes ( and, in 
+   the first iteration, sum of squared pixel norms ), which are then added 
+   up in task order, so the result is reproducible for a given # threads. 
+   Since the pixel values are integers, the sums are in fact exact and do 
+   not depend on it at all.
+ */
+
+typedef struct
+ {
+  const RGB_Image *data;
+  const int *count;
+  int *member;
+  const Center_SoA *soa;
+  const NN_Kernels *kernels;
+  RGB_Cluster *partial; /* NUM_TASKS x NUM_COLORS partial sums */
+  int *num_changes;     /* per task */
+  uint64_t *sum_sq;     /* per task ( first iteration ) */
+  int num_colors;
+  int num_tasks;
+  int first_iter;
+ } Lloyd_Job;
+
+static void
+reset_clusters ( RGB_Cluster *clusters, const int num_colors )
+{
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   clusters[j].center.red = 0.0;
+   clusters[j].center.green = 0.0;
+   clusters[j].center.blue = 0.0;
+   clusters[j].size = 0;
+  }
+}
+
+/* Sum of || x ||^2 over the pixels [BEGIN, END) of DATA, weighted by COUNT if not NULL */
+static uint64_t
+sum_squares ( const RGB_Image *data, const int *count, const int begin, const int end )
+{
+ uint64_t sum_sq = 0;
+ const RGB_Pixel8 *pixel;
+
+ for ( int i = begin; i < end; i++ )
+  {
+   pixel = &data->data[i];
+   sum_sq += ( uint64_t ) ( count ? count[i] : 1 ) * 
+	     ( pixel->red * pixel->red + pixel->green * pixel->green + pixel->blue * pixel->blue );
+  }
+
+ return sum_sq;
+}
+
+/* 
+   Objective of Lloyd's algorithm ( the SSE ) once the centers have moved 
+   to the centroids of their clusters, from the centroid sums in SUM and 
+   SUM_SQ ( see sum_squares ): SSE = SUM_SQ - sum_j || S_j ||^2 / n_j. 
+   Both are exact, so the result does not depend on the # threads, and 
+   no pixel has to be visited again.
+ */
+static double
+lloyd_objective ( const RGB_Cluster *sum, const int num_colors, const uint64_t sum_sq )
+{
+ double obj = sum_sq;
+ const RGB_Pixel *center;
+
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   if ( sum[j].size )
+    {
+     center = &sum[j].center;
+     obj -= ( center->red * center->red + center->green * center->green + 
+	      center->blue * center->blue ) / sum[j].size;
+    }
+  }
+
+ return obj;
+}
+
+/* 
+   Record the objective of iteration NUM_ITERS ( see lloyd_objective ) 
+   and tell whether Lloyd's algorithm should stop: when no pixel moved, 
+   after OPTIONS->MAX_ITERS iterations, or when the objective fell by 
+   less than OPTIONS->TOLERANCE of its previous value. OBJ holds the 
+   previous objective ( DBL_MAX at first ) and receives the new one.
+ */
+static bool
+lloyd_stop ( const MKM_Options *options, const RGB_Cluster *sum, const int num_colors, 
+	     const uint64_t sum_sq, const int num_iters, const int num_changes, double *obj )
+{
+ double old_obj = *obj;
+ double new_obj = lloyd_objective ( sum, num_colors, sum_sq );
+
+ *obj = new_obj;
+ if ( options->trace )
+  {
+   options->trace ( options->trace_arg, num_iters, new_obj, num_changes );
+  }
+
+ return num_changes == 0 || options->max_iters <= num_iters || 
+	( 0.0 < options->tolerance && old_obj - new_obj <= options->tolerance * old_obj );
+}
+
+/* Add up the per-task partial sums in task order */
+static void
+reduce_partials ( const RGB_Cluster *partial, const int num_tasks, 
+		  const int num_colors, RGB_Cluster *sum )
+{
+ const RGB_Cluster *cluster;
+
+ reset_clusters ( sum, num_colors );
+ for ( int t = 0; t < num_tasks; t++ )
+  {
+   for ( int j = 0; j < num_colors; j++ )
+    {
+     cluster = &partial[t * num_colors + j];
+     sum[j].center.red += cluster->center.red;
+     sum[j].center.green += cluster->center.green;
+     sum[j].center.blue += cluster->center.blue;
+     sum[j].size += cluster->size;
+    }
+  }
+}
+
+static void
+lloyd_task ( void *arg, const int task )
+{
+ int begin, end, min_dist_index, weight, num_changes = 0;
+ double min_dist;
+ RGB_Pixel8 in_pix;
+ RGB_Cluster *cluster;
+ const Lloyd_Job *job = ( const Lloyd_Job * ) arg;
+ RGB_Cluster *tmp_clusters = &job->partial[task * job->num_colors];
+
+ /* Reset the new clusters */ 
+ reset_clusters ( tmp_clusters, job->num_colors );
+
+ task_range ( task, job->num_tasks, job->data->size, &begin, &end );
+ if ( job->first_iter )
+  {
+   job->sum_sq[task] = sum_squares ( job->data, job->count, begin, end );
+  }
+
+ for ( int i = begin; i < end; i++ )
+  {
+   /* Cache the pixel */
+   in_pix = job->data->data[i];
+   weight = job->count ? job->count[i] : 1;
+
+   /* Find the nearest center */
+   min_dist_index = job->kernels->nearest ( job->soa, &in_pix, &min_dist );
+
+   if ( job->first_iter || ( job->member[i] != min_dist_index ) )
+    {
+     /* Update the membership of the pixel */
+     job->member[i] = min_dist_index;
+     num_changes += weight;
+    }
+
+   /* Update the temp center of the nearest cluster */
+   cluster = &tmp_clusters[min_dist_index];
+   cluster->center.red += weight * in_pix.red;
+   cluster->center.green += weight * in_pix.green;
+   cluster->center.blue += weight * in_pix.blue;
+   cluster->size += weight;
+  }
+
+ job->num_changes[task] = num_changes;
+}
+
+/* Color quantization using Lloyd's k-means algorithm */
+/* 
+   For application of Lloyd's k-means algorithm to color quantization, see
+   M. E. Celebi, Improving the Performance of K-Means for Color Quantization, 
+   Image and Vision Computing, vol. 29, no. 4, pp. 260271, 2011.
+
+   If HIST ( the histogram of IN_IMG ) is not NULL, the algorithm runs on 
+   the distinct colors of the image weighted by their counts. Since the 
+   pixel values are integers, the weighted sums are exact and the result 
+   is identical to that of the unweighted algorithm. OPTIONS gives the 
+   stopping rule ( see lloyd_stop ). CLUSTERS, ARENA and STATS are as 
+   in macqueen_cluster.
+ */
+
+static void 
+lloyd_cluster ( const RGB_Image *in_img, RGB_Cluster *clusters, const int num_colors, 
+		const MKM_Options *options, const Color_Hist *hist, Thread_Pool *pool, 
+		Arena *arena, MKM_Stats *stats )
+{
+ int j, t;
+ int num_iters, num_changes;
+ int size;
+ int *member;
+ const int *count;
+ long long total_changes = 0, num_dists = 0;
+ uint64_t sum_sq = 0;
+ double obj = DBL_MAX;
+ bool done;
+ RGB_Cluster *tmp_clusters, *cluster;
+ const RGB_Image *data;
+ Center_SoA soa;
+ Lloyd_Job job;
+
+ data = hist ? &hist->colors : in_img;
+ count = hist ? hist->count : NULL;
+
+ tmp_clusters = ( RGB_Cluster * ) arena_alloc ( arena, num_colors * sizeof ( RGB_Cluster ) );
+ member = ( int * ) arena_alloc ( arena, data->size * sizeof ( int ) );
+
+ job.data = data;
+ job.count = count;
+ job.member = member;
+ job.soa = &soa;
+ job.kernels = get_kernels ( );
+ job.num_colors = num_colors;
+ job.num_tasks = pool_num_tasks ( pool, data->size );
+ job.partial = ( RGB_Cluster * ) arena_alloc ( arena, job.num_tasks * num_colors * sizeof ( RGB_Cluster ) );
+ job.num_changes = ( int * ) arena_alloc ( arena, job.num_tasks * sizeof ( int ) );
+ job.sum_sq = ( uint64_t * ) arena_alloc ( arena, job.num_tasks * sizeof ( uint64_t ) );
+
+ soa_init ( &soa, clusters, num_colors, arena );
+ num_iters = 0;
+
+ /* Clustering pixel data using Lloyd's k-means algorithm */
+ do
+  {
+   num_iters++;
+   num_changes = 0;
+
+   /* Assign the pixels in parallel and combine the partial results */
+   job.first_iter = num_iters == 1;
+   pool_run ( pool, lloyd_task, &job, job.num_tasks );
+   reduce_partials ( job.partial, job.num_tasks, num_colors, tmp_clusters );
+
+   for ( t = 0; t < job.num_tasks; t++ )
+    {
+     num_changes += job.num_changes[t];
+     sum_sq += job.first_iter ? job.sum_sq[t] : 0;
+    }
+
+   total_changes += num_changes;
+   num_dists += ( long long ) data->size * num_colors;
+   done = lloyd_stop ( options, tmp_clusters, num_colors, sum_sq, num_iters, num_changes, &obj );
+
+   /* Update all centers */
+   for ( j = 0; j < num_colors; j++ )
+    {
+     cluster = &tmp_clusters[j];
+     if ( ( size = cluster->size ) != 0 )
+      {
+       clusters[j].center.red = cluster->center.red / size;
+       clusters[j].center.green = cluster->center.green / size;
+       clusters[j].center.blue = cluster->center.blue / size;
+       soa_set ( &soa, j, &clusters[j].center );
+      }
+    }
+  }
+ while ( !done );
+    
+ stats->num_iters = num_iters;
+ stats->num_changes = total_changes;
+ stats->num_dists = num_dists;
+ stats->objective = obj;
+}
+
+/* Color quantization using Lloyd's k-means algorithm accelerated by Hamerly's bounds */
+/* 
+   For details of the acceleration, see
+   G. Hamerly, Making k-means Even Faster, 
+   Proceedings of the 2010 SIAM International Conference on Data Mining, pp. 130-140, 2010.
+
+   The arguments have the same meaning as in lloyd_cluster.
+
+   Each pixel keeps an upper bound on the distance to its assigned center and 
+   a lower bound on the distance to every other center. A pixel is skipped 
+   when its upper bound is less than the larger of its lower bound and half 
+   the distance from its center to the nearest other center. The skip tests 
+   are strict and the centroid sums are exact, so the result is identical 
+   to that of lloyd_cluster. The pixels that are not skipped are rescanned 
+   with the NEAREST2 kernel of the SIMD level in use.
+ */
+
+/* Safety margin for the bounds against round-off in the square roots */
+#define BOUND_SLACK 1e-9
+
+/* Bound maintenance and assignment step of hamerly_cluster, one band of pixels per task */
+
+typedef struct
+ {
+  const RGB_Image *data;
+  const int *count;
+  int *member;
+  double *upper;
+  double *lower;
+  const RGB_Cluster *clusters;
+  const Center_SoA *soa; /* the centers, for the full rescans */
+  NN_Nearest2 nearest2;
+  const double *shift;
+  const double *half_sep;
+  RGB_Cluster *partial; /* NUM_TASKS x NUM_COLORS partial sums */
+  int *num_changes;     /* per task */
+  long long *num_dists; /* per task */
+  uint64_t *sum_sq;     /* per task ( first iteration ) */
+  int num_colors;
+  int num_tasks;
+  int first_iter;
+  int max_shift_index;
+  double max_shift;
+  double max_shift2;
+ } Hamerly_Job;
+
+static void
+hamerly_task ( void *arg, const int task )
+{
+ int begin, end, min_dist_index, weight, num_changes = 0;
+ long long num_dists = 0;
+ double min_dist, min_dist2, dist, bound;
+ double delta_red, delta_green, delta_blue;
+ RGB_Pixel8 in_pix;
+ const RGB_Cluster *center;
+ RGB_Cluster *cluster;
+ const Hamerly_Job *job = ( const Hamerly_Job * ) arg;
+ const RGB_Cluster *clusters = job->clusters;
+ int *member = job->member;
+ double *upper = job->upper;
+ double *lower = job->lower;
+ RGB_Cluster *tmp_clusters = &job->partial[task * job->num_colors];
+
+ /* Reset the new clusters */ 
+ reset_clusters ( tmp_clusters, job->num_colors );
+
+ task_range ( task, job->num_tasks, job->data->size, &begin, &end );
+ if ( job->first_iter )
+  {
+   job->sum_sq[task] = sum_squares ( job->data, job->count, begin, end );
+  }
+
+ for ( int i = begin; i < end; i++ )
+  {
+   /* Cache the pixel */
+   in_pix = job->data->data[i];
+   weight = job->count ? job->count[i] : 1;
+   min_dist_index = member[i];
+
+   if ( !job->first_iter )
+    {
+     /* Account for the center movements in the previous iteration */
+     upper[i] += job->shift[min_dist_index];
+     lower[i] -= ( min_dist_index == job->max_shift_index ) ? job->max_shift2 : job->max_shift;
+
+     bound = job->half_sep[min_dist_index] < lower[i] ? lower[i] : job->half_sep[min_dist_index];
+     if ( upper[i] < bound )
+      {
+       goto accumulate;
+      }
+
+     /* Tighten the upper bound and try again */
+     center = &clusters[min_dist_index];
+     delta_red = in_pix.red - center->center.red;
+     delta_green = in_pix.green - center->center.green;
+     delta_blue = in_pix.blue - center->center.blue;
+     dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+     upper[i] = sqrt ( dist ) + BOUND_SLACK;
+     num_dists++;
+     if ( upper[i] < bound )
+      {
+       goto accumulate;
+      }
+    }
+
+   /* Find the nearest and the second nearest centers */
+   min_dist_index = job->nearest2 ( job->soa, &in_pix, &min_dist, &min_dist2 );
+   upper[i] = sqrt ( min_dist ) + BOUND_SLACK;
+   lower[i] = sqrt ( min_dist2 ) - BOUND_SLACK;
+   num_dists += job->num_colors;
+
+   if ( job->first_iter || ( member[i] != min_dist_index ) )
+    {
+     /* Update the membership of the pixel */
+     member[i] = min_dist_index;
+     num_changes += weight;
+    }
+
+   accumulate:
+   /* Update the temp center of the nearest cluster */
+   cluster = &tmp_clusters[min_dist_index];
+   cluster->center.red += weight * in_pix.red;
+   cluster->center.green += weight * in_pix.green;
+   cluster->center.blue += weight * in_pix.blue;
+   cluster->size += weight;
+  }
+
+ job->num_changes[task] = num_changes;
+ job->num_dists[task] = num_dists;
+}
+
+/* 
+   Half the distance from each center to its nearest other center. Each 
+   pair of centers is visited once: task T takes rows J and NUM_COLORS - 1 - J 
+   of the upper triangle for a band of J, so that the tasks get the same 
+   # pairs, and keeps its own minimum for every center in PARTIAL; a 
+   second pass takes the minima over the tasks by bands of centers.
+ */
+
+typedef struct
+ {
+  const RGB_Cluster *clusters;
+  double *partial; /* NUM_TASKS x NUM_COLORS squared distances */
+  double *half_sep;
+  int num_colors;
+  int num_tasks;
+ } Sep_Job;
+
+static void
+sep_task ( void *arg, const int task )
+{
+ int begin, end, j;
+ double dist, row_sep;
+ double delta_red, delta_green, delta_blue;
+ RGB_Pixel center;
+ const Sep_Job *job = ( const Sep_Job * ) arg;
+ const int num_colors = job->num_colors;
+ double *sep = &job->partial[task * num_colors];
+
+ for ( j = 0; j < num_colors; j++ )
+  {
+   sep[j] = DBL_MAX;
+  }
+
+ task_range ( task, job->num_tasks, ( num_colors + 1 ) / 2, &begin, &end );
+ for ( int p = begin; p < end; p++ )
+  {
+   for ( int r = 0; r < 2; r++ )
+    {
+     j = r ? num_colors - 1 - p : p;
+     if ( r && j == p )
+      {
+       break;
+      }
+
+     center = job->clusters[j].center;
+     row_sep = sep[j];
+     for ( int k = j + 1; k < num_colors; k++ )
+      {
+       delta_red = center.red - job->clusters[k].center.red;
+       delta_green = center.green - job->clusters[k].center.green;
+       delta_blue = center.blue - job->clusters[k].center.blue;
+       dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+
+       if ( dist < row_sep )
+	{
+	 row_sep = dist;
+	}
+
+       if ( dist < sep[k] )
+	{
+	 sep[k] = dist;
+	}
+      }
+
+     sep[j] = row_sep;
+    }
+  }
+}
+
+static void
+sep_reduce_task ( void *arg, const int task )
+{
+ int begin, end;
+ double sep;
+ const Sep_Job *job = ( const Sep_Job * ) arg;
+
+ task_range ( task, job->num_tasks, job->num_colors, &begin, &end );
+ for ( int j = begin; j < end; j++ )
+  {
+   sep = DBL_MAX;
+   for ( int t = 0; t < job->num_tasks; t++ )
+    {
+     sep = std::min ( sep, job->partial[t * job->num_colors + j] );
+    }
+
+   job->half_sep[j] = 0.5 * sqrt ( sep ) - BOUND_SLACK;
+  }
+}
+
+static void 
+hamerly_cluster ( const RGB_Image *in_img, RGB_Cluster *clusters, const int num_colors, 
+		  const MKM_Options *options, const Color_Hist *hist, Thread_Pool *pool, 
+		  Arena *arena, MKM_Stats *stats )
+{
+ int j, t, max_shift_index;
+ int num_iters, num_changes;
+ int size;
+ int *member;
+ const int *count;
+ double dist;
+ double delta_red, delta_blue, delta_green;
+ double max_shift, max_shift2;
+ double *upper, *lower, *shift, *half_sep;
+ long long total_changes = 0, num_dists = 0;
+ uint64_t sum_sq = 0;
+ double obj = DBL_MAX;
+ bool done;
+ RGB_Cluster *tmp_clusters, *cluster;
+ RGB_Pixel old_center;
+ const RGB_Image *data;
+ Center_SoA soa;
+ Hamerly_Job job;
+ Sep_Job sep_job;
+
+ data = hist ? &hist->colors : in_img;
+ count = hist ? hist->count : NULL;
+
+ tmp_clusters = ( RGB_Cluster * ) arena_alloc ( arena, num_colors * sizeof ( RGB_Cluster ) );
+ shift = ( double * ) arena_alloc ( arena, num_colors * sizeof ( double ) );
+ half_sep = ( double * ) arena_alloc ( arena, num_colors * sizeof ( double ) );
+ member = ( int * ) arena_alloc ( arena, data->size * sizeof ( int ) );
+ upper = ( double * ) arena_alloc ( arena, data->size * sizeof ( double ) );
+ lower = ( double * ) arena_alloc ( arena, data->size * sizeof ( double ) );
+
+ job.data = data;
+ job.count = count;
+ job.member = member;
+ job.upper = upper;
+ job.lower = lower;
+ job.clusters = clusters;
+ job.soa = &soa;
+ job.nearest2 = num_colors <= get_kernels ( )->scalar_max_colors ? nearest2_scalar : get_kernels ( )->nearest2;
+ job.shift = shift;
+ job.half_sep = half_sep;
+ job.num_colors = num_colors;
+ job.num_tasks = pool_num_tasks ( pool, data->size );
+ job.partial = ( RGB_Cluster * ) arena_alloc ( arena, job.num_tasks * num_colors * sizeof ( RGB_Cluster ) );
+ job.num_changes = ( int * ) arena_alloc ( arena, job.num_tasks * sizeof ( int ) );
+ job.num_dists = ( long long * ) arena_alloc ( arena, job.num_tasks * sizeof ( long long ) );
+ job.sum_sq = ( uint64_t * ) arena_alloc ( arena, job.num_tasks * sizeof ( uint64_t ) );
+
+ /* One task per thread, as the pairs are split evenly */
+ sep_job.clusters = clusters;
+ sep_job.half_sep = half_sep;
+ sep_job.num_colors = num_colors;
+ sep_job.num_tasks = std::min ( pool ? pool->num_threads : 1, ( num_colors + 1 ) / 2 );
+ sep_job.partial = ( double * ) arena_alloc ( arena, sep_job.num_tasks * num_colors * sizeof ( double ) );
+
+ soa_init ( &soa, clusters, num_colors, arena );
+ num_iters = 0;
+ max_shift = max_shift2 = 0.0;
+ max_shift_index = -1;
+
+ do
+  {
+   num_iters++;
+   num_changes = 0;
+
+   /* Half the distance from each center to its nearest neighboring center */
+   if ( 1 < num_iters )
+    {
+     pool_run ( pool, sep_task, &sep_job, sep_job.num_tasks );
+     pool_run ( pool, sep_reduce_task, &sep_job, sep_job.num_tasks );
+    }
+
+   /* Update the bounds and assign the pixels in parallel */
+   job.first_iter = num_iters == 1;
+   job.max_shift_index = max_shift_index;
+   job.max_shift = max_shift;
+   job.max_shift2 = max_shift2;
+   pool_run ( pool, hamerly_task, &job, job.num_tasks );
+   reduce_partials ( job.partial, job.num_tasks, num_colors, tmp_clusters );
+
+   for ( t = 0; t < job.num_tasks; t++ )
+    {
+     num_changes += job.num_changes[t];
+     num_dists += job.num_dists[t];
+     sum_sq += job.first_iter ? job.sum_sq[t] : 0;
+    }
+
+   total_changes += num_changes;
+   done = lloyd_stop ( options, tmp_clusters, num_colors, sum_sq, num_iters, num_changes, &obj );
+
+   /* Update all centers and record how far each one moved */
+   max_shift = max_shift2 = 0.0;
+   max_shift_index = -1;
+   for ( j = 0; j < num_colors; j++ )
+    {
+     cluster = &tmp_clusters[j];
+     shift[j] = 0.0;
+     if ( ( size = cluster->size ) != 0 )
+      {
+       old_center = clusters[j].center;
+       clusters[j].center.red = cluster->center.red / size;
+       clusters[j].center.green = cluster->center.green / size;
+       clusters[j].center.blue = cluster->center.blue / size;
+       soa_set ( &soa, j, &clusters[j].center );
+
+       delta_red = clusters[j].center.red - old_center.red;
+       delta_green = clusters[j].center.green - old_center.green;
+       delta_blue = clusters[j].center.blue - old_center.blue;
+       dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+       shift[j] = sqrt ( dist ) + BOUND_SLACK;
+      }
+
+     if ( max_shift < shift[j] )
+      {
+       max_shift2 = max_shift;
+       max_shift = shift[j];
+       max_shift_index = j;
+      }
+     else if ( max_shift2 < shift[j] )
+      {
+       max_shift2 = shift[j];
+      }
+    }
+  }
+ while ( !done );
+    
+ stats->num_iters = num_iters;
+ stats->num_changes = total_changes;
+ stats->num_dists = num_dists;
+ stats->objective = obj;
+}
+
+/* Gap to the next pixel that enters the reservoir ( geometric with parameter WEIGHT ) */
+static long long
+reservoir_gap ( MT_State *rng, const double weight )
+{
+ double gap = floor ( log ( 1.0 - genrand_real2 ( rng ) ) / log ( 1.0 - weight ) );
+
+ return gap < ( double ) ( LLONG_MAX / 2 ) ? ( long long ) gap : LLONG_MAX / 2;
+}
+
+/* 
+   The quantizer behind the interface of mkm.h. Its working memory is in 
+   three arenas: SCRATCH for what a single call needs, STATE for the 
+   result of the last clustering ( the palette, the histogram and, when 
+   the caller's rows are not contiguous, a packed copy of the image ) 
+   and SAMPLE_ARENA for the reservoir of the sampling mode. Each one is 
+   reset when its contents are replaced. Errors are reported before 
+   anything is changed where possible; an allocation failure in the 
+   middle of a clustering leaves the quantizer without a palette.
+ */
+
+struct MKM_Quantizer
+ {
+  MKM_Options options;
+  Thread_Pool *pool;
+  unsigned long long *sse;  /* per mapping task */
+  Arena scratch, state, sample_arena, seed_arena, schedule_arena;
+  uint16_t *cache;          /* inverse colormap, or NULL */
+  bool cache_dirty;         /* CACHE has entries */
+  bool cache_stale;         /* ... which may belong to an earlier palette */
+
+  /* Last clustering */
+  int num_colors;           /* 0 if there is no palette */
+  RGB_Cluster *clusters;
+  RGB_Pixel8 *palette;      /* truncated centers */
+  Center_SoA soa;
+  bool have_image;          /* IMG is the clustered image */
+  RGB_Image img;
+  Color_Hist *hist;         /* histogram of IMG, or NULL */
+  int *color_index;         /* palette index of each histogram color, or NULL */
+  long long num_pixels;     /* # pixels the palette was made for */
+  RGB_Cluster *seeds;       /* warm start of the next clustering, or NULL */
+
+  /* Quasirandom presentation order ( see get_schedule ) */
+  int *schedule;            /* pixel indices, or NULL */
+  int schedule_width, schedule_height, schedule_size;
+
+  /* Reservoir sampling ( see mkm_sample_begin ) */
+  bool sampling;
+  RGB_Image sample;
+  int width, height;
+  long long total, num_read, next;
+  double weight;
+  uint64_t sum[3];
+  MT_State rng;
+
+  MKM_Stats stats;
+ };
+
+void
+mkm_default_options ( MKM_Options *options )
+{
+ options->algorithm = MKM_MACQUEEN;
+ options->num_colors = 256;
+ options->init = MKM_INIT_MAXIMIN;
+ options->init_rate = 0.05;
+ options->pres_order = 0;
+ options->lr_exp = 0.5;
+ options->sample_rate = 1.0;
+ options->seed = 0;
+ options->use_prune = -1;
+ options->max_iters = INT_MAX;
+ options->use_hist = 0;
+ options->batch_size = 1024;
+ options->num_batches = 0;
+ options->warm_start = 0;
+ options->warm_decay = 0.1;
+ options->tolerance = 0.0;
+ options->trace = NULL;
+ options->trace_arg = NULL;
+ options->probe = NULL;
+ options->probe_arg = NULL;
+ options->use_cache = -1;
+ options->num_threads = 1;
+}
+
+static bool
+valid_options ( const MKM_Options *options )
+{
+ return options && 
+	MKM_MACQUEEN <= options->algorithm && options->algorithm <= MKM_MINIBATCH && 
+	2 <= options->num_colors && options->num_colors <= MKM_MAX_COLORS && 
+	MKM_INIT_MAXIMIN <= options->init && options->init <= MKM_INIT_WU && 
+	0.0 < options->init_rate && options->init_rate <= 1.0 && 
+	( options->pres_order == 0 || options->pres_order == 1 ) && 
+	0.5 <= options->lr_exp && options->lr_exp <= 1.0 && 
+	0.0 < options->sample_rate && options->sample_rate <= 1.0 && 
+	-1 <= options->use_prune && options->use_prune <= 1 && 
+	1 <= options->max_iters && 0.0 <= options->tolerance && options->tolerance < 1.0 && 
+	( options->use_hist == 0 || options->use_hist == 1 ) && 
+	1 <= options->batch_size && 0 <= options->num_batches && 
+	( options->warm_start == 0 || options->warm_start == 1 ) && 
+	0.0 <= options->warm_decay && options->warm_decay <= 1.0 && 
+	-1 <= options->use_cache && options->use_cache <= 1 && 
+	1 <= options->num_threads;
+}
+
+static bool
+valid_image ( const MKM_Image *image )
+{
+ return image && image->pixels && 0 < image->width && 0 < image->height && 
+	image->height <= INT_MAX / image->width && 
+	3 * ( size_t ) image->width <= image->stride;
+}
+
+/* ( Re )start the thread pool and the per-task sums for OPTIONS->NUM_THREADS threads */
+static void
+start_threads ( MKM_Quantizer *quantizer, const int num_threads )
+{
+ pool_destroy ( quantizer->pool );
+ free ( quantizer->sse );
+ quantizer->pool = NULL;
+ quantizer->sse = NULL;
+
+ quantizer->sse = ( unsigned long long * ) 
+  malloc ( TASKS_PER_THREAD * num_threads * sizeof ( unsigned long long ) );
+ if ( !quantizer->sse )
+  {
+   throw std::bad_alloc ( );
+  }
+
+ if ( 1 < num_threads )
+  {
+   quantizer->pool = pool_create ( num_threads );
+  }
+}
+
+MKM_Status
+mkm_create ( const MKM_Options *options, MKM_Quantizer **quantizer )
+{
+ MKM_Quantizer *q;
+
+ if ( !valid_options ( options ) || !quantizer )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ *quantizer = NULL;
+ q = new ( std::nothrow ) MKM_Quantizer ( );
+ if ( !q )
+  {
+   return MKM_ERROR_MEMORY;
+  }
+
+ q->options = *options;
+ arena_init ( &q->scratch );
+ arena_init ( &q->state );
+ arena_init ( &q->sample_arena );
+ arena_init ( &q->seed_arena );
+ arena_init ( &q->schedule_arena );
+
+ try
+  {
+   start_threads ( q, options->num_threads );
+  }
+ catch ( const std::bad_alloc & )
+  {
+   mkm_destroy ( q );
+   return MKM_ERROR_MEMORY;
+  }
+ catch ( const std::system_error & )
+  {
+   mkm_destroy ( q );
+   return MKM_ERROR_THREADS;
+  }
+
+ *quantizer = q;
+
+ return MKM_OK;
+}
+
+void
+mkm_destroy ( MKM_Quantizer *quantizer )
+{
+ if ( !quantizer )
+  {
+   return;
+  }
+
+ pool_destroy ( quantizer->pool );
+ free ( quantizer->sse );
+ free ( quantizer->cache );
+ arena_free ( &quantizer->scratch );
+ arena_free ( &quantizer->state );
+ arena_free ( &quantizer->sample_arena );
+ arena_free ( &quantizer->seed_arena );
+ arena_free ( &quantizer->schedule_arena );
+ delete quantizer;
+}
+
+MKM_Status
+mkm_set_options ( MKM_Quantizer *quantizer, const MKM_Options *options )
+{
+ if ( !quantizer || !valid_options ( options ) )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ if ( options->num_threads != quantizer->options.num_threads )
+  {
+   try
+    {
+     start_threads ( quantizer, options->num_threads );
+    }
+   catch ( const std::bad_alloc & )
+    {
+     return MKM_ERROR_MEMORY;
+    }
+   catch ( const std::system_error & )
+    {
+     return MKM_ERROR_THREADS;
+    }
+  }
+
+ quantizer->options = *options;
+
+ return MKM_OK;
+}
+
+/* 
+   Point IMG at rows [FIRST_ROW, FIRST_ROW + NUM_ROWS) of IMAGE, copying 
+   them into ARENA if they are not contiguous
+ */
+static void
+pack_rows ( const MKM_Image *image, const int first_row, const int num_rows, 
+	    RGB_Image *img, Arena *arena )
+{
+ const size_t row_bytes = 3 * ( size_t ) image->width;
+ const uint8_t *rows = image->pixels + first_row * image->stride;
+
+ img->width = image->width;
+ img->height = num_rows;
+ img->size = image->width * num_rows;
+
+ /* The library only reads the pixels */
+ if ( image->stride == row_bytes || num_rows == 1 )
+  {
+   img->data = ( RGB_Pixel8 * ) rows;
+   return;
+  }
+
+ img->data = ( RGB_Pixel8 * ) arena_alloc ( arena, img->size * sizeof ( RGB_Pixel8 ) );
+ for ( int row = 0; row < num_rows; row++ )
+  {
+   memcpy ( img->data + row * image->width, rows + row * image->stride, row_bytes );
+  }
+}
+
+/* 
+   Keep the centers of the last clustering as the seeds of the next one 
+   if a warm start was asked for and they are as many as needed. Their 
+   sizes are scaled by WARM_DECAY ( but kept at least 1, as after maximin ), 
+   so that the new image can move them.
+ */
+static void
+save_seeds ( MKM_Quantizer *q )
+{
+ const int num_colors = q->options.num_colors;
+
+ q->seeds = NULL;
+ if ( !q->options.warm_start || q->num_colors != num_colors )
+  {
+   return;
+  }
+
+ arena_reset ( &q->seed_arena );
+ q->seeds = ( RGB_Cluster * ) arena_alloc ( &q->seed_arena, num_colors * sizeof ( RGB_Cluster ) );
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   q->seeds[j].center = q->clusters[j].center;
+   q->seeds[j].size = std::max ( 1, ( int ) ( q->options.warm_decay * q->clusters[j].size ) );
+  }
+}
+
+/* Forget the last clustering */
+static void
+clear_palette ( MKM_Quantizer *q )
+{
+ q->num_colors = 0;
+ q->have_image = false;
+ q->hist = NULL;
+ q->color_index = NULL;
+ memset ( &q->stats, 0, sizeof ( q->stats ) );
+ arena_reset ( &q->scratch );
+ arena_reset ( &q->state );
+}
+
+/* 
+   The first NUM_PRES steps of the quasirandom presentation order of IMG, 
+   or NULL to draw them on the fly. The order only depends on the 
+   dimensions of the image, so Q keeps the longest schedule asked for, 
+   which serves every image of the same dimensions at any sampling rate 
+   up to that one, e.g. the frames of a video or the runs of a batch. 
+   Schedules of more than MAX_SCHEDULE steps are not kept. Unless KEEP, 
+   the image is a one-off ( a sample ) and its schedule is built in the 
+   scratch arena instead, to go with the rest of the clustering's memory.
+ */
+
+#define MAX_SCHEDULE ( 1 << 22 )
+
+static const int *
+get_schedule ( MKM_Quantizer *q, const RGB_Image *img, const int num_pres, const bool keep )
+{
+ int *schedule;
+ Pres_State pres;
+
+ if ( q->options.pres_order != 0 || MAX_SCHEDULE < num_pres )
+  {
+   return NULL;
+  }
+
+ if ( !keep )
+  {
+   schedule = ( int * ) arena_alloc ( &q->scratch, num_pres * sizeof ( int ) );
+   pres_init ( &pres, img, 0, 0 );
+   pres_block ( &pres, schedule, num_pres );
+
+   return schedule;
+  }
+
+ if ( q->schedule && q->schedule_width == img->width && q->schedule_height == img->height && 
+      num_pres <= q->schedule_size )
+  {
+   return q->schedule;
+  }
+
+ q->schedule = NULL;
+ arena_reset ( &q->schedule_arena );
+ q->schedule = ( int * ) arena_alloc ( &q->schedule_arena, num_pres * sizeof ( int ) );
+ q->schedule_width = img->width;
+ q->schedule_height = img->height;
+ q->schedule_size = num_pres;
+
+ pres_init ( &pres, img, 0, 0 );
+ pres_block ( &pres, q->schedule, num_pres );
+
+ return q->schedule;
+}
+
+/* 
+   Phases are timed here rather than in the algorithms, which only count. 
+   The probe of the options ( if any ) is called on both sides of each 
+   phase, outside of the timed interval.
+ */
+
+static high_resolution_clock::time_point
+phase_begin ( const MKM_Quantizer *q, const int phase )
+{
+ if ( q->options.probe )
+  {
+   q->options.probe ( q->options.probe_arg, phase, 0 );
+  }
+
+ return high_resolution_clock::now ( );
+}
+
+static double
+phase_end ( const MKM_Quantizer *q, const int phase, 
+	    const high_resolution_clock::time_point start )
+{
+ double time = elapsed_ms ( start );
+
+ if ( q->options.probe )
+  {
+   q->options.probe ( q->options.probe_arg, phase, 1 );
+  }
+
+ return time;
+}
+
+/* 
+   Run the chosen clustering algorithm on IMG and keep its palette. 
+   ONE_OFF: IMG is not clustered again ( see get_schedule ).
+ */
+static void
+find_palette ( MKM_Quantizer *q, const RGB_Image *img, const RGB_Pixel *mean, 
+	       const double sample_rate, const bool one_off )
+{
+ int num_batches;
+ const RGB_Image *data;
+ const MKM_Options *options = &q->options;
+ const int num_colors = options->num_colors;
+ const bool lloyd = options->algorithm == MKM_LLOYD || options->algorithm == MKM_HAMERLY;
+
+ q->clusters = ( RGB_Cluster * ) arena_alloc ( &q->state, num_colors * sizeof ( RGB_Cluster ) );
+
+ /* Lloyd's algorithm can run on the distinct colors */
+ if ( lloyd && options->use_hist )
+  {
+   auto start = phase_begin ( q, MKM_PHASE_HIST );
+   q->hist = build_hist ( img, &q->state, &q->scratch );
+   q->stats.hist_time = phase_end ( q, MKM_PHASE_HIST, start );
+   q->stats.num_unique = q->hist->colors.size;
+  }
+
+ data = q->hist ? &q->hist->colors : img;
+
+ auto start = phase_begin ( q, MKM_PHASE_INIT );
+ init_centers ( data, q->hist ? q->hist->count : NULL, q->clusters, num_colors, mean, q->seeds, 
+	       options, q->pool, &q->scratch );
+ q->stats.init_time = phase_end ( q, MKM_PHASE_INIT, start );
+
+ start = phase_begin ( q, MKM_PHASE_CLUSTER );
+ switch ( options->algorithm )
+  {
+   case MKM_MACQUEEN:
+    macqueen_cluster ( img, q->clusters, num_colors, options->pres_order, options->lr_exp, 
+		       sample_rate, options->seed, options->use_prune, 
+		       get_schedule ( q, img, ( int ) ( img->size * sample_rate ), !one_off ), 
+		       &q->scratch, &q->stats );
+    break;
+   case MKM_LLOYD:
+    lloyd_cluster ( img, q->clusters, num_colors, options, q->hist, q->pool, 
+		    &q->scratch, &q->stats );
+    break;
+   case MKM_MINIBATCH:
+    /* By default, as many samples as Macqueen's algorithm would take */
+    num_batches = options->num_batches;
+    if ( num_batches == 0 )
+     {
+      num_batches = std::max ( 1.0, ceil ( ( int ) ( img->size * sample_rate ) / 
+					    ( double ) options->batch_size ) );
+     }
+
+    minibatch_cluster ( img, q->clusters, num_colors, options->pres_order, options->lr_exp, 
+			options->batch_size, num_batches, options->seed, q->pool, 
+			&q->scratch, &q->stats );
+    break;
+   default:
+    hamerly_cluster ( img, q->clusters, num_colors, options, q->hist, q->pool, 
+		      &q->scratch, &q->stats );
+  }
+ q->stats.cluster_time = phase_end ( q, MKM_PHASE_CLUSTER, start );
+
+ /* The output colors are the truncated centers */
+ q->palette = ( RGB_Pixel8 * ) arena_alloc ( &q->state, num_colors * sizeof ( RGB_Pixel8 ) );
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   q->palette[j].red = ( uchar ) q->clusters[j].center.red;
+   q->palette[j].green = ( uchar ) q->clusters[j].center.green;
+   q->palette[j].blue = ( uchar ) q->clusters[j].center.blue;
+  }
+
+ soa_init ( &q->soa, q->clusters, num_colors, &q->state );
+ q->cache_stale = true;
+ q->num_colors = num_colors;
+}
+
+MKM_Status
+mkm_cluster ( MKM_Quantizer *quantizer, const MKM_Image *image )
+{
+ uint64_t sum[3];
+ RGB_Pixel mean;
+ MKM_Quantizer *q = quantizer;
+
+ if ( !q || !valid_image ( image ) )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ try
+  {
+   save_seeds ( q );
+   clear_palette ( q );
+   pack_rows ( image, 0, image->height, &q->img, &q->state );
+
+   /* Calculate center of mass */
+   sum_channels ( q->img.data, q->img.size, sum );
+   mean.red = ( double ) sum[0] / q->img.size;
+   mean.green = ( double ) sum[1] / q->img.size;
+   mean.blue = ( double ) sum[2] / q->img.size;
+
+   find_palette ( q, &q->img, &mean, q->options.sample_rate, false );
+   q->have_image = true;
+   q->num_pixels = q->img.size;
+  }
+ catch ( const std::bad_alloc & )
+  {
+   q->num_colors = 0;
+   return MKM_ERROR_MEMORY;
+  }
+
+ return MKM_OK;
+}
+
+/* Find the nearest center of each distinct color of the clustered image, once */
+static void
+map_hist_colors ( MKM_Quantizer *q )
+{
+ Map_Job job;
+
+ q->color_index = ( int * ) arena_alloc ( &q->state, q->hist->colors.size * sizeof ( int ) );
+
+ job.in_img = &q->hist->colors;
+ job.color_index = NULL;
+ job.hist_index = NULL;
+ job.palette = q->palette;
+ job.soa = &q->soa;
+ job.kernels = get_kernels ( );
+ job.cache = NULL;
+ job.out = NULL;
+ job.out_index = q->color_index;
+ job.index_size = sizeof ( int );
+ job.sse = NULL;
+ map_strip ( &job, 0, q->hist->colors.size, q->pool );
+}
+
+/* The inverse colormap for the current palette, or NULL if it is not worth it */
+static uint16_t *
+map_cache ( MKM_Quantizer *q )
+{
+ if ( q->options.use_cache == 0 || MAP_CACHE_MAX_COLORS <= q->num_colors || 
+      ( q->options.use_cache < 0 && q->num_pixels < MAP_CACHE_MIN_PIXELS ) )
+  {
+   return NULL;
+  }
+
+ if ( !q->cache )
+  {
+   /* The table is zero-filled lazily by the OS, only where it is touched */
+   q->cache = ( uint16_t * ) calloc ( MAP_CACHE_SIZE, sizeof ( uint16_t ) );
+   if ( !q->cache )
+    {
+     throw std::bad_alloc ( );
+    }
+  }
+ else if ( q->cache_stale && q->cache_dirty )
+  {
+   memset ( q->cache, 0, MAP_CACHE_SIZE * sizeof ( uint16_t ) );
+  }
+
+ q->cache_stale = false;
+ q->cache_dirty = true;
+
+ return q->cache;
+}
+
+static bool
+valid_output ( const MKM_Output *output, const int width, const int num_colors )
+{
+ return !output || 
+	( ( !output->rgb || 3 * ( size_t ) width <= output->rgb_stride ) && 
+	  ( !output->indices || 
+	    ( ( output->index_size == 2 || ( output->index_size == 1 && num_colors <= 256 ) ) && 
+	      output->index_size * ( size_t ) width <= output->index_stride ) ) );
+}
+
+MKM_Status
+mkm_map ( MKM_Quantizer *quantizer, const MKM_Image *image, 
+	  const int first_row, const int num_rows, const MKM_Output *output )
+{
+ int width, height, begin, end;
+ size_t row_bytes;
+ unsigned long long sse;
+ RGB_Image strip;
+ Map_Job job;
+ MKM_Quantizer *q = quantizer;
+
+ if ( !q || ( image && !valid_image ( image ) ) )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ if ( !q->num_colors || ( !image && !q->have_image ) )
+  {
+   return MKM_ERROR_STATE;
+  }
+
+ width = image ? image->width : q->img.width;
+ height = image ? image->height : q->img.height;
+ if ( first_row < 0 || num_rows < 1 || height - num_rows < first_row || 
+      !valid_output ( output, width, q->num_colors ) )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ try
+  {
+   auto start = phase_begin ( q, MKM_PHASE_MAP );
+
+   arena_reset ( &q->scratch );
+
+   job.palette = q->palette;
+   job.soa = &q->soa;
+   job.kernels = get_kernels ( );
+   job.color_index = NULL;
+   job.hist_index = NULL;
+   job.cache = NULL;
+   job.sse = q->sse;
+
+   if ( image )
+    {
+     pack_rows ( image, first_row, num_rows, &strip, &q->scratch );
+     job.in_img = &strip;
+     begin = 0;
+    }
+   else
+    {
+     /* The pixels of the clustered image can look up their histogram color */
+     job.in_img = &q->img;
+     begin = first_row * width;
+     if ( q->hist )
+      {
+       if ( !q->color_index )
+	{
+	 map_hist_colors ( q );
+	}
+
+       job.color_index = q->color_index;
+       job.hist_index = q->hist->index;
+      }
+    }
+
+   end = begin + num_rows * width;
+   if ( !job.color_index )
+    {
+     job.cache = map_cache ( q );
+    }
+
+   /* Write straight into the caller's buffers when their rows are contiguous */
+   job.out = NULL;
+   job.out_index = NULL;
+   job.index_size = 1;
+   if ( output && output->rgb )
+    {
+     job.out = output->rgb_stride == 3 * ( size_t ) width || num_rows == 1 ? 
+	       ( RGB_Pixel8 * ) output->rgb : 
+	       ( RGB_Pixel8 * ) arena_alloc ( &q->scratch, ( end - begin ) * sizeof ( RGB_Pixel8 ) );
+    }
+
+   if ( output && output->indices )
+    {
+     job.index_size = output->index_size;
+     job.out_index = output->index_stride == output->index_size * ( size_t ) width || num_rows == 1 ? 
+		     output->indices : 
+		     arena_alloc ( &q->scratch, ( end - begin ) * ( size_t ) output->index_size );
+    }
+
+   sse = map_strip ( &job, begin, end, q->pool );
+
+   if ( job.out && job.out != ( RGB_Pixel8 * ) output->rgb )
+    {
+     row_bytes = 3 * ( size_t ) width;
+     for ( int row = 0; row < num_rows; row++ )
+      {
+       memcpy ( output->rgb + row * output->rgb_stride, ( uint8_t * ) job.out + row * row_bytes, 
+		row_bytes );
+      }
+    }
+
+   if ( job.out_index && job.out_index != output->indices )
+    {
+     row_bytes = output->index_size * ( size_t ) width;
+     for ( int row = 0; row < num_rows; row++ )
+      {
+       memcpy ( ( uint8_t * ) output->indices + row * output->index_stride, 
+		( uint8_t * ) job.out_index + row * row_bytes, row_bytes );
+      }
+    }
+
+   q->stats.map_time += phase_end ( q, MKM_PHASE_MAP, start );
+   q->stats.num_mapped += end - begin;
+   q->stats.sse += sse;
+  }
+ catch ( const std::bad_alloc & )
+  {
+   return MKM_ERROR_MEMORY;
+  }
+
+ return MKM_OK;
+}
+
+MKM_Status
+mkm_quantize ( MKM_Quantizer *quantizer, const MKM_Image *image, 
+	       uint8_t *palette, const MKM_Output *output )
+{
+ MKM_Status status;
+
+ if ( !quantizer || !valid_image ( image ) || 
+      !valid_output ( output, image->width, quantizer->options.num_colors ) )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ status = mkm_cluster ( quantizer, image );
+ if ( status == MKM_OK )
+  {
+   status = mkm_map ( quantizer, NULL, 0, image->height, output );
+  }
+
+ if ( status == MKM_OK && palette )
+  {
+   status = mkm_get_palette ( quantizer, palette );
+  }
+
+ return status;
+}
+
+MKM_Status
+mkm_get_palette ( const MKM_Quantizer *quantizer, uint8_t *palette )
+{
+ if ( !quantizer || !palette )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ if ( !quantizer->num_colors )
+  {
+   return MKM_ERROR_STATE;
+  }
+
+ memcpy ( palette, quantizer->palette, quantizer->num_colors * sizeof ( RGB_Pixel8 ) );
+
+ return MKM_OK;
+}
+
+void
+mkm_get_stats ( const MKM_Quantizer *quantizer, MKM_Stats *stats )
+{
+ if ( quantizer && stats )
+  {
+   *stats = quantizer->stats;
+  }
+}
+
+/* 
+   Reservoir sampling with Algorithm L of K.-H. Li, Reservoir-Sampling 
+   Algorithms of Time Complexity O(n(1 + log(N/n))), ACM Transactions on 
+   Mathematical Software, vol. 20, no. 4, pp. 481-493, 1994. The first 
+   NUM_SAMPLE pixels fill the reservoir; then the gap to the next pixel 
+   that replaces a random one is geometric. When the sample is the whole 
+   image, it keeps the image's shape, so that the quasirandom order 
+   visits it as it would the image.
+ */
+
+MKM_Status
+mkm_sample_begin ( MKM_Quantizer *quantizer, const int width, const int height, 
+		   const int num_sample )
+{
+ MKM_Quantizer *q = quantizer;
+
+ if ( !q || width < 1 || height < 1 || num_sample < q->options.num_colors || 
+      ( long long ) width * height < num_sample )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ try
+  {
+   q->sampling = false;
+   arena_reset ( &q->sample_arena );
+   q->sample.data = ( RGB_Pixel8 * ) arena_alloc ( &q->sample_arena, num_sample * sizeof ( RGB_Pixel8 ) );
+  }
+ catch ( const std::bad_alloc & )
+  {
+   return MKM_ERROR_MEMORY;
+  }
+
+ q->sample.size = num_sample;
+ q->total = ( long long ) width * height;
+ if ( num_sample == q->total )
+  {
+   q->sample.width = width;
+   q->sample.height = height;
+  }
+ else
+  {
+   q->sample.width = num_sample;
+   q->sample.height = 1;
+  }
+
+ q->width = width;
+ q->height = height;
+ q->num_read = 0;
+ q->sum[0] = q->sum[1] = q->sum[2] = 0;
+
+ init_genrand ( &q->rng, q->options.seed );
+ q->weight = exp ( log ( 1.0 - genrand_real2 ( &q->rng ) ) / num_sample );
+ q->next = num_sample + reservoir_gap ( &q->rng, q->weight );
+ q->sampling = true;
+
+ return MKM_OK;
+}
+
+MKM_Status
+mkm_sample_add ( MKM_Quantizer *quantizer, const MKM_Image *rows )
+{
+ int num_runs, run_size;
+ long long i;
+ uint64_t sum[3];
+ const RGB_Pixel8 *run;
+ MKM_Quantizer *q = quantizer;
+
+ if ( !q || !valid_image ( rows ) )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ if ( !q->sampling )
+  {
+   return MKM_ERROR_STATE;
+  }
+
+ if ( rows->width != q->width || q->total - q->num_read < ( long long ) rows->width * rows->height )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ /* Contiguous rows are taken in one go */
+ if ( rows->stride == 3 * ( size_t ) rows->width )
+  {
+   num_runs = 1;
+   run_size = rows->width * rows->height;
+  }
+ else
+  {
+   num_runs = rows->height;
+   run_size = rows->width;
+  }
+
+ for ( int r = 0; r < num_runs; r++ )
+  {
+   run = ( const RGB_Pixel8 * ) ( rows->pixels + r * rows->stride );
+
+   sum_channels ( run, run_size, sum );
+   for ( int c = 0; c < 3; c++ )
+    {
+     q->sum[c] += sum[c];
+    }
+
+   for ( i = q->num_read; i < q->num_read + run_size && i < q->sample.size; i++ )
+    {
+     q->sample.data[i] = run[i - q->num_read];
+    }
+
+   for ( ; q->next < q->num_read + run_size; )
+    {
+     q->sample.data[bounded_rand ( &q->rng, q->sample.size )] = run[q->next - q->num_read];
+     q->weight *= exp ( log ( 1.0 - genrand_real2 ( &q->rng ) ) / q->sample.size );
+     q->next += 1 + reservoir_gap ( &q->rng, q->weight );
+    }
+
+   q->num_read += run_size;
+  }
+
+ return MKM_OK;
+}
+
+MKM_Status
+mkm_sample_cluster ( MKM_Quantizer *quantizer )
+{
+ RGB_Pixel mean;
+ MKM_Quantizer *q = quantizer;
+
+ if ( !q )
+  {
+   return MKM_ERROR_ARGUMENT;
+  }
+
+ if ( !q->sampling || q->num_read != q->total )
+  {
+   return MKM_ERROR_STATE;
+  }
+
+ mean.red = ( double ) q->sum[0] / q->total;
+ mean.green = ( double ) q->sum[1] / q->total;
+ mean.blue = ( double ) q->sum[2] / q->total;
+
+ try
+  {
+   save_seeds ( q );
+   clear_palette ( q );
+   find_palette ( q, &q->sample, &mean, 1.0, true );
+   q->num_pixels = q->total;
+
+   /* 
+      Give the clustering's working memory ( maximin's distances, the 
+      schedule, the learning rates ) back before the image is mapped, 
+      rather than keep a buffer that large for the mapping
+    */
+   arena_free ( &q->scratch );
+  }
+ catch ( const std::bad_alloc & )
+  {
+   q->num_colors = 0;
+   return MKM_ERROR_MEMORY;
+  }
+
+ return MKM_OK;
+}
+
+const char *
+mkm_status_string ( const MKM_Status status )
+{
+ switch ( status )
+  {
+   case MKM_OK:
+    return "Success";
+   case MKM_ERROR_ARGUMENT:
+    return "Invalid argument";
+   case MKM_ERROR_MEMORY:
+    return "Unable to allocate memory";
+   case MKM_ERROR_THREADS:
+    return "Unable to start the worker threads";
+   case MKM_ERROR_STATE:
+    return "No palette or sample to work with";
+   default:
+    return "Unknown error";
+  }
+}
@@ -1,321 +1,303 @@
 /* 
   To compile:
-  g++ -O3 -o mkm mkm.c -lm
+  g++ -O3 -pthread -o mkm mkm.c libmkm.c -lm
 
-  For a list of command line options: ./mkm
- */
-
-/* BEGIN: Copyright notice for the Mersenne Twister implementation */
-
-/* 
-   A C-program for MT19937, with initialization improved 2002/1/26.
-   Coded by Takuji Nishimura and Makoto Matsumoto.
-
-   Before using, initialize the state by using init_genrand(seed)  
-   or init_by_array(init_key, key_length).
-
-   Copyright (C) 1997 - 2002, Makoto Matsumoto and Takuji Nishimura,
-   All rights reserved.                          
-
-   Redistribution and use in source and binary forms, with or without
-   modification, are permitted provided that the following conditions
-   are met:
+  To verify the vectorized nearest-center kernels against the scalar ones 
+  on every call ( slow ): add -DCHECK_KERNELS
 
-     1. Redistributions of source code must retain the above copyright
-        notice, this list of conditions and the following disclaimer.
+  The quantization is done by the library in libmkm.c ( see mkm.h ); 
+  this program reads and writes the images and reports the results.
 
-     2. Redistributions in binary form must reproduce the above copyright
-        notice, this list of conditions and the following disclaimer in the
-        documentation and/or other materials provided with the distribution.
-
-     3. The names of its contributors may not be used to endorse or promote 
-        products derived from this software without specific prior written 
-        permission.
-
-   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
-   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
-   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
-   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
-   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
-   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
-   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
-   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
-   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
-   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
-   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
-
-
-   Any feedback is very welcome.
-   http://www.math.sci.hiroshima-u.ac.jp/~m-mat/MT/emt.html
-   email: m-mat @ math.sci.hiroshima-u.ac.jp (remove space)
-*/
-
-/* END: Copyright notice for the Mersenne Twister implementation */
+  For a list of command line options: ./mkm
+ */
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
 #include <math.h>
+#include <mutex>
+#include <string>
 #include <string.h>
-
-#define PRINT_TIME_INIT
-#define PRINT_TIME_CLUST
-/*
-#define PRINT_TIME_MAP
-#define PRINT_TIME_TOTAL
-*/
-#define PRINT_MSE
-#define PRINT_ITER
+#include <thread>
+#include <vector>
+
+#if defined ( __unix__ ) || defined ( __APPLE__ )
+#define HAVE_POSIX
+#define HAVE_MMAP
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#define HAVE_PERF
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "mkm.h"
 
 using namespace std::chrono;
 
 typedef unsigned char uchar;
 typedef unsigned long ulong;
 
-typedef struct 
- {
-  double red, green, blue;
- } RGB_Pixel;
+/* Exit with the library's message for STATUS unless it is MKM_OK */
+static void
+check_status ( const MKM_Status status )
+{
+ if ( status != MKM_OK )
+  {
+   fprintf ( stderr, "%s!\n", mkm_status_string ( status ) );
+   exit ( EXIT_FAILURE );
+  }
+}
 
-typedef struct 
- {
-  int size;
-  RGB_Pixel center;
- } RGB_Cluster;
+static double
+elapsed_ms ( const high_resolution_clock::time_point start )
+{
+ return duration_cast<microseconds> ( high_resolution_clock::now ( ) - start ).count ( ) / 1e3;
+}
 
-typedef struct 
- {
-  int width, height;
-  int size;
-  RGB_Pixel *data;
- } RGB_Image;
+/* 
+   Reporting. STATS_LEVEL ( -S ) selects what is printed: nothing ( 0 ), 
+   the statistics of the library ( 1 ), those and the mapping and total 
+   times ( 2 ), or a single JSON line ( 3 ) that adds the wall and CPU 
+   time of each phase, the bytes read and written and the peak resident 
+   set size. The phases of the library are measured through its probe 
+   ( see MKM_Probe ), and the reading and writing of the images here. 
+   With -P, hardware counters ( perf_event_open, Linux only ) are read 
+   around each phase as well; they count the calling thread only, so 
+   they mean most with a single thread. Unless one of them is asked for, 
+   the probe is left unset and nothing is measured beyond what the 
+   library always does.
+ */
+
+#define PHASE_READ MKM_NUM_PHASES
+#define PHASE_WRITE ( MKM_NUM_PHASES + 1 ) /* including the mapping */
+#define NUM_PHASES ( MKM_NUM_PHASES + 2 )
+#define NUM_COUNTERS 3
+
+static const char *phase_name[NUM_PHASES] = { "hist", "init", "cluster", "map", "read", "write" };
+static const char *counter_name[NUM_COUNTERS] = { "cycles", "instructions", "cache_misses" };
 
-/* Maximum possible RGB distance = 3 * 255 * 255 */
-#define MAX_RGB_DIST 195075 
+typedef struct
+ {
+  bool enabled;
+  int perf_fd[NUM_COUNTERS];   /* -1 if not available */
+  double wall[NUM_PHASES];     /* ms */
+  double cpu[NUM_PHASES];      /* ms, all threads */
+  long long count[NUM_PHASES][NUM_COUNTERS];
+  high_resolution_clock::time_point wall_start[NUM_PHASES];
+  clock_t cpu_start[NUM_PHASES];
+  long long count_start[NUM_PHASES][NUM_COUNTERS];
+  long long bytes_read, bytes_written;
+ } Report;
+
+static int stats_level = 1;
+static Report report;
+
+/* Start measuring the phases, with the hardware counters if PERF is set */
+static void
+report_open ( const bool perf )
+{
+ report.enabled = true;
+ for ( int c = 0; c < NUM_COUNTERS; c++ )
+  {
+   report.perf_fd[c] = -1;
+  }
 
-/* Mersenne Twister related constants */
-#define N 624
-#define M 397
-#define MATRIX_A 0x9908b0dfUL   /* constant vector a */
-#define UPPER_MASK 0x80000000UL /* most significant w-r bits */
-#define LOWER_MASK 0x7fffffffUL /* least significant r bits */
+ if ( !perf )
+  {
+   return;
+  }
 
-#define MAXBIT 30
+ #ifdef HAVE_PERF
+ const uint64_t config[NUM_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, 
+					  PERF_COUNT_HW_CACHE_MISSES };
+ struct perf_event_attr attr;
 
-static ulong mt[N]; /* the array for the state vector  */
-static int mti = N + 1; /* mti == N + 1 means mt[N] is not initialized */
+ for ( int c = 0; c < NUM_COUNTERS; c++ )
+  {
+   memset ( &attr, 0, sizeof ( attr ) );
+   attr.size = sizeof ( attr );
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.config = config[c];
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+
+   /* This thread, on any CPU */
+   report.perf_fd[c] = syscall ( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+   if ( report.perf_fd[c] < 0 )
+    {
+     fprintf ( stderr, "Warning: no %s counter (%s)\n", counter_name[c], strerror ( errno ) );
+    }
+  }
+ #else
+ fprintf ( stderr, "Warning: hardware counters need Linux\n" );
+ #endif
+}
 
-/* initializes mt[N] with a seed */
-void 
-init_genrand ( ulong s )
+static long long
+read_counter ( const int fd )
 {
- mt[0]= s & 0xffffffffUL;
- for ( mti = 1; mti < N; mti++ ) 
-  {
-   mt[mti] = 
-	     ( 1812433253UL * ( mt[mti - 1] ^ ( mt[mti - 1] >> 30 ) ) + mti ); 
-   /* See Knuth TAOCP Vol2. 3rd Ed. P.106 for multiplier. */
-   /* In the previous versions, MSBs of the seed affect   */
-   /* only MSBs of the array mt[].                        */
-   /* 2002/01/09 modified by Makoto Matsumoto             */
-   mt[mti] &= 0xffffffffUL;
-   /* for >32 bit machines */
+ long long value = 0;
+
+ #ifdef HAVE_PERF
+ if ( 0 <= fd && read ( fd, &value, sizeof ( value ) ) != sizeof ( value ) )
+  {
+   value = 0;
   }
+ #endif
+
+ return value;
 }
 
-ulong 
-genrand_int32 ( void )
+/* Mark the beginning ( END = 0 ) or the end ( END = 1 ) of PHASE ( an MKM_Probe ) */
+static void
+report_probe ( void *arg, int phase, int end )
 {
- ulong y;
- static ulong mag01[2] = { 0x0UL, MATRIX_A };
- /* mag01[x] = x * MATRIX_A  for x = 0, 1 */
+ Report *r = ( Report * ) arg;
 
- if ( mti >= N ) 
-  { /* generate N words at one time */
-   int kk;
+ if ( !r->enabled )
+  {
+   return;
+  }
 
-   if ( mti == N + 1 ) 
+ if ( !end )
+  {
+   for ( int c = 0; c < NUM_COUNTERS; c++ )
     {
-     /* if init_genrand ( ) has not been called, */
-     init_genrand ( 5489UL ); /* a default initial seed is used */
+     r->count_start[phase][c] = read_counter ( r->perf_fd[c] );
     }
 
-   for ( kk = 0; kk < N - M; kk++ ) 
-    {
-     y = ( mt[kk] & UPPER_MASK )|( mt[kk + 1] & LOWER_MASK );
-     mt[kk] = mt[kk+M] ^ ( y >> 1 ) ^ mag01[y & 0x1UL];
-    }
-   
-   for ( ; kk < N - 1; kk++ ) 
-    {
-     y = ( mt[kk] & UPPER_MASK )|( mt[kk + 1] & LOWER_MASK );
-     mt[kk] = mt[kk + ( M - N )] ^ ( y >> 1 ) ^ mag01[y & 0x1UL];
-    }
-    
-   y = ( mt[N - 1] & UPPER_MASK )|( mt[0] & LOWER_MASK );
-   mt[N - 1] = mt[M - 1] ^ ( y >> 1 ) ^ mag01[y & 0x1UL];
-   mti = 0;
+   r->cpu_start[phase] = clock ( );
+   r->wall_start[phase] = high_resolution_clock::now ( );
+   return;
   }
-  
- y = mt[mti++];
-
- /* Tempering */
- y ^= ( y >> 11 );
- y ^= ( y << 7 ) & 0x9d2c5680UL;
- y ^= ( y << 15 ) & 0xefc60000UL;
- y ^= ( y >> 18 );
 
- return y;
-}
-
-double 
-genrand_real2 ( void )
-{
- return genrand_int32 ( ) * ( 1.0 / 4294967296.0 );
- /* divided by 2^32 */
+ r->wall[phase] += elapsed_ms ( r->wall_start[phase] );
+ r->cpu[phase] += 1e3 * ( clock ( ) - r->cpu_start[phase] ) / CLOCKS_PER_SEC;
+ for ( int c = 0; c < NUM_COUNTERS; c++ )
+  {
+   r->count[phase][c] += read_counter ( r->perf_fd[c] ) - r->count_start[phase][c];
+  }
 }
 
-/* Function for generating a bounded random integer between 0 and RANGE */
-/* Source: http://www.pcg-random.org/posts/bounded-rands.html */
-
-uint32_t 
-bounded_rand ( const uint32_t range ) 
+/* Peak resident set size of the process ( KB ), or 0 if unknown */
+static long
+peak_rss_kb ( void )
 {
- uint32_t x = genrand_int32 ( );  
- uint64_t m = ( ( uint64_t ) x ) * ( ( uint64_t ) range );
- uint32_t l = ( uint32_t ) m;
+ #ifdef HAVE_POSIX
+ struct rusage usage;
 
- if ( l < range ) 
- {
-  uint32_t t = -range;
+ if ( !getrusage ( RUSAGE_SELF, &usage ) )
+  {
+   #ifdef __APPLE__
+   return usage.ru_maxrss / 1024;
+   #else
+   return usage.ru_maxrss;
+   #endif
+  }
+ #endif
 
-  if ( t >= range ) 
-   {
-    t -= range;
-    if ( t >= range ) 
-     {
-      t %= range;
-     }
-   }
-  
-  while ( l < t ) 
-   {
-    x = genrand_int32 ( );  
-    m = ( ( uint64_t ) x ) * ( ( uint64_t ) range );
-    l = ( uint32_t ) m;
-   }
- }
- 
- return m >> 32;
+ return 0;
 }
 
-/* 
-  Returns two quasirandom numbers from a 2D Sobol
-  sequence. Adapted from Numerical Recipies in C. 
- */
-
-void 
-sob_seq ( double *x, double *y ) 
+/* Size of the file FILENAME in bytes, or 0 if unknown */
+static long long
+file_size ( const char *filename )
 {
- int j, k, l;
- ulong i, im, ipp;
-
- /* 
-   The following variables are static since we want their
-   values to remain stored after the function returns. These
-   values represent the state of the quasirandom number generator. 
-  */
-
- static double fac;
- static int init = 0;
- static ulong ix1, ix2;
- static ulong in, *iu[2 * MAXBIT + 1];
- static ulong mdeg[3] = { 0, 1, 2 };
- static ulong ip[3] = { 0, 0, 1 };
- static ulong iv[2 * MAXBIT + 1] =
-     { 0, 1, 1, 1, 1, 1, 1, 3, 1, 3, 3, 1, 1, 5, 7, 7, 3, 3, 5, 15, 11, 5, 15, 13, 9 };
-
- /* Initialize the generator the first time the function is called */
- if ( !init ) 
-  {
-   init = 1;
-   for ( j = 1, k = 0; j <= MAXBIT; j++, k += 2 ) 
-    { 
-     iu[j] = &iv[k]; 
-    }
-    
-   for ( k = 1; k <= 2; k++ ) 
+ long long size = 0;
+ FILE *fp = fopen ( filename, "rb" );
+
+ if ( fp )
+  {
+   if ( !fseek ( fp, 0, SEEK_END ) )
     {
-     for ( j = 1; j <= mdeg[k]; j++ ) 
-      { 
-       iu[j][k] <<= ( MAXBIT - j ); 
-      }
+     size = std::max ( 0L, ftell ( fp ) );
+    }
 
-     for ( j = mdeg[k] + 1; j <= MAXBIT; j++ ) 
-      {
-       ipp = ip[k];
-       i = iu[j - mdeg[k]][k];
-       i ^= ( i >> mdeg[k] );
+   fclose ( fp );
+  }
 
-       for ( l = mdeg[k] - 1; l >= 1; l-- )
-        {
-	 if ( ipp & 1 ) 
-	  { 
-	   i ^= iu[j - l][k]; 
-	  } 
+ return size;
+}
 
-	 ipp >>= 1;
-	}
+/* Read a nonnegative integer from a PPM header, skipping white space and comments */
+static int
+read_header_int ( FILE *fp, int *value )
+{
+ int c;
 
-       iu[j][k] = i;
+ for ( ; ; )
+  {
+   c = getc ( fp );
+   if ( c == '#' )
+    {
+     while ( c != '\n' && c != EOF )
+      {
+       c = getc ( fp );
       }
     }
-
-   fac = 1.0 / ( 1L << MAXBIT );
-   in = 0;
+   else if ( c != ' ' && c != '\t' && c != '\r' && c != '\n' )
+    {
+     break;
+    }
   }
 
- /* Now calculate the next pair of numbers in the 2-D Sobol sequence */
+ if ( c < '0' || '9' < c )
+  {
+   return 0;
+  }
 
- im = in;
- for ( j = 1; j <= MAXBIT; j++ ) 
+ *value = 0;
+ while ( '0' <= c && c <= '9' )
   {
-   if ( !( im & 1 ) ) 
-    { 
-     break; 
+   if ( ( INT_MAX - ( c - '0' ) ) / 10 < *value )
+    {
+     return 0;
     }
 
-   im >>= 1;
+   *value = 10 * *value + ( c - '0' );
+   c = getc ( fp );
   }
 
- im = ( j - 1 ) * 2;
- *x = ( ix1 ^= iv[im + 1] ) * fac;
- *y = ( ix2 ^= iv[im + 2] ) * fac;
- 
- in++;
-
- /* X and Y will fall in [0,1] */
+ /* C is the single white space character that ends the token */
+ return c != EOF;
 }
 
-RGB_Image *
-read_PPM ( const char *filename, RGB_Pixel *mean )
+/* 
+   Read the header of a binary ( P6 ) PPM image from FP ( named FILENAME 
+   in the messages ), leaving FP at the first pixel. Returns 0 if FP is 
+   at its end, as after the last frame of a sequence.
+ */
+
+static int
+read_PPM_header ( FILE *fp, const char *filename, int *width, int *height )
 {
- uchar byte;
  char buff[16];
- int c, max_rgb_val, i = 0;
- FILE *fp;
- RGB_Pixel *pixel;
- RGB_Image *img;
+ int c, max_rgb_val;
 
- fp = fopen(filename, "rb");
- if ( !fp ) 
- {
-  fprintf ( stderr, "Unable to open file '%s'!\n", filename );
-  exit ( EXIT_FAILURE );
- }
+ c = getc ( fp );
+ if ( c == EOF )
+  {
+   return 0;
+  }
+
+ ungetc ( c, fp );
 
  /* read image format */
- if ( !fgets ( buff, sizeof ( buff ), fp ) ) 
+ if ( fread ( buff, 1, 2, fp ) != 2 ) 
   {
    perror ( filename );
    exit ( EXIT_FAILURE );
@@ -328,32 +310,16 @@ read_PPM ( const char *filename, RGB_Pixel *mean )
    exit ( EXIT_FAILURE );
   }
 
- img = ( RGB_Image * ) malloc ( sizeof ( RGB_Image ) );
- if ( !img ) 
-  {
-   fprintf ( stderr, "Unable to allocate memory!\n" );
-   exit ( EXIT_FAILURE );
-  }
-
- /* skip comments */
- c = getc(fp);
- while ( c == '#' ) 
-  {
-   while ( getc(fp) != '\n' );
-   c = getc ( fp );
-  }
-
- ungetc ( c, fp );
-
  /* read image dimensions */
- if (fscanf(fp, "%u %u", &img->width, &img->height) != 2) 
+ if ( !read_header_int ( fp, width ) || !read_header_int ( fp, height ) || 
+      *width < 1 || *height < 1 ) 
   {
    fprintf ( stderr, "Invalid image dimensions ('%s')!\n", filename );
    exit ( EXIT_FAILURE );
   }
 
  /* read maximum component value */
- if ( fscanf ( fp, "%d", &max_rgb_val ) != 1 ) 
+ if ( !read_header_int ( fp, &max_rgb_val ) ) 
   {
    fprintf ( stderr, "Invalid maximum R, G, B value ('%s')!\n", filename );
    exit ( EXIT_FAILURE );
@@ -366,567 +332,1366 @@ read_PPM ( const char *filename, RGB_Pixel *mean )
    exit ( EXIT_FAILURE );
   }
 
- while ( fgetc(fp) != '\n' );
+ return 1;
+}
+
+/* 
+   Open a binary ( P6 ) PPM image and read its header. Returns the file 
+   positioned at the first pixel.
+ */
+
+static FILE *
+open_PPM ( const char *filename, int *width, int *height )
+{
+ FILE *fp;
 
- /* allocate memory for pixel data */
- img->size = img->height * img->width;
- img->data = ( RGB_Pixel * ) malloc ( img->size * sizeof ( RGB_Pixel ) );
+ fp = fopen(filename, "rb");
+ if ( !fp ) 
+ {
+  fprintf ( stderr, "Unable to open file '%s'!\n", filename );
+  exit ( EXIT_FAILURE );
+ }
 
- if ( !img ) 
+ if ( !read_PPM_header ( fp, filename, width, height ) )
   {
-   fprintf ( stderr, "Unable to allocate memory!\n");
+   fprintf ( stderr, "Empty file '%s'!\n", filename );
    exit ( EXIT_FAILURE );
   }
 
- /* Read in pixels using buffer and calculate center of mass */
- mean->red = mean->green = mean->blue = 0.0;
- while ( fread ( &byte, 1, 1, fp ) && i < img->size )
-  {
-   pixel = &img->data[i];
-   mean->red += ( pixel->red = byte );
-   fread ( &byte, 1, 1, fp );
-   mean->green += ( pixel->green = byte );
-   fread ( &byte, 1, 1, fp );
-   mean->blue += ( pixel->blue = byte );
-   i++;
-  }
+ return fp;
+}
 
- mean->red /= img->size;
- mean->green /= img->size;
- mean->blue /= img->size;
+/* 
+   Image read from a PPM file. The pixels are either in a mapping of the 
+   file or in an allocated buffer.
+ */
 
- fclose ( fp );
+typedef struct
+ {
+  MKM_Image img;
+  void *map;       /* file mapping that holds the pixels, or NULL */
+  size_t map_size;
+ } PPM_Image;
 
- return img;
-}
+/* 
+   Read a binary ( P6 ) PPM image. When the file is a regular file, the 
+   payload is mapped into memory and used as the pixel buffer as is ( the 
+   mapping is private, so the file is never modified ). Pipes and other 
+   streams are read with a single large read into an allocated buffer 
+   instead. Images returned by read_PPM must be released with free_PPM.
+ */
 
-void 
-write_PPM ( const RGB_Image *img, const char *filename )
+PPM_Image *
+read_PPM ( const char *filename )
 {
- uchar byte;
+ int width, height;
+ long offset;
+ size_t num_bytes;
  FILE *fp;
+ PPM_Image *ppm;
 
- fp = fopen ( filename, "wb" );
- if ( !fp ) 
+ ppm = ( PPM_Image * ) malloc ( sizeof ( PPM_Image ) );
+ if ( !ppm ) 
   {
-   fprintf ( stderr, "Unable to open file '%s'!\n", filename );
+   fprintf ( stderr, "Unable to allocate memory!\n" );
    exit ( EXIT_FAILURE );
   }
 
- fprintf ( fp, "P6\n" );
- fprintf ( fp, "%d %d\n", img->width, img->height );
- fprintf ( fp, "%d\n", 255 );
+ fp = open_PPM ( filename, &width, &height );
+ if ( INT_MAX / width < height ) 
+  {
+   fprintf ( stderr, "Image too large ('%s'); try the streaming mode (-m)!\n", filename );
+   exit ( EXIT_FAILURE );
+  }
+
+ num_bytes = 3 * ( size_t ) width * height;
+ ppm->img.pixels = NULL;
+ ppm->img.width = width;
+ ppm->img.height = height;
+ ppm->img.stride = 3 * ( size_t ) width;
+ ppm->map = NULL;
+ ppm->map_size = 0;
+
+ #ifdef HAVE_MMAP
+ /* Map the whole file and point the pixel buffer at the payload */
+ struct stat st;
+
+ offset = ftell ( fp );
+ if ( 0 <= offset && !fstat ( fileno ( fp ), &st ) && S_ISREG ( st.st_mode ) )
+  {
+   if ( st.st_size < offset + ( off_t ) num_bytes )
+    {
+     fprintf ( stderr, "Truncated pixel data ('%s')!\n", filename );
+     exit ( EXIT_FAILURE );
+    }
+
+   ppm->map = mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno ( fp ), 0 );
+   if ( ppm->map == MAP_FAILED )
+    {
+     ppm->map = NULL;
+    }
+   else
+    {
+     ppm->map_size = st.st_size;
+     ppm->img.pixels = ( const uint8_t * ) ppm->map + offset;
+     #ifdef MADV_SEQUENTIAL
+     madvise ( ppm->map, ppm->map_size, MADV_SEQUENTIAL );
+     #endif
+    }
+  }
+ #else
+ ( void ) offset;
+ #endif
 
- for ( int i = 0; i < img->size; i++ )
+ if ( !ppm->img.pixels )
   {
-   byte = ( uchar ) img->data[i].red;
-   fwrite ( &byte, sizeof ( uchar ), 1, fp );
-   byte = ( uchar ) img->data[i].green;
-   fwrite ( &byte, sizeof ( uchar ), 1, fp );
-   byte = ( uchar ) img->data[i].blue;
-   fwrite ( &byte, sizeof ( uchar ), 1, fp );
+   /* allocate memory for pixel data */
+   uint8_t *pixels = ( uint8_t * ) malloc ( num_bytes );
+
+   if ( !pixels ) 
+    {
+     fprintf ( stderr, "Unable to allocate memory!\n");
+     exit ( EXIT_FAILURE );
+    }
+
+   /* Read in the pixels as they are stored in the file */
+   if ( fread ( pixels, 1, num_bytes, fp ) != num_bytes )
+    {
+     fprintf ( stderr, "Truncated pixel data ('%s')!\n", filename );
+     exit ( EXIT_FAILURE );
+    }
+
+   ppm->img.pixels = pixels;
   }
 
  fclose ( fp );
+
+ return ppm;
 }
 
-/* Maximin initialization method */
 /* 
-   For a comprehensive survey of k-means initialization methods, see
-   M. E. Celebi, H. Kingravi, and P. A. Vela, 
-   A Comparative Study of Efficient Initialization Methods for the K-Means Clustering Algorithm, 
-   Expert Systems with Applications, vol. 40, no. 1, pp. 200210, 2013.
+   Bring the pixels of a mapped PPM image into memory now rather than 
+   through page faults on first use, e.g. so that the batch reader does 
+   the disk reads in its own thread. Touches one byte per ( 4 KB or 
+   larger ) page.
  */
 
-void 
-maximin ( const RGB_Image *img, RGB_Cluster* clusters, const int num_colors, const RGB_Pixel *mean )
+#define PAGE_STEP 4096
+
+void
+load_PPM ( const PPM_Image *ppm )
 {
- int i, j, max_dist_index = 0;
- double delta_red, delta_green, delta_blue;
- double dist, max_dist;
- double *nc_dist;
- RGB_Pixel pixel;
- RGB_Cluster *cluster;
+ const size_t num_bytes = 3 * ( size_t ) ppm->img.width * ppm->img.height;
+ volatile uint8_t sink = 0;
 
- nc_dist = ( double * ) malloc ( img->size * sizeof ( double ) );
+ if ( !ppm->map )
+  {
+   return;
+  }
 
- /* Initialize first center by the mean R, G, B color */
- cluster = &clusters[0];
- cluster->center.red = mean->red;
- cluster->center.green = mean->green;
- cluster->center.blue = mean->blue;
- cluster->size = 1;
+ #if defined ( HAVE_MMAP ) && defined ( MADV_WILLNEED )
+ madvise ( ppm->map, ppm->map_size, MADV_WILLNEED );
+ #endif
 
- /* Initialize the nearest-center-distance for each pixel */
- for ( j = 0; j < img->size; j++ )
+ for ( size_t i = 0; i < num_bytes; i += PAGE_STEP )
   {
-   nc_dist[j] = MAX_RGB_DIST;
+   sink = sink + ppm->img.pixels[i];
   }
 
- /* Choose the remaining centers using maximin */
- for ( i = 0 + 1; i < num_colors; i++ )
+ if ( num_bytes )
   {
-   max_dist = -MAX_RGB_DIST;
+   sink = sink + ppm->img.pixels[num_bytes - 1];
+  }
+}
 
-   for ( j = 0; j < img->size; j++ )
-    {
-     /* Cache the pixel */
-     pixel = img->data[j];
+void
+free_PPM ( PPM_Image *ppm )
+{
+ #ifdef HAVE_MMAP
+ if ( ppm->map )
+  {
+   munmap ( ppm->map, ppm->map_size );
+   free ( ppm );
+   return;
+  }
+ #endif
 
-     /* Compute the pixel's distance to the previously chosen center */
-     cluster = &clusters[i - 1];
-     delta_red = pixel.red - cluster->center.red;
-     delta_green = pixel.green - cluster->center.green;
-     delta_blue = pixel.blue - cluster->center.blue;
-     dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
+ free ( ( void * ) ppm->img.pixels );
+ free ( ppm );
+}
 
-     if ( dist < nc_dist[j] )
-      {
-       /* Update the nearest-center-distance for this pixel */
-       nc_dist[j] = dist;
-      }
+/* Print what the library measured during the last clustering ( levels 1 and 2 ) */
+static void
+print_stats ( const MKM_Stats *stats, const int algo, const int num_colors )
+{
+ if ( stats_level < 1 || 2 < stats_level )
+  {
+   return;
+  }
 
-     if ( max_dist < nc_dist[j] )
-      {
-       /* Update the maximum nearest-center-distance so far */
-       max_dist = nc_dist[j];
-       max_dist_index = j;
-      }
-    }
+ if ( stats->num_unique )
+  {
+   printf ( "Histogram time = %g (%d unique colors)\n", stats->hist_time, stats->num_unique );
+  }
 
-   /* Pixel with maximum distance to its nearest center is chosen as a center */
-   cluster = &clusters[i];
-   pixel = img->data[max_dist_index];
-   cluster->center.red = pixel.red;
-   cluster->center.green = pixel.green;
-   cluster->center.blue = pixel.blue;
-   cluster->size = 1;
+ printf ( "Initialization time = %g\n", stats->init_time );
+ printf ( "Clustering time = %g\n", stats->cluster_time );
+
+ if ( algo == MKM_MACQUEEN || algo == MKM_MINIBATCH )
+  {
+   /* 
+      Macqueen's algorithm evaluates all of them for palettes below the 
+      crossover of its pruned search, which depends on the SIMD kernel 
+      ( see num_dists in mkm.h and -X )
+    */
+   printf ( "Distance evaluations per sample = %g (of %d)\n", 
+	    stats->num_samples > 0 ? ( double ) stats->num_dists / stats->num_samples : 0.0, 
+	    num_colors );
   }
 
- free ( nc_dist );
+ if ( algo == MKM_MINIBATCH )
+  {
+   printf ( "Number of batches = %d\n", stats->num_iters );
+  }
+ else if ( algo != MKM_MACQUEEN )
+  {
+   printf ( "Number of iterations = %d\n", stats->num_iters );
+  }
 }
 
-/* Color quantization using Macqueen's k-means algorithm */
-/* 
-  For detailed information, see
-  S. Thompson, M. E. Celebi, and K. H. Buck, 
-  Fast Color Quantization Using Macqueens K-Means Algorithm, 
-  Journal of Real-Time Image Processing, to appear 
-  (https://doi.org/10.1007/s11554-019-00914-6), 2020.
- */
-
-RGB_Image* 
-macqueen_cluster ( const RGB_Image *in_img, const int num_colors, const int pres_order, 
-		   const double lr_exp, const double sample_rate, RGB_Pixel *mean )
+/* Print the hardware counters of each phase that ran ( levels 1 and 2 ) */
+static void
+print_counters ( void )
 {
- int i, j;
- int max_pres, min_dist_index;
- int row_index, col_index, rand_index;
- int old_size, new_size;
- double min_dist, dist;
- double delta_red, delta_green, delta_blue;
- double sob_x, sob_y;
- double rate;
- RGB_Cluster *clusters, *cluster;
- RGB_Pixel in_pix, *out_pix;
- RGB_Image *out_img;
-
- clusters = ( RGB_Cluster * ) malloc ( num_colors * sizeof ( RGB_Cluster ) );
-
- auto start = high_resolution_clock::now();
-    
- /* Initialize cluster centers */
- maximin ( in_img, clusters, num_colors, mean );
-    
- auto stop = high_resolution_clock::now ( );
- auto duration = duration_cast<microseconds> ( stop - start ); 
-    
- #ifdef PRINT_TIME_INIT
- printf ( "Initialization time = %g\n", duration.count ( ) / 1e3 );
- #endif
-
- start = high_resolution_clock::now ( );
+ if ( stats_level < 1 || 2 < stats_level || !report.enabled || 
+      std::max ( { report.perf_fd[0], report.perf_fd[1], report.perf_fd[2] } ) < 0 )
+  {
+   return;
+  }
 
- /* Clustering pixel data using Macqueen's k-means algorithm */
- max_pres = in_img->size * sample_rate; 
- for ( i = 0; i < max_pres; i++ )
+ for ( int p = 0; p < NUM_PHASES; p++ )
   {
-   /* Choose a pixel quasi- or pseudo-randomly */
-   if ( pres_order == 0 )
+   if ( report.wall[p] == 0.0 )
     {
-     /* Quasirandom */
-     sob_seq ( &sob_x, &sob_y );
-
-     row_index = ( int ) ( sob_y * in_img->height + 0.5 ); /* round */
-     if ( row_index == in_img->height )
-      {
-       row_index--;
-      }
+     continue;
+    }
 
-     col_index = ( int ) ( sob_x * in_img->width + 0.5 ); /* round */
-     if ( col_index == in_img->width )
+   printf ( "Counters (%s):", phase_name[p] );
+   for ( int c = 0; c < NUM_COUNTERS; c++ )
+    {
+     if ( 0 <= report.perf_fd[c] )
       {
-       col_index--;
+       printf ( " %s = %lld", counter_name[c], report.count[p][c] );
       }
+    }
+   printf ( "\n" );
+  }
+}
 
-     rand_index = row_index * in_img->width + col_index;
+/* Print STRING as a JSON string */
+static void
+print_json_string ( const char *string )
+{
+ putchar ( '"' );
+ for ( const char *c = string; *c; c++ )
+  {
+   if ( *c == '"' || *c == '\\' )
+    {
+     printf ( "\\%c", *c );
     }
-   else 
+   else if ( ( uchar ) *c < 0x20 )
     {
-     /* Pseudorandom */
-     /* rand_index = ( int ) ( genrand_real2 ( ) * in_img->size ); */
-     rand_index = bounded_rand ( in_img->size );
+     printf ( "\\u%04x", *c );
     }
-      
-   /* Cache the chosen pixel */
-   in_pix = in_img->data[rand_index];
-
-   /* Find the nearest center */
-   min_dist = MAX_RGB_DIST; 
-   min_dist_index = -INT_MAX;
-   for ( j = 0; j < num_colors; j++ ) 
+   else
     {
-     cluster = &clusters[j];
-     delta_red = in_pix.red - cluster->center.red;
-     delta_green = in_pix.green - cluster->center.green;
-     delta_blue = in_pix.blue - cluster->center.blue;
-     dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
-
-     if ( dist < min_dist )
-      {
-       min_dist = dist;
-       min_dist_index = j;
-      }  
+     putchar ( *c );
     }
-
-   /* Update the nearest center */
-   cluster = &clusters[min_dist_index];
-   old_size = cluster->size;
-   new_size = old_size + 1;
-   rate = pow ( new_size, -lr_exp );
-   cluster->center.red += rate * ( in_pix.red - cluster->center.red );
-   cluster->center.green += rate * ( in_pix.green - cluster->center.green );
-   cluster->center.blue += rate * ( in_pix.blue - cluster->center.blue );
-   cluster->size = new_size;
   }
-    
- stop = high_resolution_clock::now ( );
- duration = duration_cast<microseconds> ( stop - start ); 
- #ifdef PRINT_TIME_CLUST
- printf ( "Clustering time = %g\n", duration.count ( ) / 1e3 );
- #endif
+ putchar ( '"' );
+}
 
- out_img = (RGB_Image *) malloc(sizeof(RGB_Image));
- out_img->data = (RGB_Pixel *) malloc(in_img->size * sizeof(RGB_Pixel));
- out_img->width = in_img->width;
- out_img->height = in_img->height;
- out_img->size = in_img->size;
-
- start = high_resolution_clock::now ( );
-
- /* Now quantize the image */
- for ( i = 0; i < in_img->size; i++ )
-  {
-   /* Cache the pixel */
-   in_pix = in_img->data[i];
-        
-   /* Find the nearest center */
-   min_dist = MAX_RGB_DIST;
-   min_dist_index = -INT_MAX;
-   for ( j = 0; j < num_colors; j++ ) 
-    {
-     cluster = &clusters[j];
-            
-     delta_red = in_pix.red - cluster->center.red;
-     delta_green = in_pix.green - cluster->center.green;
-     delta_blue = in_pix.blue - cluster->center.blue;
-     dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
-
-     if ( dist < min_dist )
+/* 
+   Print the statistics of the quantization of IN_FILE_NAME as one JSON 
+   line ( level 3 ). The write phase excludes the mapping done during it.
+ */
+static void
+print_json ( const char *in_file_name, const int width, const int height, 
+	     const MKM_Options *options, const MKM_Stats *stats, const double mse, 
+	     const double total_time )
+{
+ double wall, cpu;
+ long long count;
+
+ printf ( "{\"image\":" );
+ print_json_string ( in_file_name );
+ printf ( ",\"width\":%d,\"height\":%d,\"algorithm\":%d,\"init\":%d,\"colors\":%d,\"threads\":%d", 
+	  width, height, options->algorithm, options->init, options->num_colors, options->num_threads );
+
+ printf ( ",\"phases\":{" );
+ for ( int p = 0; p < NUM_PHASES; p++ )
+  {
+   wall = report.wall[p] - ( p == PHASE_WRITE ? report.wall[MKM_PHASE_MAP] : 0.0 );
+   cpu = report.cpu[p] - ( p == PHASE_WRITE ? report.cpu[MKM_PHASE_MAP] : 0.0 );
+   printf ( "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f", p ? "," : "", phase_name[p], wall, cpu );
+   for ( int c = 0; c < NUM_COUNTERS; c++ )
+    {
+     if ( 0 <= report.perf_fd[c] )
+      {
+       count = report.count[p][c] - ( p == PHASE_WRITE ? report.count[MKM_PHASE_MAP][c] : 0 );
+       printf ( ",\"%s\":%lld", counter_name[c], count );
+      }
+    }
+   printf ( "}" );
+  }
+ printf ( "}" );
+
+ printf ( ",\"total_ms\":%.3f,\"samples\":%lld,\"distance_evals\":%lld,\"iterations\":%d", 
+	  total_time, stats->num_samples, stats->num_dists, stats->num_iters );
+ printf ( ",\"changes\":%lld,\"objective\":%.17g,\"unique_colors\":%d,\"mse\":%.4f", 
+	  stats->num_changes, stats->objective, stats->num_unique, mse );
+ printf ( ",\"bytes_read\":%lld,\"bytes_written\":%lld,\"peak_rss_kb\":%ld}\n", 
+	  report.bytes_read, report.bytes_written, peak_rss_kb ( ) );
+}
+
+/* 
+   Print the objective after each iteration of Lloyd's algorithm ( see 
+   MKM_Trace ); ARG keeps the objective of the previous iteration
+ */
+static void
+print_objective ( void *arg, int iter, double objective, int num_changes )
+{
+ double *old_obj = ( double * ) arg;
+
+ printf ( "iteration %d: obj = %g ; delta obj = %g [# changes = %d]\n", 
+	  iter, objective, iter == 1 ? 0.0 : ( *old_obj - objective ) / *old_obj, num_changes );
+ *old_obj = objective;
+}
+
+/* MSE of the pixels mapped since the last clustering */
+static double
+quantizer_mse ( const MKM_Quantizer *quantizer )
+{
+ MKM_Stats stats;
+
+ mkm_get_stats ( quantizer, &stats );
+
+ return stats.num_mapped ? ( double ) stats.sse / stats.num_mapped : 0.0;
+}
+
+/* # pixels mapped and written at a time */
+#define MAP_STRIP_SIZE ( 1 << 20 )
+
+/* 
+   Quantize the image of the last clustering and write the result to 
+   FILENAME as a binary PPM. The pixels are mapped and written one strip 
+   of rows at a time, so no output image is ever allocated.
+ */
+
+void 
+write_PPM ( const char *filename, MKM_Quantizer *quantizer, const int width, const int height )
+{
+ int strip_rows, num_rows;
+ size_t row_bytes = 3 * ( size_t ) width;
+ MKM_Output output = { NULL, row_bytes, NULL, 0, 0 };
+ FILE *fp;
+
+ fp = fopen ( filename, "wb" );
+ if ( !fp ) 
+  {
+   fprintf ( stderr, "Unable to open file '%s'!\n", filename );
+   exit ( EXIT_FAILURE );
+  }
+
+ fprintf ( fp, "P6\n" );
+ fprintf ( fp, "%d %d\n", width, height );
+ fprintf ( fp, "%d\n", 255 );
+
+ strip_rows = std::max ( 1, std::min ( height, MAP_STRIP_SIZE / width ) );
+ output.rgb = ( uint8_t * ) malloc ( strip_rows * row_bytes );
+ if ( !output.rgb ) 
+  {
+   fprintf ( stderr, "Unable to allocate memory!\n" );
+   exit ( EXIT_FAILURE );
+  }
+
+ for ( int row = 0; row < height; row += num_rows )
+  {
+   num_rows = std::min ( strip_rows, height - row );
+   check_status ( mkm_map ( quantizer, NULL, row, num_rows, &output ) );
+
+   if ( fwrite ( output.rgb, row_bytes, num_rows, fp ) != ( size_t ) num_rows )
+    {
+     perror ( "Unable to write the output image" );
+     exit ( EXIT_FAILURE );
+    }
+  }
+
+ free ( output.rgb );
+
+ if ( fclose ( fp ) )
+  {
+   perror ( filename );
+   exit ( EXIT_FAILURE );
+  }
+}
+
+/* 
+   Indexed image: the palette and the index of each pixel's color in it. 
+   The indices take one byte each for up to 256 colors and two bytes 
+   otherwise.
+ */
+
+typedef struct
+ {
+  int width, height;
+  int num_colors;
+  uint8_t *palette;     /* R, G, B of each color */
+  int index_size;       /* bytes per index ( 1 or 2 ) */
+  void *index;          /* uint8_t or uint16_t index of each pixel */
+ } Indexed_Image;
+
+/* Map the image of the last clustering to its NUM_COLORS colors and return the indexed image */
+
+Indexed_Image *
+map_indexed ( MKM_Quantizer *quantizer, const int width, const int height, const int num_colors )
+{
+ MKM_Output output;
+ Indexed_Image *idx_img;
+
+ idx_img = ( Indexed_Image * ) malloc ( sizeof ( Indexed_Image ) );
+ if ( !idx_img ) 
+  {
+   fprintf ( stderr, "Unable to allocate memory!\n" );
+   exit ( EXIT_FAILURE );
+  }
+
+ idx_img->width = width;
+ idx_img->height = height;
+ idx_img->num_colors = num_colors;
+ idx_img->index_size = num_colors <= 256 ? 1 : 2;
+ idx_img->palette = ( uint8_t * ) malloc ( 3 * num_colors );
+ idx_img->index = malloc ( ( size_t ) width * height * idx_img->index_size );
+ if ( !idx_img->palette || !idx_img->index ) 
+  {
+   fprintf ( stderr, "Unable to allocate memory!\n" );
+   exit ( EXIT_FAILURE );
+  }
+
+ output.rgb = NULL;
+ output.rgb_stride = 0;
+ output.indices = idx_img->index;
+ output.index_size = idx_img->index_size;
+ output.index_stride = ( size_t ) width * idx_img->index_size;
+ check_status ( mkm_map ( quantizer, NULL, 0, height, &output ) );
+ check_status ( mkm_get_palette ( quantizer, idx_img->palette ) );
+
+ return idx_img;
+}
+
+void
+free_indexed ( Indexed_Image *idx_img )
+{
+ free ( idx_img->palette );
+ free ( idx_img->index );
+ free ( idx_img );
+}
+
+/* 
+   Write IDX_IMG to FILENAME in a simple indexed format: a text header 
+   "MKMI\n<width> <height>\n<# colors> <bytes per index>\n", the palette 
+   as <# colors> 8-bit R, G, B triplets ( the truncated centers, as in the 
+   PPM output ), and the indices in row-major order ( little-endian when 
+   they take two bytes ).
+ */
+
+void 
+write_indexed ( const char *filename, const Indexed_Image *idx_img )
+{
+ size_t size = ( size_t ) idx_img->width * idx_img->height;
+ FILE *fp;
+
+ fp = fopen ( filename, "wb" );
+ if ( !fp ) 
+  {
+   fprintf ( stderr, "Unable to open file '%s'!\n", filename );
+   exit ( EXIT_FAILURE );
+  }
+
+ fprintf ( fp, "MKMI\n" );
+ fprintf ( fp, "%d %d\n", idx_img->width, idx_img->height );
+ fprintf ( fp, "%d %d\n", idx_img->num_colors, idx_img->index_size );
+ fwrite ( idx_img->palette, 3, idx_img->num_colors, fp );
+
+ #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+ if ( idx_img->index_size == 2 )
+  {
+   uchar bytes[2];
+
+   for ( size_t j = 0; j < size; j++ )
+    {
+     uint16_t index = ( ( const uint16_t * ) idx_img->index )[j];
+
+     bytes[0] = index & 0xFF;
+     bytes[1] = index >> 8;
+     fwrite ( bytes, 1, 2, fp );
+    }
+  }
+ else
+ #endif
+ fwrite ( idx_img->index, idx_img->index_size, size, fp );
+
+ if ( ferror ( fp ) || fclose ( fp ) )
+  {
+   perror ( filename );
+   exit ( EXIT_FAILURE );
+  }
+}
+
+/* 
+   Write the image of the last clustering, quantized with its NUM_COLORS 
+   colors, in FORMAT ( 0: PPM, 1: indexed )
+ */
+
+static void
+write_quantized ( const char *filename, const int format, MKM_Quantizer *quantizer, 
+		  const int width, const int height, const int num_colors )
+{
+ Indexed_Image *idx_img;
+
+ if ( format == 0 )
+  {
+   write_PPM ( filename, quantizer, width, height );
+  }
+ else
+  {
+   idx_img = map_indexed ( quantizer, width, height, num_colors );
+   write_indexed ( filename, idx_img );
+   free_indexed ( idx_img );
+  }
+}
+
+/* 
+   Streaming quantization with Macqueen's algorithm for images too large 
+   to be held in memory. The image is read twice, one strip of rows at a 
+   time, so it must be a regular file:
+
+   1. The first pass computes the mean color and draws a uniform sample of 
+      ( sample rate ) x ( # pixels ) pixels ( see mkm_sample_begin ), 
+      capped by the memory budget. When the sample is the whole image, the 
+      result is that of the in-memory mode.
+   2. maximin and Macqueen's algorithm run on the sample.
+   3. The second pass maps the image and writes it strip by strip.
+
+   Half of the BUDGET bytes may go to the sample and the memory the 
+   library needs to cluster it ( SAMPLE_BYTES per pixel and the learning 
+   rates ), and the rest to the input and output strips ( and the inverse 
+   colormap if a quarter of the budget covers it ). The library gives 
+   the clustering's memory back before the mapping pass. Returns the MSE.
+ */
+
+#define MAP_CACHE_BYTES ( ( 1 << 24 ) * 2LL )
+
+/* Per sample: the pixel, maximin's nearest-center distance and the presentation order */
+#define SAMPLE_BYTES ( 3 + sizeof ( double ) + sizeof ( int ) )
+
+/* Macqueen's learning rates, one per cluster size up to the sample size, unless LR_EXP = 1 */
+#define RATE_TABLE_ENTRIES ( 1LL << 20 )
+
+static long long
+rate_table_bytes ( const double lr_exp, const long long num_sample )
+{
+ return lr_exp == 1.0 ? 0 : std::min ( num_sample + 1, RATE_TABLE_ENTRIES ) * ( long long ) sizeof ( double );
+}
+
+double 
+quantize_stream ( const char *in_file_name, const char *out_file_name, 
+		  const MKM_Options *options, const long long budget, MKM_Stats *stats )
+{
+ int width, height, strip_rows, num_sample, num_rows;
+ long long num_pixels, cache_bytes, sample_bytes;
+ long offset;
+ size_t row_bytes;
+ double mse;
+ FILE *in_fp, *out_fp;
+ uint8_t *strip, *out_strip;
+ MKM_Options stream_options = *options;
+ MKM_Image strip_img;
+ MKM_Output output;
+ MKM_Quantizer *quantizer;
+
+ in_fp = open_PPM ( in_file_name, &width, &height );
+ offset = ftell ( in_fp );
+ if ( offset < 0 )
+  {
+   fprintf ( stderr, "The streaming mode needs a seekable input ('%s')!\n", in_file_name );
+   exit ( EXIT_FAILURE );
+  }
+
+ num_pixels = ( long long ) width * height;
+ row_bytes = 3 * ( size_t ) width;
+
+ /* Split the budget */
+ cache_bytes = MAP_CACHE_BYTES <= budget / 4 ? MAP_CACHE_BYTES : 0;
+ num_sample = ( int ) std::min ( { ( long long ) ceil ( options->sample_rate * num_pixels ), 
+				   ( budget / 2 - rate_table_bytes ( options->lr_exp, 0 ) ) / 
+				   ( long long ) ( SAMPLE_BYTES + ( options->lr_exp == 1.0 ? 0 : sizeof ( double ) ) ), 
+				   ( long long ) INT_MAX } );
+ sample_bytes = ( long long ) SAMPLE_BYTES * num_sample + rate_table_bytes ( options->lr_exp, num_sample );
+ strip_rows = ( int ) std::min ( ( budget - cache_bytes - sample_bytes ) / 
+				 ( 2 * ( long long ) row_bytes ), ( long long ) height );
+ if ( num_sample < options->num_colors || strip_rows < 1 || INT_MAX / width < strip_rows )
+  {
+   fprintf ( stderr, "Memory budget too small for '%s'!\n", in_file_name );
+   exit ( EXIT_FAILURE );
+  }
+
+ stream_options.use_cache = cache_bytes != 0;
+ check_status ( mkm_create ( &stream_options, &quantizer ) );
+
+ strip = ( uint8_t * ) malloc ( strip_rows * row_bytes );
+ out_strip = ( uint8_t * ) malloc ( strip_rows * row_bytes );
+ if ( !strip || !out_strip ) 
+  {
+   fprintf ( stderr, "Unable to allocate memory!\n" );
+   exit ( EXIT_FAILURE );
+  }
+
+ strip_img.pixels = strip;
+ strip_img.width = width;
+ strip_img.stride = row_bytes;
+
+ auto start = high_resolution_clock::now ( );
+
+ /* Pass 1: mean and reservoir sample */
+ report_probe ( &report, PHASE_READ, 0 );
+ check_status ( mkm_sample_begin ( quantizer, width, height, num_sample ) );
+ for ( int row = 0; row < height; row += num_rows )
+  {
+   num_rows = std::min ( strip_rows, height - row );
+   if ( fread ( strip, row_bytes, num_rows, in_fp ) != ( size_t ) num_rows )
+    {
+     fprintf ( stderr, "Truncated pixel data ('%s')!\n", in_file_name );
+     exit ( EXIT_FAILURE );
+    }
+
+   strip_img.height = num_rows;
+   check_status ( mkm_sample_add ( quantizer, &strip_img ) );
+  }
+
+ report_probe ( &report, PHASE_READ, 1 );
+ report.bytes_read += offset + num_pixels * 3;
+ if ( 1 <= stats_level && stats_level <= 2 )
+  {
+   printf ( "Sampling time = %g (%d of %lld pixels, %d rows per strip)\n", 
+	    elapsed_ms ( start ), num_sample, num_pixels, strip_rows );
+  }
+
+ /* maximin and Macqueen's algorithm on the sample */
+ check_status ( mkm_sample_cluster ( quantizer ) );
+ mkm_get_stats ( quantizer, stats );
+ print_stats ( stats, options->algorithm, options->num_colors );
+
+ /* Pass 2: map and write the image strip by strip */
+ if ( fseek ( in_fp, offset, SEEK_SET ) )
+  {
+   fprintf ( stderr, "The streaming mode needs a seekable input ('%s')!\n", in_file_name );
+   exit ( EXIT_FAILURE );
+  }
+
+ out_fp = fopen ( out_file_name, "wb" );
+ if ( !out_fp ) 
+  {
+   fprintf ( stderr, "Unable to open file '%s'!\n", out_file_name );
+   exit ( EXIT_FAILURE );
+  }
+
+ report_probe ( &report, PHASE_WRITE, 0 );
+ fprintf ( out_fp, "P6\n" );
+ fprintf ( out_fp, "%d %d\n", width, height );
+ fprintf ( out_fp, "%d\n", 255 );
+
+ output.rgb = out_strip;
+ output.rgb_stride = row_bytes;
+ output.indices = NULL;
+ output.index_size = 0;
+ output.index_stride = 0;
+
+ for ( int row = 0; row < height; row += num_rows )
+  {
+   num_rows = std::min ( strip_rows, height - row );
+   if ( fread ( strip, row_bytes, num_rows, in_fp ) != ( size_t ) num_rows )
+    {
+     fprintf ( stderr, "Truncated pixel data ('%s')!\n", in_file_name );
+     exit ( EXIT_FAILURE );
+    }
+
+   strip_img.height = num_rows;
+   check_status ( mkm_map ( quantizer, &strip_img, 0, num_rows, &output ) );
+
+   if ( fwrite ( out_strip, row_bytes, num_rows, out_fp ) != ( size_t ) num_rows )
+    {
+     perror ( out_file_name );
+     exit ( EXIT_FAILURE );
+    }
+  }
+
+ if ( fclose ( out_fp ) )
+  {
+   perror ( out_file_name );
+   exit ( EXIT_FAILURE );
+  }
+
+ report_probe ( &report, PHASE_WRITE, 1 );
+ report.bytes_read += num_pixels * 3;
+ report.bytes_written += file_size ( out_file_name );
+
+ fclose ( in_fp );
+ free ( strip );
+ free ( out_strip );
+
+ mkm_get_stats ( quantizer, stats );
+ if ( stats_level == 2 )
+  {
+   printf ( "Mapping time = %g\n", stats->map_time );
+  }
+
+ mse = quantizer_mse ( quantizer );
+ mkm_destroy ( quantizer );
+
+ return mse;
+}
+
+/* 
+   Frame-sequence mode for video: binary PPM frames, one right after the 
+   other, are read from IN_FP and written quantized to OUT_FP. The first 
+   frame of each scene is clustered from scratch with OPTIONS. The others 
+   are warm-started from the palette of the previous frame ( see 
+   mkm_cluster ) and get a shorter pass: Macqueen's and the mini-batch 
+   algorithm sample WARM_RATE of their pixels and Lloyd's algorithm runs 
+   at most WARM_ITERS iterations. A new scene starts when the frame size 
+   changes, after KEY_INTERVAL frames ( if not 0 ), and when the coarse 
+   color histogram of a frame differs from that of the previous frame by 
+   more than SCENE_CUT ( see hist_change ). The statistics of each frame, 
+   and a summary, go to the standard error, since the standard output 
+   usually carries the frames. Latency is measured from the end of the 
+   read to the end of the write. Returns the # frames.
+ */
+
+typedef struct
+ {
+  int key_interval;   /* max. # frames per scene ( 0 = no limit ) */
+  double scene_cut;   /* histogram change that starts a new scene, in [0, 1] */
+  double warm_rate;   /* sampling rate of the warm-started frames */
+  int warm_iters;     /* max. # Lloyd iterations of the warm-started frames */
+ } Frame_Options;
+
+#define FRAME_HIST_BITS 3
+#define FRAME_HIST_SIZE ( 1 << ( 3 * FRAME_HIST_BITS ) )
+
+/* Histogram of the colors of IMG with FRAME_HIST_BITS bits per channel */
+static void
+coarse_hist ( const MKM_Image *img, int *hist )
+{
+ const int shift = 8 - FRAME_HIST_BITS;
+ const uint8_t *pixel;
+
+ memset ( hist, 0, FRAME_HIST_SIZE * sizeof ( int ) );
+ for ( int row = 0; row < img->height; row++ )
+  {
+   pixel = img->pixels + row * img->stride;
+   for ( int col = 0; col < img->width; col++, pixel += 3 )
+    {
+     hist[( ( pixel[0] >> shift ) << ( 2 * FRAME_HIST_BITS ) ) | 
+	  ( ( pixel[1] >> shift ) << FRAME_HIST_BITS ) | ( pixel[2] >> shift )]++;
+    }
+  }
+}
+
+/* Fraction of the NUM_PIXELS pixels that would have to change bins to turn HIST1 into HIST2 */
+static double
+hist_change ( const int *hist1, const int *hist2, const long long num_pixels )
+{
+ long long diff = 0;
+
+ for ( int j = 0; j < FRAME_HIST_SIZE; j++ )
+  {
+   diff += abs ( hist1[j] - hist2[j] );
+  }
+
+ return diff / ( 2.0 * num_pixels );
+}
+
+int
+quantize_frames ( FILE *in_fp, FILE *out_fp, const MKM_Options *options, 
+		  const Frame_Options *frame )
+{
+ int width = 0, height = 0, new_width, new_height;
+ int num_frames = 0, num_scenes = 0, scene_len = 0;
+ int hist[2][FRAME_HIST_SIZE];
+ int cur = 0;
+ bool key;
+ size_t num_bytes = 0;
+ double change, latency, mse;
+ double sum_latency = 0.0, max_latency = 0.0, sum_mse = 0.0;
+ uint8_t *in_data = NULL, *out_data = NULL;
+ MKM_Options key_options = *options;
+ MKM_Options warm_options = *options;
+ MKM_Image img;
+ MKM_Output output;
+ MKM_Stats stats;
+ MKM_Quantizer *quantizer;
+
+ key_options.warm_start = 0;
+ warm_options.warm_start = 1;
+ warm_options.sample_rate = frame->warm_rate;
+ warm_options.max_iters = frame->warm_iters;
+ check_status ( mkm_create ( &key_options, &quantizer ) );
+
+ while ( read_PPM_header ( in_fp, "standard input", &new_width, &new_height ) )
+  {
+   key = new_width != width || new_height != height;
+   if ( key )
+    {
+     if ( INT_MAX / new_width < new_height ) 
       {
-       min_dist = dist;
-       min_dist_index = j;
-      }     
+       fprintf ( stderr, "Frame %d too large!\n", num_frames );
+       exit ( EXIT_FAILURE );
+      }
+
+     width = new_width;
+     height = new_height;
+     num_bytes = 3 * ( size_t ) width * height;
+     free ( in_data );
+     free ( out_data );
+     in_data = ( uint8_t * ) malloc ( num_bytes );
+     out_data = ( uint8_t * ) malloc ( num_bytes );
+     if ( !in_data || !out_data ) 
+      {
+       fprintf ( stderr, "Unable to allocate memory!\n" );
+       exit ( EXIT_FAILURE );
+      }
+
+     img.pixels = in_data;
+     img.width = width;
+     img.height = height;
+     img.stride = 3 * ( size_t ) width;
+
+     output.rgb = out_data;
+     output.rgb_stride = img.stride;
+     output.indices = NULL;
+     output.index_size = 0;
+     output.index_stride = 0;
+    }
+
+   if ( fread ( in_data, 1, num_bytes, in_fp ) != num_bytes )
+    {
+     fprintf ( stderr, "Truncated pixel data (frame %d)!\n", num_frames );
+     exit ( EXIT_FAILURE );
     }
 
-   /* Replace the input color with the nearest color in the palette */
-   in_pix = clusters[min_dist_index].center;
-   out_pix = &out_img->data[i];
-   out_pix->red = in_pix.red;
-   out_pix->green = in_pix.green;
-   out_pix->blue = in_pix.blue;       
-  }
-    
- stop = high_resolution_clock::now ( );
- duration = duration_cast<microseconds> ( stop - start ); 
- #ifdef PRINT_TIME_MAP
- printf ( "Mapping time = %g\n", duration.count ( ) / 1e3 );
- #endif
+   auto start = high_resolution_clock::now ( );
+
+   /* Start a new scene or go on with the palette of the previous frame */
+   cur = 1 - cur;
+   coarse_hist ( &img, hist[cur] );
+   change = key ? 1.0 : hist_change ( hist[cur], hist[1 - cur], ( long long ) width * height );
+   key = key || ( frame->key_interval && frame->key_interval <= scene_len ) || 
+	 frame->scene_cut < change;
+   scene_len = key ? 1 : scene_len + 1;
+   num_scenes += key;
+
+   check_status ( mkm_set_options ( quantizer, key ? &key_options : &warm_options ) );
+   check_status ( mkm_cluster ( quantizer, &img ) );
+   check_status ( mkm_map ( quantizer, NULL, 0, height, &output ) );
+
+   fprintf ( out_fp, "P6\n%d %d\n%d\n", width, height, 255 );
+   if ( fwrite ( out_data, 1, num_bytes, out_fp ) != num_bytes || fflush ( out_fp ) )
+    {
+     perror ( "Unable to write the output frame" );
+     exit ( EXIT_FAILURE );
+    }
+
+   latency = elapsed_ms ( start );
+   mkm_get_stats ( quantizer, &stats );
+   mse = quantizer_mse ( quantizer );
+   fprintf ( stderr, "Frame %d: %s, change = %.3f, init = %g, clustering = %g, mapping = %g, latency = %g ms, MSE = %.2f\n", 
+	     num_frames, key ? "new scene" : "warm", change, stats.init_time, 
+	     stats.cluster_time, stats.map_time, latency, mse );
+
+   sum_latency += latency;
+   max_latency = std::max ( max_latency, latency );
+   sum_mse += mse;
+   num_frames++;
+  }
+
+ if ( num_frames )
+  {
+   fprintf ( stderr, "Frames = %d (%d scenes), mean latency = %g ms, max. latency = %g ms, mean MSE = %.2f\n", 
+	     num_frames, num_scenes, sum_latency / num_frames, max_latency, sum_mse / num_frames );
+  }
+
+ free ( in_data );
+ free ( out_data );
+ mkm_destroy ( quantizer );
+
+ return num_frames;
+}
+
+static void
+print_usage ( char *prog_name )
+{
+ fprintf ( stderr, "Color Quantization Using Macqueen's K-Means Algorithm\n\n" ); 
+ fprintf ( stderr, "Reference: S. Thompson, M. E. Celebi, and K. H. Buck, Fast Color Quantization Using Macqueens K-Means Algorithm, Journal of Real-Time Image Processing, to appear (https://doi.org/10.1007/s11554-019-00914-6), 2020.\n\n" ); 
+ fprintf ( stderr, "Usage: %s -i <input image> -o <output image> -f <output format> -n <# colors> -a <algorithm> -I <initializer> -J <init sampling rate> -p <presentation order> -e <exponent> -s <sampling rate> -X <pruning> -r <# runs> -d <seed> -t <# iters> -y <tolerance> -g <trace> -u <histogram> -z <batch size> -k <# batches> -j <# threads> -m <memory budget> -S <statistics> -P <counters>\n", prog_name );
+ fprintf ( stderr, "       %s -b <batch input> -o <output directory> -q <# in flight> [other options as above]\n", prog_name );
+ fprintf ( stderr, "       %s -v <key interval> -c <scene change> -w <warm sampling rate> -x <warm # iters> -l <warm decay> [other options as above] < frames > quantized frames\n\n", prog_name );
+ fprintf ( stderr, "All parameters are optional except for the <input image> ( or the <batch input>, or -v )\n\n" );
+ fprintf ( stderr, "-i <input image>: input image in binary ppm format\n\n" ); 
+ fprintf ( stderr, "-o <output image>: output image (default = out.ppm)\n\n" ); 
+ fprintf ( stderr, "-f <output format>: format of the output image (0: binary ppm, 1: indexed, i.e. the palette followed by one 8-bit index per pixel, or 16-bit for more than 256 colors; default = 0)\n\n" ); 
+ fprintf ( stderr, "-n <# colors>: # colors (integer in [2, 65536]; default = 256).\n\n" ); 
+ fprintf ( stderr, "-a <algorithm>: clustering algorithm (0: Macqueen, 1: Lloyd, 2: Lloyd accelerated with Hamerly's bounds, 3: mini-batch k-means; default = 0)\n\n" );
+ fprintf ( stderr, "-I <initializer>: how the initial centers are chosen (0: maximin, 1: maximin on a quasirandom sample of <init sampling rate> x # pixels pixels, 2: median cut, 3: Wu's variance-based splitting; 2 and 3 work on a 32 x 32 x 32 color histogram and fall back to maximin on images with fewer occupied cells than colors; default = 0)\n\n" );
+ fprintf ( stderr, "-J <init sampling rate>: sampling rate for <initializer> 1 (double-precision floating point in (0, 1]; default = 0.05)\n\n" );
+ fprintf ( stderr, "-p <presentation order>: presentation order for Macqueen's and the mini-batch algorithm (0: quasirandom, 1: pseudorandom; default = 0)\n\n" );
+ fprintf ( stderr, "-e <exponent>: learning rate exponent for Macqueen's and the mini-batch algorithm (double-precision floating point in [0.5, 1]; default = 0.5)\n\n" );
+ fprintf ( stderr, "-s <sampling rate>: sampling rate for Macqueen's and the mini-batch algorithm (double-precision floating point in (0, 1]; default = 1.0)\n\n" );
+ fprintf ( stderr, "-X <pruning>: nearest-center search of Macqueen's algorithm (-1: pruned from the palette size where it beats a full scan with the SIMD kernel in use, i.e. 32 colors with the scalar kernel, 128 with SSE4.1, 256 with AVX2 and 1536 with AVX-512, 0: full scan, 1: pruned; default = -1)\n\n" );
+ fprintf ( stderr, "-r <# runs>: # independent runs for Macqueen's algorithm with pseudorandom presentation, run concurrently with -j (positive integer; default = 1)\n\n" );
+ fprintf ( stderr, "-d <seed>: seed for the pseudorandom number generator for Macqueen's and the mini-batch algorithm; run r uses <seed> + r (nonnegative integer; default = # secs. since 1/1/1970 UTC)\n\n" );
+ fprintf ( stderr, "-t <# iters>: max. # iterations for Lloyd's algorithm, accelerated or not (positive integer; default = %d)\n\n", INT_MAX );
+ fprintf ( stderr, "-y <tolerance>: stop Lloyd's algorithm, accelerated or not, once an iteration lowers the sum of squared errors by less than this fraction (double-precision floating point in [0, 1); default = 0, i.e. once no pixel changes clusters)\n\n" );
+ fprintf ( stderr, "-g <trace>: print the sum of squared errors after each iteration of Lloyd's algorithm, accelerated or not (0: no, 1: yes; default = 0)\n\n" );
+ fprintf ( stderr, "-u <histogram>: run Lloyd's algorithm, accelerated or not, on the distinct colors of the image weighted by their counts (0: no, 1: yes; default = 0)\n\n" );
+ fprintf ( stderr, "-z <batch size>: # pixels per batch for the mini-batch algorithm; each batch is assigned to the centers at once, in parallel with -j, then every pixel moves its center as in Macqueen's algorithm (positive integer; default = 1024)\n\n" );
+ fprintf ( stderr, "-k <# batches>: # batches for the mini-batch algorithm (positive integer; default = enough for <sampling rate> x # pixels samples)\n\n" );
+ fprintf ( stderr, "-j <# threads>: # threads for the parallel parts of the algorithms; the output does not depend on it (positive integer; default = 1)\n\n" );
+ fprintf ( stderr, "-b <batch input>: quantize many images in one process: a file listing one input image per line, or a directory whose .ppm files are taken; the outputs get the names of the inputs in the <output directory> (default = .), which also receives summary.csv with the time of each stage (ms) and the MSE per image\n\n" );
+ fprintf ( stderr, "-q <# in flight>: # images being read, clustered or written at the same time in batch mode (positive integer; default = 3)\n\n" );
+ fprintf ( stderr, "-m <memory budget>: stream the image through memory in strips instead of loading it, with Macqueen's algorithm run on a sample of <sampling rate> x # pixels pixels that fits in the budget; needs a regular input file, <algorithm> 0 and <output format> 0 (MB, positive integer; default = load the whole image)\n\n" );
+ fprintf ( stderr, "-v <key interval>: frame-sequence mode: read binary ppm frames, one right after the other, from the standard input and write the quantized frames to the standard output, with the statistics of each frame on the standard error; each frame starts from the palette of the previous one instead of maximin, except for the first frame of a scene, which starts every <key interval> frames (0: never), on a size change and on a scene change (nonnegative integer)\n\n" );
+ fprintf ( stderr, "-c <scene change>: fraction of the pixels that change bins in a coarse color histogram from one frame to the next above which a new scene starts in frame-sequence mode (double-precision floating point in [0, 1]; default = 0.3)\n\n" );
+ fprintf ( stderr, "-w <warm sampling rate>: sampling rate for Macqueen's and the mini-batch algorithm on the frames that start from the previous palette (double-precision floating point in (0, 1]; default = <sampling rate> / 4)\n\n" );
+ fprintf ( stderr, "-x <warm # iters>: max. # iterations for Lloyd's algorithm, accelerated or not, on the frames that start from the previous palette (positive integer; default = 2)\n\n" );
+ fprintf ( stderr, "-l <warm decay>: factor applied to the cluster sizes carried over from the previous frame, which set the learning rates of Macqueen's and the mini-batch algorithm (double-precision floating point in [0, 1]; default = 0.1)\n\n" );
+ fprintf ( stderr, "-S <statistics>: what to print (0: nothing, 1: the times of the stages, the distance evaluations or iterations and the MSE, 2: 1 plus the mapping and total times, 3: a single JSON line with the wall and CPU time of each phase, the counts, the MSE, the bytes read and written and the peak memory use; 3 is not available with -b, -r > 1, -v or -g; default = 1)\n\n" );
+ fprintf ( stderr, "-P <counters>: read the hardware counters (cycles, instructions, cache misses) of the calling thread around each phase, where Linux allows it (0: no, 1: yes; not available with -b, -r > 1, -v or -g; default = 0)\n\n" );
+ fprintf ( stderr, "The program generally runs faster if one or more of the following holds: i) image dimensions are small, ii) <# colors> is small, iii) <algorithm> is 0 (Macqueen), iv) <exponent> is small, v) <sampling rate> is small.\n\n" );
+ fprintf ( stderr, "Many image manipulation software can display/convert/process PPM images including Irfanview (http://www.irfanview.com), GIMP (http://www.gimp.org), Netpbm (http://netpbm.sourceforge.net), and ImageMagick (http://www.imagemagick.org/script/index.php).\n\n" );
+
+ exit ( EXIT_FAILURE );
+}
+
+void
+mean_stdev ( const double *data, const int num_elems, double *mean, double *stdev )
+{
+ *mean = *stdev = 0.0;
+
+ if ( num_elems == 1 ) 
+  {
+   *mean = data[0];
+   return;
+  }
+
+ for ( int i = 0; i < num_elems; i++ )
+  {
+   *mean += data[i];
+  }
+
+ *mean /= num_elems;
+
+ for ( int i = 0; i < num_elems; i++ )
+  {
+   *stdev += ( data[i] - *mean ) * ( data[i] - *mean );
+  }
+
+ *stdev = sqrt ( *stdev / ( num_elems - 1 ) );
+}
+
+/* 
+   Independent runs of Macqueen's algorithm with pseudorandom presentation. 
+   Run R is seeded with SEED + R and stores its MSE in MSE[R] and what the 
+   library measured in STATS[R], so the results do not depend on the order 
+   in which the runs complete. Each thread takes runs in turn with a 
+   quantizer of its own, which clusters serially.
+ */
+
+typedef struct
+ {
+  const MKM_Image *img;
+  MKM_Options options;
+  int num_runs;
+  std::atomic<int> next_run;
+  double *mse;
+  MKM_Stats *stats;
+ } Runs_Job;
+
+static void
+run_worker ( Runs_Job *job )
+{
+ int run;
+ MKM_Options options = job->options;
+ MKM_Quantizer *quantizer;
+
+ options.num_threads = 1;
+ check_status ( mkm_create ( &options, &quantizer ) );
+
+ while ( ( run = job->next_run.fetch_add ( 1 ) ) < job->num_runs )
+  {
+   options.seed = job->options.seed + run;
+   check_status ( mkm_set_options ( quantizer, &options ) );
+   check_status ( mkm_cluster ( quantizer, job->img ) );
+
+   /* Only the MSE is needed, so nothing is written */
+   check_status ( mkm_map ( quantizer, NULL, 0, job->img->height, NULL ) );
+   mkm_get_stats ( quantizer, &job->stats[run] );
+   job->mse[run] = quantizer_mse ( quantizer );
+  }
+
+ mkm_destroy ( quantizer );
+}
+
+/* Run NUM_RUNS runs on IMG with NUM_THREADS threads and print the MSE */
+static void
+run_many ( const MKM_Image *img, const MKM_Options *options, const int num_runs )
+{
+ int num_threads = std::min ( options->num_threads, num_runs );
+ double mean_mse, stdev_mse;
+ std::vector<std::thread> workers;
+ Runs_Job job;
+
+ job.img = img;
+ job.options = *options;
+ job.num_runs = num_runs;
+ job.next_run = 0;
+ job.mse = ( double * ) malloc ( num_runs * sizeof ( double ) );
+ job.stats = ( MKM_Stats * ) malloc ( num_runs * sizeof ( MKM_Stats ) );
+
+ /* The runs are independent, so run them concurrently */
+ for ( int t = 1; t < num_threads; t++ )
+  {
+   workers.emplace_back ( run_worker, &job );
+  }
+
+ run_worker ( &job );
+ for ( auto &worker : workers )
+  {
+   worker.join ( );
+  }
+
+ for ( int run = 0; run < num_runs; run++ )
+  {
+   print_stats ( &job.stats[run], options->algorithm, options->num_colors );
+  }
+
+ mean_stdev ( job.mse, num_runs, &mean_mse, &stdev_mse );
+ if ( 1 <= stats_level )
+  {
+   printf ( "MSE = $%.1f_{%.1f}$\n", mean_mse, stdev_mse );
+  }
+
+ free ( job.mse );
+ free ( job.stats );
+}
+
+/* 
+   Batch mode. The images named in a list file ( one per line ) or the 
+   .ppm files of a directory are quantized in one process and written 
+   under the same names to an output directory. Three stages overlap: a 
+   reader thread loads image i + 1 while the main thread clusters and 
+   maps image i with the quantizer and a writer thread writes image 
+   i - 1. At most MAX_IN_FLIGHT images are between the start of their 
+   reading and the end of their writing. The writer also appends a line 
+   per image with its stage times and MSE to a summary file.
+ */
+
+typedef struct
+ {
+  std::string in_name, out_name;
+  PPM_Image *in_img;
+  uint8_t *out_data;      /* quantized pixels ( PPM output ) */
+  Indexed_Image *idx_img; /* indexed output */
+  double mse;
+  double read_time, clust_time, map_time, write_time; /* ms */
+ } Batch_Item;
+
+/* Queue of items handed from one stage to the next; NULL marks the end */
+typedef struct
+ {
+  std::deque<Batch_Item *> items;
+  std::mutex mutex;
+  std::condition_variable cv;
+ } Batch_Queue;
+
+static void
+batch_push ( Batch_Queue *queue, Batch_Item *item )
+{
+ {
+  std::lock_guard<std::mutex> lock ( queue->mutex );
+  queue->items.push_back ( item );
+ }
+ queue->cv.notify_one ( );
+}
+
+static Batch_Item *
+batch_pop ( Batch_Queue *queue )
+{
+ Batch_Item *item;
+ std::unique_lock<std::mutex> lock ( queue->mutex );
+
+ queue->cv.wait ( lock, [queue] { return !queue->items.empty ( ); } );
+ item = queue->items.front ( );
+ queue->items.pop_front ( );
+
+ return item;
+}
+
+typedef struct
+ {
+  std::vector<std::string> in_names;
+  std::string out_dir;
+  Batch_Queue read_q, write_q;
+  std::mutex mutex;
+  std::condition_variable slot_cv;
+  int free_slots;         /* # more images that may be in flight */
+  FILE *summary;
+ } Batch;
+
+/* Collect the input names from LIST ( a list file or a directory ) */
+static void
+batch_inputs ( const char *list, std::vector<std::string> *names )
+{
+ char line[4096];
+ size_t len;
+ FILE *fp;
+
+ #ifdef HAVE_POSIX
+ DIR *dir;
+ struct dirent *entry;
+
+ dir = opendir ( list );
+ if ( dir )
+  {
+   while ( ( entry = readdir ( dir ) ) )
+    {
+     len = strlen ( entry->d_name );
+     if ( 4 < len && !strcmp ( entry->d_name + len - 4, ".ppm" ) )
+      {
+       names->push_back ( std::string ( list ) + "/" + entry->d_name );
+      }
+    }
+
+   closedir ( dir );
+   std::sort ( names->begin ( ), names->end ( ) );
+   return;
+  }
+ #endif
+
+ fp = fopen ( list, "r" );
+ if ( !fp ) 
+  {
+   fprintf ( stderr, "Unable to open file '%s'!\n", list );
+   exit ( EXIT_FAILURE );
+  }
+
+ while ( fgets ( line, sizeof ( line ), fp ) )
+  {
+   len = strcspn ( line, "\r\n" );
+   line[len] = '\0';
+   if ( len )
+    {
+     names->push_back ( line );
+    }
+  }
+
+ fclose ( fp );
+}
+
+static void
+batch_reader ( Batch *batch )
+{
+ Batch_Item *item;
+ const char *base;
 
- free ( clusters );
+ for ( const std::string &name : batch->in_names )
+  {
+   /* Wait for a free slot */
+   {
+    std::unique_lock<std::mutex> lock ( batch->mutex );
+    batch->slot_cv.wait ( lock, [batch] { return 0 < batch->free_slots; } );
+    batch->free_slots--;
+   }
 
- return out_img;
-}
+   item = new Batch_Item ( );
+   item->in_name = name;
+   base = strrchr ( name.c_str ( ), '/' );
+   item->out_name = batch->out_dir + "/" + ( base ? base + 1 : name.c_str ( ) );
 
-/* Color quantization using Lloyd's k-means algorithm */
-/* 
-   For application of Lloyd's k-means algorithm to color quantization, see
-   M. E. Celebi, Improving the Performance of K-Means for Color Quantization, 
-   Image and Vision Computing, vol. 29, no. 4, pp. 260271, 2011.
- */
+   #ifdef HAVE_POSIX
+   struct stat in_st, out_st;
 
-RGB_Image* 
-lloyd_cluster ( const RGB_Image *in_img, const int num_colors, 
-		const int max_iters, RGB_Pixel *mean )
-{
- int i, j, min_dist_index;
- int num_iters, num_changes;
- int size;
- int *member;
- double min_dist, dist;
- double delta_red, delta_blue, delta_green;
- #ifdef PRINT_OBJ
- double old_obj, new_obj = DBL_MAX;
- #endif
- RGB_Cluster *clusters, *tmp_clusters, *cluster;
- RGB_Pixel in_pix, *out_pix;
- RGB_Image *out_img;
+   if ( !stat ( item->in_name.c_str ( ), &in_st ) && !stat ( item->out_name.c_str ( ), &out_st ) && 
+	in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino )
+    {
+     fprintf ( stderr, "Output '%s' would overwrite its input!\n", item->out_name.c_str ( ) );
+     exit ( EXIT_FAILURE );
+    }
+   #endif
 
- clusters = ( RGB_Cluster * ) malloc ( num_colors * sizeof ( RGB_Cluster ) );
- tmp_clusters = ( RGB_Cluster * ) malloc ( num_colors * sizeof ( RGB_Cluster ) );
- member = ( int * ) malloc ( in_img->size * sizeof ( int ) );
+   /* Read the pixels here, while the previous image is clustered */
+   auto start = high_resolution_clock::now ( );
+   item->in_img = read_PPM ( name.c_str ( ) );
+   load_PPM ( item->in_img );
+   item->read_time = elapsed_ms ( start );
 
- auto start = high_resolution_clock::now ( );
-    
- /* Initialize cluster centers */
- maximin ( in_img, clusters, num_colors, mean );
-    
- auto stop = high_resolution_clock::now ( );
- auto duration = duration_cast<microseconds> ( stop - start ); 
- #ifdef PRINT_TIME_INIT
- printf ( "Initialization time = %g\n", duration.count ( ) / 1e3 );
- #endif
+   batch_push ( &batch->read_q, item );
+  }
 
- start = high_resolution_clock::now ( );
+ batch_push ( &batch->read_q, NULL );
+}
 
- num_iters = 0;
+static void
+batch_writer ( Batch *batch )
+{
+ Batch_Item *item;
+ const MKM_Image *img;
+ FILE *fp;
 
- /* Clustering pixel data using Lloyd's k-means algorithm */
- do
+ while ( ( item = batch_pop ( &batch->write_q ) ) )
   {
-   num_iters++;
-   num_changes = 0;
+   auto start = high_resolution_clock::now ( );
 
-   #ifdef PRINT_OBJ
-   old_obj = new_obj;
-   new_obj = 0.0;
-   #endif
+   img = &item->in_img->img;
 
-   /* Reset the new clusters */ 
-   for ( j = 0; j < num_colors; j++ )
+   if ( item->idx_img )
     {
-     cluster = &tmp_clusters[j];
-     cluster->center.red = 0.0;
-     cluster->center.green = 0.0;
-     cluster->center.blue = 0.0;
-     cluster->size = 0;
+     write_indexed ( item->out_name.c_str ( ), item->idx_img );
+     free_indexed ( item->idx_img );
     }
-
-   for ( i = 0; i < in_img->size; i++ )
+   else
     {
-     /* Cache the pixel */
-     in_pix = in_img->data[i];
- 
-     /* Find the nearest center */
-     min_dist = MAX_RGB_DIST; 
-     min_dist_index = -INT_MAX;
-     for ( j = 0; j < num_colors; j++ ) 
+     fp = fopen ( item->out_name.c_str ( ), "wb" );
+     if ( !fp ) 
       {
-       cluster = &clusters[j];
- 
-       delta_red = in_pix.red - cluster->center.red;
-       delta_green = in_pix.green - cluster->center.green;
-       delta_blue = in_pix.blue - cluster->center.blue;
-       dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
- 
-       if ( dist < min_dist )
-        {
-         min_dist = dist;
-         min_dist_index = j;
-        } 
+       fprintf ( stderr, "Unable to open file '%s'!\n", item->out_name.c_str ( ) );
+       exit ( EXIT_FAILURE );
       }
-      
-     #ifdef PRINT_OBJ
-     new_obj += min_dist;
-     #endif
 
-     if ( ( num_iters == 1 ) || ( member[i] != min_dist_index ) )
+     fprintf ( fp, "P6\n" );
+     fprintf ( fp, "%d %d\n", img->width, img->height );
+     fprintf ( fp, "%d\n", 255 );
+     fwrite ( item->out_data, 3 * ( size_t ) img->width, img->height, fp );
+     if ( ferror ( fp ) || fclose ( fp ) )
       {
-       /* Update the membership of the pixel */
-       member[i] = min_dist_index;
-       num_changes++;
+       perror ( item->out_name.c_str ( ) );
+       exit ( EXIT_FAILURE );
       }
-	
-     /* Update the temp center of the nearest cluster */
-     cluster = &tmp_clusters[min_dist_index];
-     cluster->center.red += in_pix.red;
-     cluster->center.green += in_pix.green;
-     cluster->center.blue += in_pix.blue;
-     cluster->size += 1;
-    }
 
-   /* Update all centers */
-   for ( j = 0; j < num_colors; j++ )
-    {
-     cluster = &tmp_clusters[j];
-     if ( ( size = cluster->size ) != 0 )
-      {
-       clusters[j].center.red = cluster->center.red / size;
-       clusters[j].center.green = cluster->center.green / size;
-       clusters[j].center.blue = cluster->center.blue / size;
-      }
+     free ( item->out_data );
     }
 
-   #ifdef PRINT_OBJ
-   printf ( "iteration %d: obj = %g ; delta obj = %g [# changes = %d]\n", 
-	    num_iters, new_obj, 
-	    num_iters == 1 ? 0.0 : ( old_obj - new_obj ) / old_obj,  
-     	    num_changes );
-   #endif
-  }
- while ( 0 < num_changes && num_iters < max_iters );
-    
- stop = high_resolution_clock::now ( );
- duration = duration_cast<microseconds> ( stop - start ); 
- #ifdef PRINT_TIME_CLUST
- printf ( "Clustering time = %g\n", duration.count ( ) / 1e3 );
- #endif
-
- out_img = ( RGB_Image * ) malloc ( sizeof ( RGB_Image ) );
- out_img->data = ( RGB_Pixel * ) malloc ( in_img->size * sizeof ( RGB_Pixel ) );
- out_img->width = in_img->width;
- out_img->height = in_img->height;
- out_img->size = in_img->size;
-
- start = high_resolution_clock::now ( );
-
- /* Now quantize the image */
- for ( i = 0; i < in_img->size; i++ )
-  {
-   /* Cache the pixel */
-   in_pix = in_img->data[i];
-        
-   /* Find the nearest center */
-   min_dist = MAX_RGB_DIST;
-   min_dist_index = -INT_MAX;
-   for ( j = 0; j < num_colors; j++ ) 
-    {
-     cluster = &clusters[j];
-	    	    
-     delta_red = in_pix.red - cluster->center.red;
-     delta_green = in_pix.green - cluster->center.green;
-     delta_blue = in_pix.blue - cluster->center.blue;
-     dist = delta_red * delta_red + delta_green * delta_green + delta_blue * delta_blue;
-
-     if ( dist < min_dist )
-      {
-       min_dist = dist;
-       min_dist_index = j;
-      }     
-    }
+   item->write_time = elapsed_ms ( start );
 
-   /* Replace the input color with the nearest color in the palette */
-   in_pix = clusters[min_dist_index].center;
-   out_pix = &out_img->data[i];
-   out_pix->red = in_pix.red;
-   out_pix->green = in_pix.green;
-   out_pix->blue = in_pix.blue;       
-  }
-    
- stop = high_resolution_clock::now ( );
- duration = duration_cast<microseconds> ( stop - start ); 
- #ifdef PRINT_TIME_MAP
- printf ( "Mapping time = %g\n", duration.count ( ) / 1e3 );
- #endif
+   fprintf ( batch->summary, "%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.4f\n", item->in_name.c_str ( ), 
+	     img->width, img->height, item->read_time, item->clust_time, 
+	     item->map_time, item->write_time, item->mse );
+   fflush ( batch->summary );
 
- #ifdef PRINT_ITER
- printf ( "Number of iterations = %d\n", num_iters );
- #endif
- 
- free ( clusters );
- free ( tmp_clusters );
- free ( member );
+   free_PPM ( item->in_img );
+   delete item;
 
- return out_img;
+   /* Free the slot */
+   {
+    std::lock_guard<std::mutex> lock ( batch->mutex );
+    batch->free_slots++;
+   }
+   batch->slot_cv.notify_one ( );
+  }
 }
 
-/* Calculate the MSE between two RGB images */
+/* 
+   Quantize the images of LIST into OUT_DIR in FORMAT ( as in 
+   write_quantized ) with the options of QUANTIZER, which is reused for 
+   every image, and MAX_IN_FLIGHT images in flight. Writes the summary 
+   to OUT_DIR/summary.csv and returns the # images processed.
+ */
 
-double 
-calc_MSE ( const RGB_Image *img1, const RGB_Image *img2 )
+int
+batch_quantize ( const char *list, const char *out_dir, MKM_Quantizer *quantizer, 
+		 const int format, const int num_colors, const int max_in_flight )
 {
- double delta, total = 0.0;
-
- for ( int i = 0; i < img1->size; i++ )
+ int num_images = 0;
+ std::string summary_name;
+ Batch batch;
+ Batch_Item *item;
+ const MKM_Image *img;
+ MKM_Output output;
+
+ batch_inputs ( list, &batch.in_names );
+ batch.out_dir = out_dir;
+ batch.free_slots = max_in_flight;
+
+ summary_name = batch.out_dir + "/summary.csv";
+ batch.summary = fopen ( summary_name.c_str ( ), "w" );
+ if ( !batch.summary ) 
   {
-   delta = img1->data[i].red - img2->data[i].red;
-   total += delta * delta;
-   delta = img1->data[i].green - img2->data[i].green;
-   total += delta * delta;
-   delta = img1->data[i].blue - img2->data[i].blue;
-   total += delta * delta;
+   fprintf ( stderr, "Unable to open file '%s'!\n", summary_name.c_str ( ) );
+   exit ( EXIT_FAILURE );
   }
 
- return total / img1->size;
-}
+ fprintf ( batch.summary, "image,width,height,read_ms,cluster_ms,map_ms,write_ms,mse\n" );
 
-static void
-print_usage ( char *prog_name )
-{
- fprintf ( stderr, "Color Quantization Using Macqueen's K-Means Algorithm\n\n" ); 
- fprintf ( stderr, "Reference: S. Thompson, M. E. Celebi, and K. H. Buck, Fast Color Quantization Using Macqueens K-Means Algorithm, Journal of Real-Time Image Processing, to appear (https://doi.org/10.1007/s11554-019-00914-6), 2020.\n\n" ); 
- fprintf ( stderr, "Usage: %s -i <input image> -o <output image> -n <# colors> -a <algorithm> -p <presentation order> -e <exponent> -s <sampling rate> -r <# runs> -d <seed> -t <# iters>\n\n", prog_name );
- fprintf ( stderr, "All parameters are optional except for the <input image>\n\n" );
- fprintf ( stderr, "-i <input image>: input image in binary ppm format\n\n" ); 
- fprintf ( stderr, "-o <output image>: output image in binary ppm format (default = out.ppm)\n\n" ); 
- fprintf ( stderr, "-n <# colors>: # colors (integer greater than 1; default = 256).\n\n" ); 
- fprintf ( stderr, "-a <algorithm>: clustering algorithm (0: Macqueen, 1: Lloyd; default = 0)\n\n" );
- fprintf ( stderr, "-p <presentation order>: presentation order for Macqueen's algorithm (0: quasirandom, 1: pseudorandom; default = 0)\n\n" );
- fprintf ( stderr, "-e <exponent>: learning rate exponent for Macqueen's algorithm (double-precision floating point in [0.5, 1]; default = 0.5)\n\n" );
- fprintf ( stderr, "-s <sampling rate>: sampling rate for Macqueen's algorithm (double-precision floating point in (0, 1]; default = 1.0)\n\n" );
- fprintf ( stderr, "-r <# runs>: # independent runs for Macqueen's algorithm with pseudorandom presentation (positive integer; default = 1)\n\n" );
- fprintf ( stderr, "-d <seed>: seed for the pseudorandom number generator for Macqueen's algorithm (nonnegative integer; default = # secs. since 1/1/1970 UTC)\n\n" );
- fprintf ( stderr, "-t <# iters>: max. # iterations for Lloyd's algorithm (positive integer; default = %d)\n\n", INT_MAX );
- fprintf ( stderr, "The program generally runs faster if one or more of the following holds: i) image dimensions are small, ii) <# colors> is small, iii) <algorithm> is 0 (Macqueen), iv) <exponent> is small, v) <sampling rate> is small.\n\n" );
- fprintf ( stderr, "Many image manipulation software can display/convert/process PPM images including Irfanview (http://www.irfanview.com), GIMP (http://www.gimp.org), Netpbm (http://netpbm.sourceforge.net), and ImageMagick (http://www.imagemagick.org/script/index.php).\n\n" );
+ std::thread reader ( batch_reader, &batch );
+ std::thread writer ( batch_writer, &batch );
 
- exit ( EXIT_FAILURE );
-}
+ while ( ( item = batch_pop ( &batch.read_q ) ) )
+  {
+   auto start = high_resolution_clock::now ( );
 
-void
-mean_stdev ( const double *data, const int num_elems, double *mean, double *stdev )
-{
- *mean = *stdev = 0.0;
+   img = &item->in_img->img;
+   check_status ( mkm_cluster ( quantizer, img ) );
+   item->clust_time = elapsed_ms ( start );
 
- if ( num_elems == 1 ) 
-  {
-   *mean = data[0];
-   return;
-  }
+   start = high_resolution_clock::now ( );
 
- for ( int i = 0; i < num_elems; i++ )
-  {
-   *mean += data[i];
-  }
+   if ( format == 0 )
+    {
+     /* The whole image is a single strip, kept for the writer */
+     item->out_data = ( uint8_t * ) malloc ( 3 * ( size_t ) img->width * img->height );
+     if ( !item->out_data ) 
+      {
+       fprintf ( stderr, "Unable to allocate memory!\n" );
+       exit ( EXIT_FAILURE );
+      }
 
- *mean /= num_elems;
+     item->idx_img = NULL;
+     output.rgb = item->out_data;
+     output.rgb_stride = 3 * ( size_t ) img->width;
+     output.indices = NULL;
+     output.index_size = 0;
+     output.index_stride = 0;
+     check_status ( mkm_map ( quantizer, NULL, 0, img->height, &output ) );
+    }
+   else
+    {
+     item->out_data = NULL;
+     item->idx_img = map_indexed ( quantizer, img->width, img->height, num_colors );
+    }
 
- for ( int i = 0; i < num_elems; i++ )
-  {
-   *stdev += ( data[i] - *mean ) * ( data[i] - *mean );
+   item->mse = quantizer_mse ( quantizer );
+   item->map_time = elapsed_ms ( start );
+
+   batch_push ( &batch.write_q, item );
+   num_images++;
   }
 
- *stdev = sqrt ( *stdev / ( num_elems - 1 ) );
+ batch_push ( &batch.write_q, NULL );
+ reader.join ( );
+ writer.join ( );
+ fclose ( batch.summary );
+
+ return num_images;
 }
 
 int 
@@ -936,14 +1701,39 @@ main ( int argc, char **argv )
  char out_file_name[256] = "out.ppm";
  int num_colors = 256;
  int algo = 0;
+ int init = MKM_INIT_MAXIMIN;
  int pres_order = 0;
+ int use_prune = -1;
  int num_runs = 1;
  int seed = -1;
  int max_iters = INT_MAX;
+ int use_hist = 0;
+ int trace = 0;
+ int batch_size = 1024;
+ int num_batches = 0;
+ int out_format = 0;
+ int mem_budget = 0;
+ int num_threads = 1;
+ int max_in_flight = 3;
+ int key_interval = -1;
+ int warm_iters = 2;
+ int perf = 0;
+ double scene_cut = 0.3;
+ double warm_rate = 0.0;
+ double warm_decay = 0.1;
+ bool out_given = false;
+ const char *batch_list = NULL;
+ ulong run_seed;
  double lr_exp = 0.5;
  double sample_rate = 1.0;
- RGB_Pixel mean;
- RGB_Image *in_img, *out_img;
+ double init_rate = 0.05;
+ double tolerance = 0.0;
+ double old_obj = 0.0;
+ double mse = 0.0;
+ PPM_Image *in_img;
+ MKM_Options options;
+ MKM_Stats stats;
+ MKM_Quantizer *quantizer;
 
  if ( argc == 1 )
   {
@@ -959,12 +1749,13 @@ main ( int argc, char **argv )
    else if ( !strcmp ( argv[i], "-o" ) )
     {
      strcpy ( out_file_name, argv[++i] );
+     out_given = true;
     }
    else if ( !strcmp ( argv[i], "-n" ) )
     {
      num_colors = atoi ( argv[++i] );
      
-     if ( num_colors < 2 ) 
+     if ( num_colors < 2 || MKM_MAX_COLORS < num_colors ) 
       {
        print_usage ( argv[0] );
      }
@@ -973,7 +1764,25 @@ main ( int argc, char **argv )
     {
      algo = atoi ( argv[++i] );
      
-     if ( algo != 0 && algo != 1 ) 
+     if ( algo < 0 || 3 < algo ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-I" ) )
+    {
+     init = atoi ( argv[++i] );
+     
+     if ( init < MKM_INIT_MAXIMIN || MKM_INIT_WU < init ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-J" ) )
+    {
+     init_rate = atof ( argv[++i] );
+     
+     if ( init_rate <= 0.0 || 1.0 < init_rate ) 
       {
        print_usage ( argv[0] );
       }
@@ -1005,6 +1814,15 @@ main ( int argc, char **argv )
        print_usage ( argv[0] );
       }
     }
+   else if ( !strcmp ( argv[i], "-X" ) )
+    {
+     use_prune = atoi ( argv[++i] );
+     
+     if ( use_prune < -1 || 1 < use_prune ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
    else if ( !strcmp ( argv[i], "-r" ) )
     {
      num_runs = atoi ( argv[++i] );
@@ -1027,74 +1845,309 @@ main ( int argc, char **argv )
        print_usage ( argv[0] );
       }
     }
+   else if ( !strcmp ( argv[i], "-y" ) )
+    {
+     tolerance = atof ( argv[++i] );
+     
+     if ( tolerance < 0.0 || 1.0 <= tolerance ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-g" ) )
+    {
+     trace = atoi ( argv[++i] );
+     
+     if ( trace != 0 && trace != 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-z" ) )
+    {
+     batch_size = atoi ( argv[++i] );
+     
+     if ( batch_size < 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-k" ) )
+    {
+     num_batches = atoi ( argv[++i] );
+     
+     if ( num_batches < 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-j" ) )
+    {
+     num_threads = atoi ( argv[++i] );
+     
+     if ( num_threads < 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-f" ) )
+    {
+     out_format = atoi ( argv[++i] );
+     
+     if ( out_format != 0 && out_format != 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-b" ) )
+    {
+     batch_list = argv[++i];
+    }
+   else if ( !strcmp ( argv[i], "-q" ) )
+    {
+     max_in_flight = atoi ( argv[++i] );
+     
+     if ( max_in_flight < 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-m" ) )
+    {
+     mem_budget = atoi ( argv[++i] );
+     
+     if ( mem_budget < 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-v" ) )
+    {
+     key_interval = atoi ( argv[++i] );
+     
+     if ( key_interval < 0 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-c" ) )
+    {
+     scene_cut = atof ( argv[++i] );
+     
+     if ( scene_cut < 0.0 || 1.0 < scene_cut ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-w" ) )
+    {
+     warm_rate = atof ( argv[++i] );
+     
+     if ( warm_rate <= 0.0 || 1.0 < warm_rate ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-x" ) )
+    {
+     warm_iters = atoi ( argv[++i] );
+     
+     if ( warm_iters < 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-l" ) )
+    {
+     warm_decay = atof ( argv[++i] );
+     
+     if ( warm_decay < 0.0 || 1.0 < warm_decay ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-u" ) )
+    {
+     use_hist = atoi ( argv[++i] );
+     
+     if ( use_hist != 0 && use_hist != 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-S" ) )
+    {
+     stats_level = atoi ( argv[++i] );
+     
+     if ( stats_level < 0 || 3 < stats_level ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
+   else if ( !strcmp ( argv[i], "-P" ) )
+    {
+     perf = atoi ( argv[++i] );
+     
+     if ( perf != 0 && perf != 1 ) 
+      {
+       print_usage ( argv[0] );
+      }
+    }
    else
     {
      print_usage ( argv[0] );
     }
   }
 
- in_img = read_PPM ( in_file_name, &mean );
+ if ( ( mem_budget && ( algo != 0 || out_format != 0 ) ) || ( batch_list && ( mem_budget || 1 < num_runs ) ) || 
+      ( 0 <= key_interval && ( batch_list || mem_budget || 1 < num_runs || out_format != 0 || trace ) ) || 
+      ( ( stats_level == 3 || perf ) && ( batch_list || 1 < num_runs || 0 <= key_interval || trace ) ) )
+  {
+   print_usage ( argv[0] );
+  }
+
+ run_seed = seed < 0 ? time ( NULL ) : seed;
+
+ mkm_default_options ( &options );
+ options.algorithm = algo;
+ options.num_colors = num_colors;
+ options.init = init;
+ options.init_rate = init_rate;
+ options.pres_order = pres_order;
+ options.lr_exp = lr_exp;
+ options.sample_rate = sample_rate;
+ options.seed = run_seed;
+ options.use_prune = use_prune;
+ options.max_iters = max_iters;
+ options.tolerance = tolerance;
+ if ( trace )
+  {
+   options.trace = print_objective;
+   options.trace_arg = &old_obj;
+  }
+ options.use_hist = use_hist;
+ options.batch_size = batch_size;
+ options.num_batches = num_batches;
+ options.warm_decay = warm_decay;
+ options.num_threads = num_threads;
+ if ( stats_level == 3 || perf )
+  {
+   report_open ( perf );
+   options.probe = report_probe;
+   options.probe_arg = &report;
+  }
 
- if ( pres_order == 1 )
+ if ( batch_list )
   {
-   init_genrand ( seed < 0 ? time ( NULL ) : seed );
+   auto start = high_resolution_clock::now ( );
+
+   check_status ( mkm_create ( &options, &quantizer ) );
+   int num_images = batch_quantize ( batch_list, out_given ? out_file_name : ".", quantizer, 
+				     out_format, num_colors, max_in_flight );
+
+   printf ( "Batch time = %g (%d images)\n", elapsed_ms ( start ), num_images );
+
+   mkm_destroy ( quantizer );
+
+   return EXIT_SUCCESS;
   }
 
- auto start = high_resolution_clock::now ( );
+ if ( 0 <= key_interval )
+  {
+   Frame_Options frame;
+
+   frame.key_interval = key_interval;
+   frame.scene_cut = scene_cut;
+   frame.warm_rate = warm_rate ? warm_rate : sample_rate / 4;
+   frame.warm_iters = warm_iters;
+   quantize_frames ( stdin, stdout, &options, &frame );
+
+   return EXIT_SUCCESS;
+  }
 
- if ( algo == 0 )
+ if ( mem_budget )
   {
-   if ( pres_order == 0 || num_runs == 1 )
+   auto start = high_resolution_clock::now ( );
+
+   mse = quantize_stream ( in_file_name, out_file_name, &options, ( long long ) mem_budget << 20, 
+			   &stats );
+   if ( 1 <= stats_level && stats_level <= 2 )
     {
-     out_img = macqueen_cluster ( in_img, num_colors, pres_order, lr_exp, sample_rate, &mean );
-     write_PPM ( out_img, out_file_name  );
-     #ifdef PRINT_MSE
-     printf ( "MSE = %.2f\n", calc_MSE ( in_img, out_img ) );
-     #endif
-     free ( out_img->data );
-     free ( out_img );
+     printf ( "MSE = %.2f\n", mse );
     }
-   else
-    {
-     double mean_mse, stdev_mse;
-     double *mse = ( double * ) malloc ( num_runs * sizeof ( double ) );
 
-     for ( int r = 0; r < num_runs; r++ )
-      {
-       out_img = macqueen_cluster ( in_img, num_colors, pres_order, lr_exp, sample_rate, &mean );
-       mse[r] = calc_MSE ( in_img, out_img );
+   print_counters ( );
+   if ( stats_level == 3 )
+    {
+     int width, height;
+     double total_time = elapsed_ms ( start );
 
-       free ( out_img->data );
-       free ( out_img );
-      }
-       
-     mean_stdev ( mse, num_runs, &mean_mse, &stdev_mse );
-     #ifdef PRINT_MSE
-     printf ( "MSE = $%.1f_{%.1f}$\n", mean_mse, stdev_mse );
-     #endif
-     free ( mse );
+     fclose ( open_PPM ( in_file_name, &width, &height ) );
+     print_json ( in_file_name, width, height, &options, &stats, mse, total_time );
     }
+
+   return EXIT_SUCCESS;
+  }
+
+ report_probe ( &report, PHASE_READ, 0 );
+ in_img = read_PPM ( in_file_name );
+ report_probe ( &report, PHASE_READ, 1 );
+ if ( report.enabled )
+  {
+   report.bytes_read = file_size ( in_file_name );
+  }
+
+ auto start = high_resolution_clock::now ( );
+
+ if ( algo == 0 && pres_order == 1 && 1 < num_runs )
+  {
+   run_many ( &in_img->img, &options, num_runs );
   }
  else
   {
-   out_img = lloyd_cluster ( in_img, num_colors, max_iters, &mean );
-   write_PPM ( out_img, out_file_name  );
-   #ifdef PRINT_MSE
-   printf ( "MSE = %.2f\n", calc_MSE ( in_img, out_img ) );
-   #endif
-   free ( out_img->data );
-   free ( out_img );
+   check_status ( mkm_create ( &options, &quantizer ) );
+   check_status ( mkm_cluster ( quantizer, &in_img->img ) );
+   mkm_get_stats ( quantizer, &stats );
+   print_stats ( &stats, algo, num_colors );
+
+   report_probe ( &report, PHASE_WRITE, 0 );
+   write_quantized ( out_file_name, out_format, quantizer, in_img->img.width, 
+		     in_img->img.height, num_colors );
+   report_probe ( &report, PHASE_WRITE, 1 );
+   if ( report.enabled )
+    {
+     report.bytes_written = file_size ( out_file_name );
+    }
+
+   mkm_get_stats ( quantizer, &stats );
+   mse = quantizer_mse ( quantizer );
+   if ( stats_level == 2 )
+    {
+     printf ( "Mapping time = %g\n", stats.map_time );
+    }
+
+   if ( 1 <= stats_level && stats_level <= 2 )
+    {
+     printf ( "MSE = %.2f\n", mse );
+    }
+
+   print_counters ( );
+   mkm_destroy ( quantizer );
   }
     
- auto stop = high_resolution_clock::now ( );
- auto duration = duration_cast<microseconds> ( stop - start ); 
+ double total_time = elapsed_ms ( start );
    
- #ifdef PRINT_TIME_TOTAL
- printf ( "Total time = %g\n", duration.count ( ) / 1e3 );
- #endif
+ if ( stats_level == 2 )
+  {
+   printf ( "Total time = %g\n", total_time );
+  }
+ else if ( stats_level == 3 )
+  {
+   print_json ( in_file_name, in_img->img.width, in_img->img.height, &options, &stats, 
+		mse, total_time );
+  }
 
- free ( in_img->data );
- free ( in_img );
+ free_PPM ( in_img );
 
  return EXIT_SUCCESS;
 }
@@ -0,0 +1,236 @@
+/*
+  Color quantization with Macqueen's k-means algorithm ( or Lloyd's,
+  plain or accelerated with Hamerly's bounds, or mini-batch k-means )
+  as a library. See
+  libmkm.c for the implementation and mkm.c for a client ( the mkm
+  command line program ).
+
+  A quantizer ( MKM_Quantizer ) holds the options, a pool of worker
+  threads, the palette found by the last clustering and all the working
+  memory. The working memory is kept from one call to the next and only
+  grows, so once a quantizer has seen its largest image, further calls
+  allocate nothing. A quantizer must not be used by more than one thread
+  at a time; use one quantizer per thread instead.
+
+  Images are caller-owned buffers of 8-bit R, G, B triplets stored row
+  by row, STRIDE bytes apart. The library never keeps a pointer to them
+  beyond a call, except that mkm_map may be asked to map the image of
+  the last mkm_cluster call again ( see mkm_map ).
+
+  Every function that can fail returns MKM_OK or one of the error codes
+  below; mkm_status_string describes them. Nothing is printed and the
+  process is never terminated.
+
+  Typical use:
+
+    MKM_Options options;
+    MKM_Quantizer *quantizer;
+    MKM_Image image = { pixels, width, height, 3 * width };
+    MKM_Output output = { NULL, 0, indices, 1, width };
+
+    mkm_default_options ( &options );
+    options.num_colors = 16;
+    if ( mkm_create ( &options, &quantizer ) == MKM_OK )
+     {
+      status = mkm_quantize ( quantizer, &image, palette, &output );
+      ...
+      mkm_destroy ( quantizer );
+     }
+ */
+
+#ifndef MKM_H
+#define MKM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+ {
+  MKM_OK = 0,
+  MKM_ERROR_ARGUMENT, /* invalid option, image or output buffer */
+  MKM_ERROR_MEMORY,   /* out of memory */
+  MKM_ERROR_THREADS,  /* unable to start the worker threads */
+  MKM_ERROR_STATE     /* no palette ( or sample ) to work with yet */
+ } MKM_Status;
+
+/* Clustering algorithms */
+#define MKM_MACQUEEN 0
+#define MKM_LLOYD 1
+#define MKM_HAMERLY 2
+#define MKM_MINIBATCH 3
+
+/* Initializers */
+#define MKM_INIT_MAXIMIN 0    /* maximin on all the pixels */
+#define MKM_INIT_SUBSAMPLE 1  /* maximin on a quasirandom sample of init_rate x # pixels */
+#define MKM_INIT_MEDIAN_CUT 2 /* Heckbert's median cut on a 5-bit-per-channel histogram */
+#define MKM_INIT_WU 3         /* Wu's variance-based splitting on the same histogram */
+
+/* Most colors in a palette */
+#define MKM_MAX_COLORS 65536
+
+/*
+  Called after each iteration of Lloyd's algorithm ( plain or Hamerly's )
+  with ARG, the iteration number, its objective ( the sum of squared
+  distances of the pixels to the centroids of their clusters ) and the
+  # pixels that changed clusters
+ */
+typedef void ( *MKM_Trace ) ( void *arg, int iter, double objective, int num_changes );
+
+/* Phases of a clustering and of mkm_map ( see MKM_Probe ) */
+#define MKM_PHASE_HIST 0    /* histogram ( Lloyd, Hamerly with use_hist ) */
+#define MKM_PHASE_INIT 1    /* initializer or warm start */
+#define MKM_PHASE_CLUSTER 2 /* clustering algorithm */
+#define MKM_PHASE_MAP 3     /* one mkm_map call */
+#define MKM_NUM_PHASES 4
+
+/*
+  Called with ARG right before ( END = 0 ) and right after ( END = 1 )
+  each phase, outside of the times in MKM_Stats, e.g. to read hardware
+  counters. The library does no other bookkeeping for it.
+ */
+typedef void ( *MKM_Probe ) ( void *arg, int phase, int end );
+
+typedef struct
+ {
+  int algorithm;      /* MKM_MACQUEEN, MKM_LLOYD, MKM_HAMERLY or MKM_MINIBATCH */
+  int num_colors;     /* palette size, in [2, MKM_MAX_COLORS] */
+  int init;           /* MKM_INIT_MAXIMIN, MKM_INIT_SUBSAMPLE, MKM_INIT_MEDIAN_CUT or MKM_INIT_WU */
+  double init_rate;   /* MKM_INIT_SUBSAMPLE: # samples / # pixels, in ( 0, 1 ] */
+  int pres_order;     /* Macqueen, mini-batch: 0 = quasirandom, 1 = pseudorandom */
+  double lr_exp;      /* Macqueen, mini-batch: learning rate exponent, in [0.5, 1] */
+  double sample_rate; /* Macqueen, mini-batch: # samples / # pixels, in ( 0, 1 ] */
+  unsigned long seed; /* Macqueen, mini-batch: seed for the pseudorandom order and sampling */
+  int use_prune;      /* Macqueen: pruned nearest-center search ( -1 = for palettes past the
+			 crossover of the SIMD kernel ( see num_dists ), 0 = no, 1 = yes ) */
+  int max_iters;      /* Lloyd, Hamerly: max. # iterations */
+  double tolerance;   /* Lloyd, Hamerly: stop once the objective falls by less than this
+			 fraction in an iteration, in [0, 1) ( 0 = when no pixel moves ) */
+  MKM_Trace trace;    /* Lloyd, Hamerly: called after each iteration, or NULL */
+  void *trace_arg;
+  MKM_Probe probe;    /* called around each phase, or NULL */
+  void *probe_arg;
+  int use_hist;       /* Lloyd, Hamerly: 1 = run on the distinct colors */
+  int batch_size;     /* mini-batch: # pixels per batch */
+  int num_batches;    /* mini-batch: # batches ( 0 = enough for the sampling rate ) */
+  int warm_start;     /* 1 = start from the last palette instead of the initializer ( see below ) */
+  double warm_decay;  /* warm start: factor on the sizes of the clusters, in [0, 1] */
+  int use_cache;      /* mapping: inverse colormap ( -1 = for large images, 0 = no, 1 = yes ) */
+  int num_threads;    /* # threads, including the calling one */
+ } MKM_Options;
+
+typedef struct
+ {
+  const uint8_t *pixels; /* R, G, B bytes of the first row */
+  int width, height;
+  size_t stride;         /* bytes from the start of one row to the next */
+ } MKM_Image;
+
+/* Where mkm_map puts its results; NULL buffers are skipped */
+typedef struct
+ {
+  uint8_t *rgb;        /* quantized pixels ( R, G, B ) */
+  size_t rgb_stride;
+  void *indices;       /* palette index of each pixel */
+  int index_size;      /* bytes per index: 1 ( up to 256 colors ) or 2 */
+  size_t index_stride;
+ } MKM_Output;
+
+typedef struct
+ {
+  /* Last clustering ( mkm_cluster or mkm_sample_cluster ) */
+  double hist_time;       /* ms, histogram ( use_hist ) */
+  double init_time;       /* ms, initializer */
+  double cluster_time;    /* ms, clustering algorithm */
+  int num_unique;         /* # distinct colors ( use_hist ), or 0 */
+  int num_iters;          /* # Lloyd iterations or mini-batches, or 0 */
+  long long num_changes;  /* Lloyd, Hamerly: # pixels that changed clusters, over all iterations */
+  double objective;       /* Lloyd, Hamerly: objective of the last iteration ( see MKM_Trace ) */
+  long long num_samples;  /* # pixels presented to Macqueen's or the mini-batch algorithm */
+  long long num_dists;    /* # pixel-to-center distance evaluations in the clustering algorithm;
+			     Macqueen's algorithm scans all the centers ( # colors per sample )
+			     unless it prunes the search, which by default it does from 32
+			     colors with the scalar kernel, 128 with SSE4.1, 256 with AVX2
+			     and 1536 with AVX-512, where a full scan stops being faster */
+
+  /* mkm_map calls since the last clustering */
+  double map_time;        /* ms */
+  long long num_mapped;   /* # pixels */
+  unsigned long long sse; /* sum of squared errors ( MSE = SSE / NUM_MAPPED ) */
+ } MKM_Stats;
+
+typedef struct MKM_Quantizer MKM_Quantizer;
+
+/*
+  Defaults: Macqueen's algorithm, 256 colors, maximin ( subsample rate
+  0.05 ), quasirandom order, exponent 0.5, all pixels sampled, seed 0,
+  no iteration limit or tolerance, no trace or probe, no histogram,
+  batches of 1024 pixels, no warm start ( decay 0.1 ), automatic
+  pruned search and inverse colormap, a single thread.
+ */
+void mkm_default_options ( MKM_Options *options );
+
+MKM_Status mkm_create ( const MKM_Options *options, MKM_Quantizer **quantizer );
+
+void mkm_destroy ( MKM_Quantizer *quantizer );
+
+/* Change the options; the palette of the last clustering is kept */
+MKM_Status mkm_set_options ( MKM_Quantizer *quantizer, const MKM_Options *options );
+
+/*
+  Find the palette of IMAGE. With WARM_START set and a palette of
+  NUM_COLORS colors from the last clustering, the algorithm starts from
+  its centers instead of running the initializer, e.g. for the next frame of a
+  video. Each center then counts as WARM_DECAY times the # pixels it
+  got ( at least one ) in the learning rates of Macqueen's and the
+  mini-batch algorithm, so a small decay lets the new image move the
+  centers quickly. Pair it with a lower sampling rate or iteration limit
+  for a shorter pass.
+ */
+MKM_Status mkm_cluster ( MKM_Quantizer *quantizer, const MKM_Image *image );
+
+/*
+  Map the NUM_ROWS rows of IMAGE starting at FIRST_ROW to the palette;
+  the rows of OUTPUT ( NULL for the squared error only ) correspond to
+  those rows. A NULL IMAGE stands for the image of the last mkm_cluster
+  call, which must still be there unchanged; its histogram is then used
+  as well. Images of any size can be mapped, e.g. one strip at a time.
+ */
+MKM_Status mkm_map ( MKM_Quantizer *quantizer, const MKM_Image *image,
+		     const int first_row, const int num_rows, const MKM_Output *output );
+
+/* mkm_cluster, then mkm_map of the whole image and mkm_get_palette */
+MKM_Status mkm_quantize ( MKM_Quantizer *quantizer, const MKM_Image *image,
+			  uint8_t *palette, const MKM_Output *output );
+
+/* Write the palette as # colors R, G, B triplets ( the truncated centers ) */
+MKM_Status mkm_get_palette ( const MKM_Quantizer *quantizer, uint8_t *palette );
+
+void mkm_get_stats ( const MKM_Quantizer *quantizer, MKM_Stats *stats );
+
+/*
+  Clustering on a uniform sample, for images that do not fit in memory:
+  mkm_sample_begin sets up a reservoir of NUM_SAMPLE pixels for an image
+  of WIDTH x HEIGHT pixels, mkm_sample_add feeds it the image in order,
+  a few rows at a time, and mkm_sample_cluster finds the palette of the
+  sample ( with the mean of the whole image as the first center ). When
+  the sample is the whole image, the palette is that of mkm_cluster with
+  a sampling rate of 1. The image can then be mapped strip by strip.
+ */
+MKM_Status mkm_sample_begin ( MKM_Quantizer *quantizer, const int width, const int height,
+			      const int num_sample );
+
+MKM_Status mkm_sample_add ( MKM_Quantizer *quantizer, const MKM_Image *rows );
+
+MKM_Status mkm_sample_cluster ( MKM_Quantizer *quantizer );
+
+const char *mkm_status_string ( const MKM_Status status );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MKM_H */
@@ -0,0 +1,304 @@
+/*
+  Test of the vectorized nearest-center, nearest-two and maximin kernels
+  of the color quantization library against the scalar ones. To compile
+  and run:
+  g++ -O3 -pthread -o test_kernels test_kernels.c -lm && ./test_kernels
+
+  The library is included whole, so that its internal kernels are in
+  reach; build the test with the same compiler and flags as the library.
+  Every kernel the CPU supports must return bit for bit what the scalar
+  kernel returns: the same center or pixel index, the same distance ( and
+  second distance, for nearest-two ) and, for maximin, the same
+  nearest-center distance for every pixel. The cases include palettes of
+  every size up to a few hundred centers, the fixed-size instantiations,
+  tied centers and pixels, and pixel counts that leave every possible
+  remainder after the vector loops. The exit status is EXIT_FAILURE if
+  any result differs.
+ */
+
+#include "libmkm.c"
+
+#define NUM_PIXEL_TESTS 200
+
+static int num_failures = 0;
+
+/* xorshift64*: the test cases do not depend on the library's generators */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+rng_next ( void )
+{
+ rng_state ^= rng_state >> 12;
+ rng_state ^= rng_state << 25;
+ rng_state ^= rng_state >> 27;
+
+ return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in [0, 255], with a fractional part unless INTEGRAL */
+static double
+rng_channel ( const bool integral )
+{
+ return integral ? ( double ) ( rng_next ( ) % 256 ) : ( rng_next ( ) >> 11 ) * ( 255.0 / 9007199254740992.0 );
+}
+
+static RGB_Pixel8
+rng_pixel ( void )
+{
+ RGB_Pixel8 pixel;
+
+ pixel.red = rng_next ( ) % 256;
+ pixel.green = rng_next ( ) % 256;
+ pixel.blue = rng_next ( ) % 256;
+
+ return pixel;
+}
+
+/*
+   NUM_COLORS centers: random, with integral channels if INTEGRAL ( many
+   exact ties ), and with every third one copied to a later position if
+   DUPLICATE, so that equal centers fall in different lanes
+ */
+static void
+make_centers ( RGB_Cluster *clusters, const int num_colors, const bool integral, const bool duplicate )
+{
+ for ( int j = 0; j < num_colors; j++ )
+  {
+   clusters[j].center.red = rng_channel ( integral );
+   clusters[j].center.green = rng_channel ( integral );
+   clusters[j].center.blue = rng_channel ( integral );
+   clusters[j].size = 1;
+  }
+
+ if ( duplicate )
+  {
+   for ( int j = 0; j + 1 < num_colors; j += 3 )
+    {
+     clusters[num_colors - 1 - j / 3].center = clusters[j].center;
+    }
+  }
+}
+
+/* A pixel exactly halfway between two integral centers */
+static RGB_Pixel8
+tied_pixel ( RGB_Cluster *clusters, const int num_colors )
+{
+ const int j = rng_next ( ) % num_colors;
+ const int k = rng_next ( ) % num_colors;
+ RGB_Pixel8 pixel = rng_pixel ( );
+ const int delta = 1 + rng_next ( ) % 20;
+
+ pixel.red = std::max ( delta, std::min ( 255 - delta, ( int ) pixel.red ) );
+ clusters[j].center.red = pixel.red - delta;
+ clusters[j].center.green = pixel.green;
+ clusters[j].center.blue = pixel.blue;
+ clusters[k].center.red = pixel.red + delta;
+ clusters[k].center.green = pixel.green;
+ clusters[k].center.blue = pixel.blue;
+
+ return pixel;
+}
+
+static void
+check_nearest ( const NN_Kernels *kernels, const char *variant, const NN_Nearest nearest,
+		const Center_SoA *soa, const RGB_Pixel8 *pixel )
+{
+ double dist, ref_dist;
+ const int index = nearest ( soa, pixel, &dist );
+ const int ref_index = nearest_scalar ( soa, pixel, &ref_dist );
+
+ if ( index != ref_index || dist != ref_dist )
+  {
+   fprintf ( stderr, "%s %s, %d centers, pixel ( %d, %d, %d ): center %d ( %.17g ) instead of %d ( %.17g )\n",
+	     kernels->name, variant, soa->num_colors, pixel->red, pixel->green, pixel->blue,
+	     index, dist, ref_index, ref_dist );
+   num_failures++;
+  }
+}
+
+static void
+check_nearest2 ( const NN_Kernels *kernels, const Center_SoA *soa, const RGB_Pixel8 *pixel )
+{
+ double dist, dist2, ref_dist, ref_dist2;
+ const int index = kernels->nearest2 ( soa, pixel, &dist, &dist2 );
+ const int ref_index = nearest2_scalar ( soa, pixel, &ref_dist, &ref_dist2 );
+
+ if ( index != ref_index || dist != ref_dist || dist2 != ref_dist2 )
+  {
+   fprintf ( stderr, "%s nearest2, %d centers, pixel ( %d, %d, %d ): center %d ( %.17g, %.17g ) instead of %d ( %.17g, %.17g )\n",
+	     kernels->name, soa->num_colors, pixel->red, pixel->green, pixel->blue,
+	     index, dist, dist2, ref_index, ref_dist, ref_dist2 );
+   num_failures++;
+  }
+}
+
+static void
+test_nearest ( const NN_Kernels *kernels, const int num_colors, const bool integral,
+	       const bool duplicate, Arena *arena )
+{
+ RGB_Pixel8 pixel;
+ RGB_Cluster *clusters = ( RGB_Cluster * ) arena_alloc ( arena, num_colors * sizeof ( RGB_Cluster ) );
+ Center_SoA soa;
+
+ make_centers ( clusters, num_colors, integral, duplicate );
+
+ for ( int t = 0; t < NUM_PIXEL_TESTS; t++ )
+  {
+   /* Every fourth pixel sits halfway between two centers, every fourth one on a center */
+   if ( integral && t % 4 == 0 && 1 < num_colors )
+    {
+     pixel = tied_pixel ( clusters, num_colors );
+    }
+   else if ( integral && t % 4 == 1 )
+    {
+     const RGB_Pixel center = clusters[rng_next ( ) % num_colors].center;
+
+     pixel.red = center.red;
+     pixel.green = center.green;
+     pixel.blue = center.blue;
+    }
+   else
+    {
+     pixel = rng_pixel ( );
+    }
+
+   soa_init ( &soa, clusters, num_colors, arena );
+   check_nearest ( kernels, "nearest", kernels->nearest, &soa, &pixel );
+
+   if ( 1 < num_colors )
+    {
+     check_nearest2 ( kernels, &soa, &pixel );
+    }
+
+   for ( int b = 0; b < NUM_FIXED; b++ )
+    {
+     if ( soa.num_padded == SOA_PAD << b )
+      {
+       check_nearest ( kernels, "nearest_fixed", kernels->nearest_fixed[b], &soa, &pixel );
+      }
+    }
+  }
+}
+
+/*
+   Maximin passes over NUM_PIXELS pixels: random ones, or runs of a few
+   repeated ones if TIED, so that the largest distance is shared by
+   pixels in different lanes and in the tail
+ */
+static void
+test_maximin ( const NN_Kernels *kernels, const int num_pixels, const bool tied )
+{
+ int index, ref_index;
+ double max_dist, ref_max_dist;
+ RGB_Pixel center;
+ RGB_Pixel8 *pixels = ( RGB_Pixel8 * ) malloc ( num_pixels * sizeof ( RGB_Pixel8 ) );
+ double *nc_dist = ( double * ) malloc ( num_pixels * sizeof ( double ) );
+ double *ref_nc_dist = ( double * ) malloc ( num_pixels * sizeof ( double ) );
+
+ if ( !pixels || !nc_dist || !ref_nc_dist )
+  {
+   fprintf ( stderr, "Unable to allocate memory!\n" );
+   exit ( EXIT_FAILURE );
+  }
+
+ for ( int i = 0; i < num_pixels; i++ )
+  {
+   pixels[i] = tied && 0 < i && rng_next ( ) % 4 ? pixels[rng_next ( ) % i] : rng_pixel ( );
+   nc_dist[i] = ref_nc_dist[i] = MAX_RGB_DIST;
+  }
+
+ /* Successive centers, as in maximin, the first ones with fractional channels */
+ for ( int pass = 0; pass < 8; pass++ )
+  {
+   center.red = rng_channel ( 4 <= pass );
+   center.green = rng_channel ( 4 <= pass );
+   center.blue = rng_channel ( 4 <= pass );
+
+   index = kernels->maximin_pass ( pixels, num_pixels, &center, nc_dist, &max_dist );
+   ref_index = maximin_pass_scalar ( pixels, num_pixels, &center, ref_nc_dist, &ref_max_dist );
+
+   if ( index != ref_index || max_dist != ref_max_dist )
+    {
+     fprintf ( stderr, "%s maximin_pass, %d pixels, pass %d: pixel %d ( %.17g ) instead of %d ( %.17g )\n",
+	       kernels->name, num_pixels, pass, index, max_dist, ref_index, ref_max_dist );
+     num_failures++;
+    }
+
+   for ( int i = 0; i < num_pixels; i++ )
+    {
+     if ( nc_dist[i] != ref_nc_dist[i] )
+      {
+       fprintf ( stderr, "%s maximin_pass, %d pixels, pass %d: distance of pixel %d is %.17g instead of %.17g\n",
+		 kernels->name, num_pixels, pass, i, nc_dist[i], ref_nc_dist[i] );
+       num_failures++;
+       break;
+      }
+    }
+  }
+
+ free ( pixels );
+ free ( nc_dist );
+ free ( ref_nc_dist );
+}
+
+int
+main ( void )
+{
+ const int level = cpu_kernel_level ( );
+ const int sizes[] = { 300, 383, 384, 385, 511, 512, 513, 1000 };
+ const int pixel_counts[] = { 1000, 1001, 1002, 1003, 1004, 1005, 1006, 1007, 4099 };
+ const NN_Kernels *kernels;
+ Arena arena;
+
+ arena_init ( &arena );
+
+ for ( int k = 1; k <= level; k++ )
+  {
+   kernels = &kernel_table[k];
+   printf ( "Kernel '%s': ", kernels->name );
+   fflush ( stdout );
+
+   for ( int c = 0; c < 4; c++ )
+    {
+     const bool integral = c & 1;
+     const bool duplicate = c & 2;
+
+     /* Every size up to past the largest fixed-size kernel, then some larger ones */
+     for ( int num_colors = 1; num_colors <= ( SOA_PAD << ( NUM_FIXED - 1 ) ) + SOA_PAD; num_colors++ )
+      {
+       test_nearest ( kernels, num_colors, integral, duplicate, &arena );
+       arena_reset ( &arena );
+      }
+
+     for ( int num_colors : sizes )
+      {
+       test_nearest ( kernels, num_colors, integral, duplicate, &arena );
+       arena_reset ( &arena );
+      }
+    }
+
+   /* Every pixel count up to several vector widths, then a few remainders of larger ones */
+   for ( int num_pixels = 1; num_pixels <= 80; num_pixels++ )
+    {
+     test_maximin ( kernels, num_pixels, false );
+     test_maximin ( kernels, num_pixels, true );
+    }
+
+   for ( int num_pixels : pixel_counts )
+    {
+     test_maximin ( kernels, num_pixels, false );
+     test_maximin ( kernels, num_pixels, true );
+    }
+
+   printf ( "%s\n", num_failures ? "FAILED" : "ok" );
+  }
+
+ if ( level == 0 )
+  {
+   printf ( "No vectorized kernel on this CPU; nothing to test\n" );
+  }
+
+ arena_free ( &arena );
+
+ return num_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}